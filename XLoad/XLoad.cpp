@@ -4,32 +4,286 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <charconv>
 #include <vector>
 #include <array>
 #include <cassert>
-
-// FTDI
-#include "FTDI\ftd2xx.h"    // includes 'windows.h' (namespaced)
+#include <cstdint>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <deque>
+#include <functional>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <coroutine>
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+
+// Winsock (before 'windows.h')
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#include <windows.h>
+
+// Device access
+#include "xload.hpp"
+#include "xload_protocol.hpp"
+#include "xload_params.hpp"
+#include "xload_task.hpp"
+#include "xload_ring.hpp"
+
+// SIMD
+#if defined( _M_IX86 ) || defined( _M_X64 ) || defined( __SSE2__ )
+#define XLOAD_SSE2
+#include <emmintrin.h>
+#endif
 
 
 // Defines
 #define BAUDRATE_IMG        500000          // Baudrate when using the image loader
 #define BAUDRATE            12000000        // Baudrate for terminal
-#define PRG_BUFFER          512             // Buffer size
-#define NUM_PROGRAMS        128             // EEPROM programs
-#define OK_CODE             0x00            // RET code (42 for XFM1, 00 for XFM2/XVA1)
+#define PRG_BUFFER          XLOAD_PROGRAM_SIZE  // Buffer size
+#define NUM_PROGRAMS        XLOAD_NUM_PROGRAMS  // EEPROM programs
 #define LATENCY_STD         16              // milliseconds, latency timer for the FTDI
 #define LATENCY_RT          0               // realtime (high driver CPU usage)
+#define PROGRAM_NAME_OFFSET 480             // Program name location inside a program
+#define PROGRAM_NAME_LEN    24              // Program name length
+#define BANK_SIZE           ( NUM_PROGRAMS * PRG_BUFFER )
+#define DAEMON_PIPE         "\\\\.\\pipe\\XLoad"  // Local daemon endpoint
+#define PIPELINE_DEPTH      64              // Commands in flight, see xload_submit()
+#define SKETCH_SIZE         ( PRG_BUFFER / 8 )  // Coarse program signature, one sum per 8 parameters
+#define ARGS_ANY            0xFFFFFFFF      // CommandSpec::max_args without a limit
+#define AUTOMATE_FRAME_US   125             // USB 2.0 microframe, events within one share a write (automate)
+#define AUTOMATE_SPIN_US    2000            // waits shorter than this spin instead of sleeping
+#define AUTOMATE_LEAD_MS    20              // from starting the playback thread to time 0
+#define WATCH_PERIOD_MS     100             // default 'watch' poll period
+#define HISTORY_BLOCK       64              // bytes per shared block of a program snapshot
+#define HISTORY_BLOCKS      ( PRG_BUFFER / HISTORY_BLOCK )
+#define HISTORY_SIZE        10000           // program snapshots kept for undo
+#define WATCH_DEBOUNCE_MS   5               // 'i --watch': quiet time after a write before the file is read
+#define GROUP_FRAME_US      125             // USB 2.0 microframe, the write spread between members of a device group
+#define GROUP_LEAD_US       1000            // from posting a group command to its members writing it
+#define GROUP_TIMEOUT_MS    2000            // for the answers of a group command, from its release
+#define AUDIO_FRAME         6               // bytes per sample frame, 24-bit stereo
+#define AUDIO_CHUNK         ( 64 * AUDIO_FRAME )    // stream read size, the resolution of take marks
+#define TAKE_RING           ( 96000 * AUDIO_FRAME ) // capture ring, one second of audio in whole chunks
+#define TAKE_BLOCK          ( 64 * 1024 )           // take file write size
+#define TAKE_EXTENT         ( 64 * 1024 * 1024 )    // take file space reserved at a time, two minutes of audio
+#define TAKE_COMMIT_MS      1000                    // default period of take header commits, what a crash may lose
+#define TAKE_COMMIT_MIN_MS  50                      // shortest one: every commit is two flushes
+#define WAV_DATA            4096                    // offset of the audio in a take file, behind a JUNK chunk
 
 // Types
 using namespace std;
 using uchar = unsigned char;
 using uint = unsigned int;
 
-enum class FLASH_TYPE {
-    IMAGE = 0,
-    TUNING = 1,
-    WAVETABLE
+// Local program collection (bank and program files), searched by 'similar'
+struct LibraryFile {
+    string name;
+    uint programs;                          // 1 for program files, NUM_PROGRAMS for bank files
+};
+
+struct LibraryEntry {
+    uint file;                              // index into ProgramLibrary::files
+    uint slot;                              // program index within that file
+};
+
+struct ProgramLibrary {
+    vector<LibraryFile> files;
+    vector<LibraryEntry> entries;
+    vector<uchar> programs;                 // entries.size() * PRG_BUFFER, one program after the other
+    vector<uint16_t> sketches;              // entries.size() * SKETCH_SIZE, see ComputeSketch()
+};
+
+// Host copy of the active program, see ShadowProgram()
+struct ProgramShadow {
+    bool valid = false;
+    uchar program[ PRG_BUFFER ];
+};
+
+// Program snapshot: copy-on-write blocks, shared with the snapshots they did not change, see RecordHistory()
+using ProgramBlock = array<uchar, HISTORY_BLOCK>;
+
+struct ProgramSnapshot {
+    uint32_t blocks[ HISTORY_BLOCKS ];      // into ProgramHistory::blocks
+    uint64_t number;                        // never reused, also after an undo
+};
+
+struct ProgramHistory {
+    vector<ProgramBlock> blocks;            // shared by the snapshots
+    vector<uint32_t> refs;                  // snapshots using each block, 0: free
+    vector<uint32_t> unused;                // free blocks
+    deque<ProgramSnapshot> entries;         // by number
+    map<uint64_t, string> names;            // set by 'snap'
+    uint64_t next = 0;                      // number of the next snapshot
+    size_t position = 0;                    // the snapshot the device is at
+    uint64_t ab[ 2 ] = {};                  // 'ab' pair, by number
+    bool ab_set = false;
+};
+
+// Latest-value-wins parameter writes, sent by their own thread, see 'queue'
+struct ParamQueue {
+    bool enabled = false;                   // changed by the command thread only
+    mutex lock;                             // everything below
+    condition_variable changed;
+    mutex device;                           // held by the flusher while it writes, and by other commands while enabled
+    bool stop = false;
+    bool busy = false;                      // a batch is being written
+    uchar values[ PRG_BUFFER ];
+    bool pending[ PRG_BUFFER ] = {};
+    chrono::steady_clock::time_point since[ PRG_BUFFER ];  // when the pending value was first queued
+    vector<uint16_t> order;                 // pending parameters, oldest first
+    thread flusher;
+
+    uint64_t received = 0;
+    uint64_t superseded = 0;                // replaced before being sent
+    uint64_t sent = 0;
+    uint64_t writes = 0;
+    uint64_t failed = 0;
+    size_t peak = 0;                        // most pending parameters
+    chrono::nanoseconds latency{};          // queued to sent, summed
+    chrono::nanoseconds worst{};
+};
+
+// One device of a group, with its own link and I/O thread
+struct GroupMember {
+    string serial;
+    bool shared = false;                    // the terminal's device: g_device's link, reopened with it
+    shared_ptr<xload::Device> device;       // otherwise, also used by other groups with the same member
+    thread io;
+    xload::Status status = XLOAD_OK;        // of the last command
+    bool timed_out = false;                 // its answers did not come within GROUP_TIMEOUT_MS
+    chrono::steady_clock::time_point start; // its write began
+    chrono::steady_clock::time_point sent;  // its write returned
+};
+
+// Commands encoded once for every member of a group
+struct GroupFrame {
+    vector<uchar> data;
+    vector<size_t> commands;                // offset of every command in 'data' that answers
+    vector<xload::protocol::Descriptor> replies;    // and its opcode
+    size_t reply = 0;                       // answer bytes in all
+    chrono::steady_clock::time_point release;   // members write no earlier than this
+};
+
+struct DeviceGroup {
+    vector<unique_ptr<GroupMember>> members;
+    mutex lock;                             // everything below
+    condition_variable changed;
+    GroupFrame frame;                       // not changed until every member finished it
+    uint64_t generation = 0;                // frames posted
+    size_t finished = 0;                    // members done with the last one
+    bool stop = false;
+
+    uint64_t frames = 0;
+    uint64_t late = 0;                      // frames with more than GROUP_FRAME_US write spread
+    chrono::nanoseconds spread{};           // summed
+    chrono::nanoseconds worst{};
+
+    ~DeviceGroup();
+};
+
+// Command written to the device during a take
+struct TakeMark {
+    uint64_t sample;                        // sample frames recorded when it was written
+    chrono::nanoseconds at;                 // from the start of the take
+    string command;
+    size_t labels = 0;                      // size of AudioTake::labels up to its own label
+};
+
+// Recording in progress, see StartTake()
+struct AudioTake {
+    atomic<bool> active = false;            // changed by the command thread only
+    string file;
+    HANDLE out = INVALID_HANDLE_VALUE;
+    vector<uchar> block;                    // the file block at 'tail', TAKE_BLOCK bytes, filled up to 'tail'
+    uint64_t reserved = 0;                  // file size, grown TAKE_EXTENT at a time
+    uint64_t committed = 0;                 // audio bytes the header counts, on disk
+    chrono::milliseconds commit_period{ TAKE_COMMIT_MS };
+    bool write_failed = false;
+    uchar* ring = nullptr;                  // TAKE_RING bytes, the stream is read straight into it
+    vector<uchar> memory;                   // the ring
+    xload::ring::Writer shared;             // a copy of it other processes read ('. filename share')
+    atomic<uint64_t> head = 0;              // bytes received into the ring
+    atomic<uint64_t> tail = 0;              // bytes written from it to the file
+    atomic<bool> stop = false;
+    atomic<bool> finished = false;          // the stream has stopped
+    xload::CancelSource waiter;             // cancelled by 'link' when it stops, set by WaitTake()
+    xload::Status status = XLOAD_OK;
+    uint64_t dropped = 0;                   // bytes received while the ring was full
+    chrono::steady_clock::time_point started;
+    thread link;                            // stream to ring
+    thread disk;                            // ring to file
+    mutex lock;                             // the marks, and waking 'disk'
+    condition_variable ready;
+    vector<TakeMark> marks;
+    vector<uchar> cues;                     // 'cue ' chunk points, one per mark, built as marks come
+    vector<uchar> labels;                   // 'adtl' list 'labl' chunks, likewise
+};
+
+// Programs to write and the bank they come from, left by 'diff_bank' for 'put_bank plan'
+struct TransferPlan {
+    string source;                          // first diff_bank operand, the bank the plan applies to
+    vector<uchar> from;                     // its contents when compared
+    vector<uchar> bank;                     // BANK_SIZE result image
+    vector<uint> slots;                     // programs of 'bank' that differ from 'from'
+};
+
+// Host copy of a device's EEPROM bank, see BankCachePath()
+struct BankCache {
+    string serial;                          // device the bank belongs to
+    bool valid = false;
+    bool dirty = false;                     // changed since it was saved, see SaveBankCache()
+    bool current = false;                   // read or written by this process, not only loaded from the file
+    vector<uchar> bank;                     // BANK_SIZE
+};
+
+// Column-major copy of the library for 'query', one column of entries.size() values per parameter
+struct ColumnStore {
+    size_t rows = 0;
+    vector<uchar> columns;
+};
+
+// Command line split into views of the line, see Tokenize(); valid while the line is
+struct Command {
+    string_view line;
+    string_view name;
+    string_view rest;                       // everything after the name, as typed
+    vector<string_view> args;               // without a trailing '-f'
+    vector<uint> numbers;                   // args[ i ] as a number (or parameter index) where the schema asks
+                                            // for one, 0 otherwise
+    bool force = false;                     // trailing '-f': read the device, not the shadow
+    bool labels = false;                    // trailing '-l': label parameters, see xload_params.hpp
+};
+
+enum CommandFlags : uint {
+    CMD_FORCE = 1,                          // takes a trailing '-f'
+    CMD_PAIRS = 2,                          // arguments come in pairs
+    CMD_QUIT = 4,                           // ends the session
+    CMD_LABELS = 8,                         // takes a trailing '-l'
+    CMD_QUEUED = 16,                        // runs next to the parameter queue instead of draining it first
+    CMD_GROUP = 32,                         // can go to a device group ('@name command')
+    CMD_TAKE = 64,                          // can run while recording: sends nothing that answers
+    CMD_CONSOLE = 128,                      // runs until ESC at the console: not for daemon clients
+    CMD_FILES = 256,                        // writes files its arguments name: not for daemon clients
+};
+
+// Entry of COMMANDS: what ProcessLine() checks before calling 'run'
+struct CommandSpec {
+    string_view name;
+    void ( *run )( const Command& cmd );
+    uint min_args;
+    uint max_args;                          // ARGS_ANY for no limit
+    string_view schema;                     // per argument 'n' number, 'p' parameter (number or name) or 'w' word;
+                                            // a trailing '*' repeats the whole schema
+    uint flags;                             // CMD_*
 };
 
 
@@ -39,10 +293,29 @@ enum class FLASH_TYPE {
 void Terminal();
 void Color( int color );
 void PrintError( const char error[] );
+void CommandError( const char error[] );
+void CommandError( const char error[], xload::Status st );
 void CloseDevice();
-int ProcessLine( string s );
+int ProcessLine( string_view line );
+uint RunCommands( const vector<string>& lines, bool keep_going );
+int Daemon( const string& tcp, bool remote );
+int Client( const string& tcp, const vector<string>& commands, bool timing );
+bool ReadScript( const string& filename, vector<string>& lines );
 int OpenDevice( uint baudrate, uint latency );
-int SetFlashDump( string filename, uint baudrate, FLASH_TYPE flash_type );
+int SetFlashDump( string filename, uint baudrate, xload_flash_type flash_type );
+void SetBankCache( const uchar* bank );
+void UpdateBankCache( uint slot, const uchar* program );
+void SaveBankCache();
+bool LoadBankCache();
+bool LoadBankSource( const string& name, vector<uchar>& bank );
+void InvalidateBankCache();
+int DumpProgram( uchar* buffer );
+void StopParamQueue();
+bool ParseEndpoint( const string& endpoint, sockaddr_in& address );
+void WatchProgramFile( const string& file );
+void MarkTake( const uint16_t* params, const uchar* values, size_t count );
+void StopTake();
+void WaitTake();
 
 
 // Error messages
@@ -50,24 +323,80 @@ int SetFlashDump( string filename, uint baudrate, FLASH_TYPE flash_type );
 // main
 const char ERROR_PORT[] = "Error opening port.";
 const char ERROR_PARAMETERS[] = "Insufficient parameters.";
+const char ERROR_OPENING_SCRIPT[] = "Error opening script file.";
+const char ERROR_DAEMON_RUNNING[] = "A daemon is already serving the device.";
+const char ERROR_DAEMON_TCP[] = "Error opening TCP endpoint.";
+const char ERROR_DAEMON_REMOTE[] = "TCP endpoint not on loopback, clients are not authenticated (-remote allows it).";
+const char ERROR_DAEMON_CONNECT[] = "Error connecting to daemon.";
 
 // terminal
 const char ERROR_CONNECTING_DEVICE[] = "   Couldn't connect to device.\n";
 const char ERROR_SETTING_DEVICE[] = "   Error setting device parameters.\n";
 const char ERROR_INITIALIZING[] = "   Error initializing program.\n";
+const char ERROR_INITIALIZING_BANK[] = "   Error initializing bank.\n";
+const char ERROR_READING_BANK[] = "   Error reading bank.\n";
+const char ERROR_WRITING_BANK[] = "   Error writing bank.\n";
+const char ERROR_WRITING_PARAMS[] = "   Error writing parameters.\n";
+const char ERROR_READING_PARAMS[] = "   Error reading parameters.\n";
+const char ERROR_READING_CHANNEL[] = "   Error reading channel.\n";
+const char ERROR_WRITING_IMAGE[] = "   Error writing image.\n";
+const char ERROR_IMAGE_PAGES[] = "   Pages not acknowledged: ";
+const char ERROR_UNKNOWN_COMMAND[] = "   Unknown command (see 'h').\n";
+const char ERROR_DAEMON_COMMAND[] = "   Not for daemon clients: waits for ESC at its console, or writes files.\n";
 const char ERROR_INVALID_PROGRAM_NUMBER[] = "   Invalid program number (0-127).\n";
 const char ERROR_INVALID_PARAM_NUMBER[] = "   Invalid parameter number (0-511).\n";
-const char ERROR_INVALID_PARAM_VALUE[] = "   Invalid parameter value (0-255).\n";
+const char ERROR_PARAM_RANGE[] = "   Value out of range for ";
 const char ERROR_READING_PROGRAM[] = "   Error reading program.\n";
 const char ERROR_WRITING_PROGRAM[] = "   Error writing program.\n";
 const char ERROR_WRITING_CHANNEL[] = "   Error writing channel.\n";
 const char ERROR_OPENING_FILE[] = "   Error opening file.\n";
 const char ERROR_INVALID_CHANNEL[] = "   Invalid channel (0 = omni, 1-16).\n";
 const char ERROR_LOADING_PROGRAM[] = "   Error loading program.\n";
+const char ERROR_LIBRARY_EMPTY[] = "   Library is empty (lib add <path>).\n";
+const char ERROR_INVALID_RESULT[] = "   Invalid result number (see 'similar').\n";
+const char ERROR_INVALID_QUERY[] = "   Invalid query (see 'h').\n";
+const char ERROR_INVALID_RULE[] = "   Invalid rule at line ";
+const char ERROR_BANK_FILE_SIZE[] = "   Not a bank file (65536 bytes): ";
+const char ERROR_NO_PLAN[] = "   No transfer plan (see 'diff_bank').\n";
+const char ERROR_INVALID_FRACTION[] = "   Invalid fraction (0-1).\n";
+const char ERROR_PLAN_STALE[] = "   Device bank is not the one 'diff_bank' compared, run it again.\n";
+const char ERROR_CANCELLED[] = "   Cancelled.\n";
+const char ERROR_INVALID_ARGUMENTS[] = "   Invalid arguments (see 'h').\n";
+const char ERROR_INVALID_EVENT[] = "   Invalid event at line ";
+const char ERROR_QUEUE_WRITE[] = "   Queued parameter writes failed: ";
+const char ERROR_WATCH_CONNECT[] = "   Error connecting to the watch endpoint.\n";
+const char ERROR_WATCH_SINK[] = "   Error writing watch events, stopped.\n";
+const char ERROR_INVALID_SNAPSHOT[] = "   No such snapshot (see 'history').\n";
+const char ERROR_AUTOMATION_WRITE[] = "   Error writing parameters, playback stopped.\n";
+const char ERROR_NO_GROUP[] = "   No such group (see 'group').\n";
+const char ERROR_GROUP_DEVICE[] = "   Error opening group member ";
+const char ERROR_GROUP_COMMAND[] = "   Groups take s, i, r and * only.\n";
+const char ERROR_GROUP_MEMBER[] = "   Group command failed on ";
+const char ERROR_GROUP_TIMEOUT[] = "   No answer in time from ";
+const char ERROR_RECORDING[] = "   Not while recording ('.' stops).\n";
+const char ERROR_NOT_RECORDING[] = "   Not recording.\n";
+const char ERROR_TAKE_STREAM[] = "   Recording stopped: ";
+const char ERROR_TAKE_WRITE[] = "   Error writing the recording, it ends early.\n";
+const char ERROR_TAKE_RING[] = "   Shared audio ring unavailable, or another process records into it.\n";
+const char ERROR_TAKE_SHADOW[] = "   Error reading the active program, recording needs a copy of it.\n";
 
 // Globals
 
-FT_HANDLE ft_port;
+xload::Device g_device;
+uint g_command_errors = 0;                  // errors reported by commands, see CommandError()
+string g_device_serial;                     // serial number of the open device
+BankCache g_bank_cache;
+ProgramShadow g_shadow;
+double g_inject_fraction = 0.25;            // parameter batches larger than this part of a program are injected
+TransferPlan g_plan;                        // last 'diff_bank' result, consumed by 'put_bank plan'
+ProgramLibrary g_library;
+vector<uint> g_similar;                     // library entries found by the last 'similar', best first
+ColumnStore g_columns;                      // rebuilt by BuildColumns() when the library changed
+ProgramHistory g_history;                   // snapshots of the host copy, for undo and 'ab'
+ParamQueue g_param_queue;                   // after g_device: stops before the device closes
+map<string, unique_ptr<DeviceGroup>, less<>> g_groups;  // after g_device: members may use its link
+AudioTake g_take;                           // '.' recording, runs next to the terminal
+thread_local string_view g_command_line;    // line ProcessLine() is running, labels take marks
 
 
 //---------------------------------------------------------------------------------------------------------------------
@@ -77,6 +406,10 @@ FT_HANDLE ft_port;
 //
 // Options: 
 //          -img:   Load flash image file
+//          -f:     Run script file ('-' for stdin), -k to continue after errors
+//          -daemon: Serve the device to local clients, see Daemon()
+//          -c:     Forward commands to the daemon
+//          Any other arguments are commands, run in one device session
 //---------------------------------------------------------------------------------------------------------------------
 int main( int argc, char** argv ) {
     int err = 0;
@@ -89,6 +422,7 @@ int main( int argc, char** argv ) {
             }
 
             Terminal();
+            CloseDevice();
         }
         else {
             err = -1;
@@ -100,7 +434,7 @@ int main( int argc, char** argv ) {
         if( arg1 == "-img" ) {
             Color( 10 );
             cout << endl << "Loading Image file:" << endl;
-            err = SetFlashDump( argv[ 2 ], BAUDRATE_IMG, FLASH_TYPE::IMAGE );
+            err = SetFlashDump( argv[ 2 ], BAUDRATE_IMG, XLOAD_FLASH_IMAGE );
 
             if( err == 0 ) {
                 cout << endl << "done." << endl;
@@ -111,12 +445,74 @@ int main( int argc, char** argv ) {
             cout <<
                 "\nUsage:\tXLoad [ option ]\n\nOptions:\n"
                 "\t-img filename\t\tLoad Synthesizer Image\n"
-                "\t\"<command>\"\t\tRun command\n\n\n"
+                "\t\"<command>\" ...\t\tRun commands\n"
+                "\t-f script [-k]\t\tRun script file ('-' for stdin), -k continues after errors\n"
+                "\t-daemon [-tcp [addr:]port [-remote]]\n"
+                "\t\t\t\tServe the device to clients on " DAEMON_PIPE " (and loopback TCP, any address\n"
+                "\t\t\t\twith -remote: clients are not authenticated)\n"
+                "\t-c [-tcp [host:]port] [-t] [\"<command>\" ...]\n"
+                "\t\t\t\tRun commands (or stdin) on the daemon, -t shows timings\n\n\n"
                 "Examples:\n\tXLoad \"get_bank d:/bank1.bank\"\n"
                 "\tXLoad \"* 5\"\n"
+                "\tXLoad \"r 3\" \"s 10 64\" \"w 3\"\n"
+                "\tXLoad -f d:/setup.xl\n"
                 "\tXLoad \". d:/rec.wav\"\n";
         }
+        else if( arg1 == "-daemon" || arg1 == "-c" ) {
+            string tcp;
+            bool timing = false;
+            bool remote = false;
+            vector<string> commands;
+
+            for( int i = 2; i < argc; ++i ) {
+                string arg = argv[ i ];
+                if( arg == "-tcp" && i + 1 < argc )
+                    tcp = argv[ ++i ];
+                else if( arg == "-t" )
+                    timing = true;
+                else if( arg == "-remote" )
+                    remote = true;
+                else
+                    commands.push_back( arg );
+            }
+
+            if( arg1 == "-c" )
+                return Client( tcp, commands, timing );
+
+            err = OpenDevice( BAUDRATE, LATENCY_STD );
+            if( err ) {
+                PrintError( ERROR_PORT );
+                return err;
+            }
+
+            Color( 10 );
+            err = Daemon( tcp, remote );
+            CloseDevice();
+
+            Color( 15 );
+            return err;
+        }
         else {
+            // Commands from a script (-f), or the command line; '-k' keeps going after errors
+            vector<string> lines;
+            bool keep_going = false;
+            bool script = false;
+
+            for( int i = 1; i < argc; ++i ) {
+                string arg = argv[ i ];
+                if( arg == "-k" )
+                    keep_going = true;
+                else if( arg == "-f" && i + 1 < argc ) {
+                    script = true;
+                    if( !ReadScript( argv[ ++i ], lines ) ) {
+                        PrintError( ERROR_OPENING_SCRIPT );
+                        return 1;
+                    }
+                }
+                else
+                    lines.push_back( arg );
+            }
+
             err = OpenDevice( BAUDRATE, LATENCY_STD );
             if( err ) {
                 PrintError( ERROR_PORT );
@@ -125,9 +521,25 @@ int main( int argc, char** argv ) {
 
             Color( 10 );
             cout << endl;
-            ProcessLine( argv[ 1 ] );
 
+            // A single command runs as before, lists are timed
+            uint failed = 0;
+            if( !script && lines.size() == 1 ) {
+                uint errors = g_command_errors;
+                ProcessLine( lines[ 0 ] );
+                failed = g_command_errors - errors;
+            }
+            else
+                failed = RunCommands( lines, keep_going );
+
+            // A take that ends in an error fails the run too
+            uint errors = g_command_errors;
+            WaitTake();
+            failed += g_command_errors - errors;
             CloseDevice();
+
+            Color( 15 );
+            return failed ? 1 : 0;
         }
     }
 
@@ -142,7 +554,7 @@ int main( int argc, char** argv ) {
     }
 
     Color( 15 );
-    return 0;
+    return err > 0 ? err : 0;
 }
 
 void Color( int color ) {
@@ -155,6 +567,19 @@ void PrintError( const char error[] ) {
     Color( 15 );
 }
 
+// Errors of terminal commands, counted so scripts can stop on them
+void CommandError( const char error[] ) {
+    cout << error;
+    g_command_errors++;
+}
+
+// Same, with what the device library reported: 'error' ends in ".\n", the reason goes before it
+void CommandError( const char error[], xload::Status st ) {
+    string_view text = error;
+    cout << text.substr( 0, text.size() - 2 ) << ": " << xload::StatusText( st ) << ".\n";
+    g_command_errors++;
+}
+
 //---------------------------------------------------------------------------------------------------------------------
 // Terminal code
 //
@@ -191,7 +616,7 @@ vector<string> split( string& text, string brakes ) {
     return move( out );
 }
 
-bool is_numeric( string str ) {
+bool is_numeric( string_view str ) {
     int iteration = 0;
     bool result = true;
 
@@ -210,209 +635,457 @@ bool is_numeric( string str ) {
 }
 
 //---------------------------------------------------------------------------------------------------------------------
-// OpenDevice(), CloseDevice()
+// Command lines
 //
+// A line is split once into views of it, numbers converted with from_chars and checked against the command's
+// CommandSpec; the Command's vectors keep their capacity, so a line costs no allocation once they have grown.
 //---------------------------------------------------------------------------------------------------------------------
-int OpenDevice( uint baud_rate, uint latency ) {
-    FT_STATUS st;
-
-    // Debug only
-    //
-
-    if( 0 ) {
-        DWORD numDevs;
-        st = FT_CreateDeviceInfoList( &numDevs );
-
-        if( numDevs > 0 ) {
-            FT_DEVICE_LIST_INFO_NODE* devInfo;
-
-            // allocate storage for list based on numDevs
-            devInfo = (FT_DEVICE_LIST_INFO_NODE*) malloc( sizeof( FT_DEVICE_LIST_INFO_NODE ) * numDevs );
-
-            // get the device information list
-
-            st = FT_GetDeviceInfoList( devInfo, &numDevs );
-            if( st == FT_OK ) {
-                for( uint i = 0; i < numDevs; i++ ) {
-                    printf( "Dev %d:\n", i );
-                    printf( " Flags=0x%x\n", devInfo[ i ].Flags );
-                    printf( " Type=0x%x\n", devInfo[ i ].Type );
-                    printf( " ID=0x%x\n", devInfo[ i ].ID );
-                    printf( " LocId=0x%x\n", devInfo[ i ].LocId );
-                    printf( " SerialNumber=%s\n", devInfo[ i ].SerialNumber );
-                    printf( " Description=%s\n", devInfo[ i ].Description );
-                    //printf( " ftHandle=0x%x\n", devInfo[ i ].ftHandle );
-                }
+void Tokenize( string_view line, Command& cmd ) {
+    cmd.line = line;
+    cmd.name = cmd.rest = {};
+    cmd.args.clear();
+    cmd.numbers.clear();
+    cmd.force = false;
+    cmd.labels = false;
+
+    size_t pos = 0;
+    while( pos < line.size() ) {
+        size_t end = line.find( ' ', pos );
+        if( end == string_view::npos )
+            end = line.size();
+
+        if( end > pos ) {
+            if( cmd.name.empty() ) {
+                cmd.name = line.substr( pos, end - pos );
+                cmd.rest = line.substr( end < line.size() ? end + 1 : end );
             }
+            else
+                cmd.args.push_back( line.substr( pos, end - pos ) );
         }
+
+        pos = end + 1;
     }
+}
 
+// Whole token as a decimal number
+bool ParseNumber( string_view token, uint& value ) {
+    auto result = from_chars( token.data(), token.data() + token.size(), value );
+    return result.ec == errc() && result.ptr == token.data() + token.size();
+}
 
-    // Open port
-    //
+// Parameter by name (xload_params.hpp), or number; 'p37' also names parameter 37
+bool ParseParam( string_view token, uint& param ) {
+    if( auto p = xload::params::Find( token ) ) {
+        param = p->index;
+        return true;
+    }
 
-    st = FT_OpenEx( (PVOID) "Digilent Adept USB Device B", FT_OPEN_BY_DESCRIPTION, &ft_port );
+    if( !token.empty() && ( token[ 0 ] == 'p' || token[ 0 ] == 'P' ) )
+        token.remove_prefix( 1 );
 
-    if( st != FT_OK ) {
-        cout << ERROR_CONNECTING_DEVICE;
-        return 1;
+    return ParseNumber( token, param );
+}
+
+// Takes trailing '-f' and '-l', checks the argument count and kinds, fills cmd.numbers
+bool CheckArgs( const CommandSpec& spec, Command& cmd ) {
+    while( !cmd.args.empty() ) {
+        if( ( spec.flags & CMD_FORCE ) && cmd.args.back() == "-f" )
+            cmd.force = true;
+        else if( ( spec.flags & CMD_LABELS ) && cmd.args.back() == "-l" )
+            cmd.labels = true;
+        else
+            break;
+
+        cmd.args.pop_back();
     }
 
+    size_t count = cmd.args.size();
+    if( count < spec.min_args || count > spec.max_args || ( ( spec.flags & CMD_PAIRS ) && count % 2 ) )
+        return false;
 
-    // Set port parameters
-    //
+    bool repeat = !spec.schema.empty() && spec.schema.back() == '*';
+    size_t group = repeat ? spec.schema.size() - 1 : spec.schema.size();
+    for( size_t i = 0; i < count; ++i ) {
+        char kind = 'w';
+        if( i < group )
+            kind = spec.schema[ i ];
+        else if( repeat && group )
+            kind = spec.schema[ i % group ];
 
-    st = FT_SetBaudRate( ft_port, baud_rate );
-    st = FT_SetDataCharacteristics( ft_port, FT_BITS_8, FT_STOP_BITS_1, FT_PARITY_NONE );
-    st = FT_SetTimeouts( ft_port, UINT_MAX, UINT_MAX );
-    st = FT_SetLatencyTimer( ft_port, latency );
-    st = FT_SetUSBParameters( ft_port, 4096, 0 );
+        uint value = 0;
+        if( kind == 'n' && !ParseNumber( cmd.args[ i ], value ) )
+            return false;
 
-    if( st != FT_OK ) {
-        cout << ERROR_SETTING_DEVICE;
-        return 1;
-    }
+        if( kind == 'p' && !ParseParam( cmd.args[ i ], value ) )
+            return false;
 
-    return 0;
-}
+        cmd.numbers.push_back( value );
+    }
 
-void CloseDevice() {
-    FT_SetTimeouts( ft_port, 100, 100 );
-    FT_Close( ft_port );
+    return true;
 }
 
 //---------------------------------------------------------------------------------------------------------------------
-// SetFlashDump()
+// Program kernels
 //
+// Distances between 512-byte programs. The program name is not part of the sound, so it is masked out; weights are
+// one 16-bit factor per parameter (0 ignores the parameter).
 //---------------------------------------------------------------------------------------------------------------------
-int SetFlashDump( string filename, uint baudrate, FLASH_TYPE flash_type ) {
+const uchar* SoundMask() {
+    struct Mask {
+        alignas( 16 ) uchar m[ PRG_BUFFER ];
 
-    // Images are loaded using the CMOD_A7_Loader.bit file, which has the COM set at 500kbps
-    //
+        Mask() {
+            memset( m, 0xFF, PRG_BUFFER );
+            memset( &m[ PROGRAM_NAME_OFFSET ], 0, PROGRAM_NAME_LEN );
+        }
+    };
 
-    if( OpenDevice( baudrate, LATENCY_RT ) != 0 ) {
-        return 1;
+    static const Mask mask;
+    return mask.m;
+}
+
+uint64_t DistanceL1( const uchar* a, const uchar* b ) {
+    const uchar* m = SoundMask();
+
+#ifdef XLOAD_SSE2
+    __m128i acc = _mm_setzero_si128();
+    for( uint i = 0; i < PRG_BUFFER; i += 16 ) {
+        __m128i mask = _mm_load_si128( (const __m128i*) &m[ i ] );
+        __m128i va = _mm_and_si128( _mm_loadu_si128( (const __m128i*) &a[ i ] ), mask );
+        __m128i vb = _mm_and_si128( _mm_loadu_si128( (const __m128i*) &b[ i ] ), mask );
+        acc = _mm_add_epi64( acc, _mm_sad_epu8( va, vb ) );
     }
 
-    // Open file
-    ifstream infile;
-    infile.open( filename, ios::in | ios::binary );
-    if( !infile.is_open() ) {
-        cout << ERROR_OPENING_FILE;
-        return 1;
+    return uint64_t( _mm_cvtsi128_si32( acc ) ) + uint64_t( _mm_cvtsi128_si32( _mm_srli_si128( acc, 8 ) ) );
+#else
+    uint64_t sum = 0;
+    for( uint i = 0; i < PRG_BUFFER; ++i )
+        sum += abs( int( a[ i ] & m[ i ] ) - int( b[ i ] & m[ i ] ) );
+
+    return sum;
+#endif
+}
+
+uint64_t DistanceL2( const uchar* a, const uchar* b ) {
+    const uchar* m = SoundMask();
+
+#ifdef XLOAD_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for( uint i = 0; i < PRG_BUFFER; i += 16 ) {
+        __m128i mask = _mm_load_si128( (const __m128i*) &m[ i ] );
+        __m128i va = _mm_and_si128( _mm_loadu_si128( (const __m128i*) &a[ i ] ), mask );
+        __m128i vb = _mm_and_si128( _mm_loadu_si128( (const __m128i*) &b[ i ] ), mask );
+
+        // |a - b| widened to 16 bits, squared and summed in pairs (fits: 512 * 255^2 < 2^31)
+        __m128i d = _mm_or_si128( _mm_subs_epu8( va, vb ), _mm_subs_epu8( vb, va ) );
+        __m128i lo = _mm_unpacklo_epi8( d, zero );
+        __m128i hi = _mm_unpackhi_epi8( d, zero );
+        acc = _mm_add_epi32( acc, _mm_add_epi32( _mm_madd_epi16( lo, lo ), _mm_madd_epi16( hi, hi ) ) );
     }
 
+    acc = _mm_add_epi32( acc, _mm_srli_si128( acc, 8 ) );
+    acc = _mm_add_epi32( acc, _mm_srli_si128( acc, 4 ) );
+    return uint64_t( uint( _mm_cvtsi128_si32( acc ) ) );
+#else
+    uint64_t sum = 0;
+    for( uint i = 0; i < PRG_BUFFER; ++i ) {
+        int d = int( a[ i ] & m[ i ] ) - int( b[ i ] & m[ i ] );
+        sum += d * d;
+    }
 
-    // Prepare file of 0x220000 bytes
-    uint FILE_SIZE;
-    uint pages;
-    uchar cmd_erase, cmd_write;
+    return sum;
+#endif
+}
 
-    switch( flash_type ) {
-        case FLASH_TYPE::IMAGE:
-            FILE_SIZE = 34 * 256 * 256;
-            pages = 34 * 256;
-            cmd_erase = '{';
-            cmd_write = '}';
-            break;
+uint64_t DistanceL1W( const uchar* a, const uchar* b, const uint16_t* w ) {
+#ifdef XLOAD_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for( uint i = 0; i < PRG_BUFFER; i += 16 ) {
+        __m128i va = _mm_loadu_si128( (const __m128i*) &a[ i ] );
+        __m128i vb = _mm_loadu_si128( (const __m128i*) &b[ i ] );
+        __m128i d = _mm_or_si128( _mm_subs_epu8( va, vb ), _mm_subs_epu8( vb, va ) );
+
+        __m128i wlo = _mm_loadu_si128( (const __m128i*) &w[ i ] );
+        __m128i whi = _mm_loadu_si128( (const __m128i*) &w[ i + 8 ] );
+        acc = _mm_add_epi32( acc, _mm_madd_epi16( _mm_unpacklo_epi8( d, zero ), wlo ) );
+        acc = _mm_add_epi32( acc, _mm_madd_epi16( _mm_unpackhi_epi8( d, zero ), whi ) );
+    }
 
-        case FLASH_TYPE::TUNING:
-            FILE_SIZE = 4 * 256 * 128;;
-            pages = 2 * 256;
-            cmd_erase = '#';
-            cmd_write = 't';
-            break;
+    acc = _mm_add_epi32( acc, _mm_srli_si128( acc, 8 ) );
+    acc = _mm_add_epi32( acc, _mm_srli_si128( acc, 4 ) );
+    return uint64_t( uint( _mm_cvtsi128_si32( acc ) ) );
+#else
+    uint64_t sum = 0;
+    for( uint i = 0; i < PRG_BUFFER; ++i )
+        sum += uint64_t( abs( int( a[ i ] ) - int( b[ i ] ) ) ) * w[ i ];
 
-        case FLASH_TYPE::WAVETABLE:
-            FILE_SIZE = 3 * 256 * 1024;
-            pages = 12 * 256;
-            cmd_erase = 'V';
-            cmd_write = 'v';
-            break;
+    return sum;
+#endif
+}
 
-        default:
-            return 2;
+uint64_t DistanceL2W( const uchar* a, const uchar* b, const uint16_t* w ) {
+#ifdef XLOAD_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for( uint i = 0; i < PRG_BUFFER; i += 16 ) {
+        __m128i va = _mm_loadu_si128( (const __m128i*) &a[ i ] );
+        __m128i vb = _mm_loadu_si128( (const __m128i*) &b[ i ] );
+        __m128i d = _mm_or_si128( _mm_subs_epu8( va, vb ), _mm_subs_epu8( vb, va ) );
+
+        for( uint h = 0; h < 2; ++h ) {
+            __m128i d16 = h ? _mm_unpackhi_epi8( d, zero ) : _mm_unpacklo_epi8( d, zero );
+            __m128i w16 = _mm_loadu_si128( (const __m128i*) &w[ i + h * 8 ] );
+
+            // d^2 fits 16 bits unsigned, d^2 * w needs 32: combine low and high product halves
+            __m128i sq = _mm_mullo_epi16( d16, d16 );
+            __m128i plo = _mm_mullo_epi16( sq, w16 );
+            __m128i phi = _mm_mulhi_epu16( sq, w16 );
+            acc = _mm_add_epi32( acc, _mm_unpacklo_epi16( plo, phi ) );
+            acc = _mm_add_epi32( acc, _mm_unpackhi_epi16( plo, phi ) );
+        }
     }
 
-    vector<char> buffer( FILE_SIZE );
-    memset( &buffer[ 0 ], FILE_SIZE, 0 );
+    // Each lane holds at most 128 products of 255^3, which fits an unsigned 32-bit lane
+    alignas( 16 ) uint lanes[ 4 ];
+    _mm_store_si128( (__m128i*) lanes, acc );
+    return uint64_t( lanes[ 0 ] ) + lanes[ 1 ] + lanes[ 2 ] + lanes[ 3 ];
+#else
+    uint64_t sum = 0;
+    for( uint i = 0; i < PRG_BUFFER; ++i ) {
+        uint64_t d = abs( int( a[ i ] ) - int( b[ i ] ) );
+        sum += d * d * w[ i ];
+    }
 
-    // Read data
-    infile.read( &buffer[ 0 ], FILE_SIZE );
+    return sum;
+#endif
+}
 
+// Sketch: the sum of each group of 8 sound parameters. |sum(a) - sum(b)| never exceeds the L1 distance of the group,
+// and (sum(a) - sum(b))^2 / 8 never exceeds its squared L2 distance, so sketch distances are exact lower bounds.
+void ComputeSketch( const uchar* program, uint16_t* sketch ) {
+    const uchar* m = SoundMask();
 
-    DWORD len;
-    FT_STATUS st;
+#ifdef XLOAD_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    for( uint i = 0; i < PRG_BUFFER; i += 16 ) {
+        __m128i mask = _mm_load_si128( (const __m128i*) &m[ i ] );
+        __m128i v = _mm_and_si128( _mm_loadu_si128( (const __m128i*) &program[ i ] ), mask );
+        __m128i sums = _mm_sad_epu8( v, zero );
 
-    // Send full_flash_erase command
-    cout << "Erasing flash..." << endl;
+        sketch[ i / 8 ] = uint16_t( _mm_cvtsi128_si32( sums ) );
+        sketch[ i / 8 + 1 ] = uint16_t( _mm_cvtsi128_si32( _mm_srli_si128( sums, 8 ) ) );
+    }
+#else
+    for( uint g = 0; g < SKETCH_SIZE; ++g ) {
+        uint sum = 0;
+        for( uint i = 0; i < 8; ++i )
+            sum += program[ g * 8 + i ] & m[ g * 8 + i ];
 
-    st = FT_Write( ft_port, &cmd_erase, 1, &len );
-    if( st != FT_OK ) {
-        return 3;
+        sketch[ g ] = uint16_t( sum );
     }
+#endif
+}
 
-    // Check return code
-    uchar code;
-    st = FT_Read( ft_port, &code, 1, &len );
-    if( st != FT_OK || code != 0 ) {
-        return 4;
+// Lower bound of the (weighted) L1 distance. gw holds the smallest weight of each group.
+uint64_t SketchBoundL1( const uint16_t* a, const uint16_t* b, const uint16_t* gw ) {
+#ifdef XLOAD_SSE2
+    __m128i acc = _mm_setzero_si128();
+    for( uint g = 0; g < SKETCH_SIZE; g += 8 ) {
+        __m128i va = _mm_loadu_si128( (const __m128i*) &a[ g ] );
+        __m128i vb = _mm_loadu_si128( (const __m128i*) &b[ g ] );
+        __m128i d = _mm_sub_epi16( _mm_max_epi16( va, vb ), _mm_min_epi16( va, vb ) );
+        acc = _mm_add_epi32( acc, _mm_madd_epi16( d, _mm_loadu_si128( (const __m128i*) &gw[ g ] ) ) );
     }
 
+    acc = _mm_add_epi32( acc, _mm_srli_si128( acc, 8 ) );
+    acc = _mm_add_epi32( acc, _mm_srli_si128( acc, 4 ) );
+    return uint64_t( uint( _mm_cvtsi128_si32( acc ) ) );
+#else
+    uint64_t sum = 0;
+    for( uint g = 0; g < SKETCH_SIZE; ++g )
+        sum += uint64_t( abs( int( a[ g ] ) - int( b[ g ] ) ) ) * gw[ g ];
 
-    // Send full_flash_write command
-    cout << "Writing..." << endl;
+    return sum;
+#endif
+}
 
-    st = FT_Write( ft_port, &cmd_write, 1, &len );
-    if( st != FT_OK ) {
-        return 5;
+// Lower bound of the (weighted) squared L2 distance
+uint64_t SketchBoundL2( const uint16_t* a, const uint16_t* b, const uint16_t* gw ) {
+    uint64_t sum = 0;
+    for( uint g = 0; g < SKETCH_SIZE; ++g ) {
+        uint64_t d = abs( int( a[ g ] ) - int( b[ g ] ) );
+        sum += d * d * gw[ g ];
     }
 
-    // Iterate thru all pages of 256 bytes each
-    int dots = 0;
-
-    for( uint i = 0; i < pages; ++i ) {
+    return sum / 8;
+}
 
-        if( flash_type == FLASH_TYPE::IMAGE ) {
-            // Write first byte (takes longer time to write, as it prepares the page)
-            st = FT_Write( ft_port, &buffer[ i * 256 ], 1, &len );
-            if( st != FT_OK || len != 1 ) {
-                return 6;
+// Number of differing bytes of 'size' (a multiple of 16); their indices go to 'changed' unless it is null
+uint DiffBytes( const uchar* a, const uchar* b, uint size, uint16_t* changed ) {
+    uint count = 0;
+
+    for( uint i = 0; i < size; i += 16 ) {
+#ifdef XLOAD_SSE2
+        __m128i va = _mm_loadu_si128( (const __m128i*) &a[ i ] );
+        __m128i vb = _mm_loadu_si128( (const __m128i*) &b[ i ] );
+        uint bits = ~uint( _mm_movemask_epi8( _mm_cmpeq_epi8( va, vb ) ) ) & 0xFFFF;
+#else
+        uint bits = 0;
+        for( uint j = 0; j < 16; ++j )
+            bits |= a[ i + j ] != b[ i + j ] ? 1u << j : 0;
+#endif
+
+        for( uint j = 0; bits; ++j, bits >>= 1 ) {
+            if( bits & 1 ) {
+                if( changed )
+                    changed[ count ] = uint16_t( i + j );
+
+                count++;
             }
+        }
+    }
 
-            // This should be ACK, but the loader is already out so hack it.
-            ::Sleep( 10 );
+    return count;
+}
 
-            // Write 255 more bytes
-            st = FT_Write( ft_port, &buffer[ i * 256 + 1 ], 255, &len );
-            if( st != FT_OK || len != 255 ) {
-                return 7;
-            }
+// Number of differing parameters; their indices go to 'changed' (PRG_BUFFER entries) unless it is null
+uint DiffPrograms( const uchar* a, const uchar* b, uint16_t* changed ) {
+    return DiffBytes( a, b, PRG_BUFFER, changed );
+}
 
-            // Check return code
-            st = FT_Read( ft_port, &code, 1, &len );
-            if( st != FT_OK || len != 1 ) {
-                return 8;
-            }
+// Row-major programs <-> one column of 'rows' values per parameter, blocked 64 programs (32 KB) at a time
+void ProgramsToColumns( const uchar* programs, size_t rows, uchar* columns ) {
+    for( size_t r0 = 0; r0 < rows; r0 += 64 ) {
+        size_t r1 = r0 + 64 < rows ? r0 + 64 : rows;
+        for( uint p = 0; p < PRG_BUFFER; ++p ) {
+            for( size_t r = r0; r < r1; ++r )
+                columns[ p * rows + r ] = programs[ r * PRG_BUFFER + p ];
         }
-        else {
-            for( uint j = 0; j < 256; ++j ) {
-                st = FT_Write( ft_port, &buffer[ i * 256 + j ], 1, &len );
-                if( st != FT_OK || len != 1 ) {
-                    return 9;
-                }
+    }
+}
 
-                st = FT_Read( ft_port, &code, 1, &len );
-                if( st != FT_OK || len != 1 || code != 0 ) {
-                    return 10;
-                }
-            }
+void ColumnsToPrograms( const uchar* columns, size_t rows, uchar* programs ) {
+    for( size_t r0 = 0; r0 < rows; r0 += 64 ) {
+        size_t r1 = r0 + 64 < rows ? r0 + 64 : rows;
+        for( uint p = 0; p < PRG_BUFFER; ++p ) {
+            for( size_t r = r0; r < r1; ++r )
+                programs[ r * PRG_BUFFER + p ] = columns[ p * rows + r ];
         }
+    }
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// OpenDevice(), CloseDevice()
+//
+//---------------------------------------------------------------------------------------------------------------------
+int OpenDevice( uint baud_rate, uint latency ) {
+    xload::Status st = g_device.Open( baud_rate, latency );
+
+    if( st == XLOAD_ERROR_OPEN ) {
+        CommandError( ERROR_CONNECTING_DEVICE );
+        return 1;
+    }
+
+    if( st != XLOAD_OK ) {
+        CommandError( ERROR_SETTING_DEVICE );
+        return 1;
+    }
+
+    // Identify device (keys the bank cache)
+    g_device_serial = g_device.Serial();
+
+    // Active program unknown until the first dump
+    g_shadow.valid = false;
+
+    return 0;
+}
+
+void CloseDevice() {
+    StopParamQueue();
+    StopTake();
+    g_device.Close();
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Cancellable operations
+//
+// Long transfers run as coroutines (xload_task.hpp) next to a watcher that turns ESC into a cancellation, and next
+// to whatever else the caller spawned on the same executor.
+//---------------------------------------------------------------------------------------------------------------------
+xload::Task<void> Finish( xload::Task<xload::Status> task, xload::Status& result, xload::CancelSource done ) {
+    result = co_await task;
+    done.Cancel();
+}
+
+xload::Task<void> CancelOnKey( xload::Executor& ex, int vk, xload::CancelSource cancel, xload::CancelToken done ) {
+    xload::Status st = co_await ex.Key( vk, done );
+    if( st == XLOAD_OK )
+        cancel.Cancel();
+}
+
+// Runs 'task' and the tasks already spawned on 'ex'; ESC cancels 'cancel'
+xload::Status RunCancellable( xload::Executor& ex, xload::Task<xload::Status> task, xload::CancelSource cancel ) {
+    xload::Status result = XLOAD_OK;
+    auto done = ex.MakeCancel();
+
+    ex.Spawn( Finish( move( task ), result, done ) );
+    ex.Spawn( CancelOnKey( ex, VK_ESCAPE, cancel, done.Token() ) );
+    ex.Run();
+
+    return result;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// SetFlashDump()
+//
+// The file is read in 64 KB blocks while the flash erases and the first pages go out.
+//---------------------------------------------------------------------------------------------------------------------
+xload::Task<void> ReadAhead( xload::Executor& ex, ifstream& infile, vector<uchar>& buffer, size_t& ready ) {
+    const size_t BLOCK = 64 * 1024;
+
+    while( ready < buffer.size() ) {
+        size_t n = buffer.size() - ready < BLOCK ? buffer.size() - ready : BLOCK;
+        infile.read( (char*) &buffer[ ready ], n );
+
+        // Short file: the rest stays zero
+        ready = infile.gcount() < streamsize( n ) ? buffer.size() : ready + n;
+        co_await ex.Yield();
+    }
+}
+
+int SetFlashDump( string filename, uint baudrate, xload_flash_type flash_type ) {
+
+    // Images are loaded using the CMOD_A7_Loader.bit file, which has the COM set at 500kbps
+    //
+
+    if( OpenDevice( baudrate, LATENCY_RT ) != 0 ) {
+        return 1;
+    }
+
+    // Open file
+    ifstream infile;
+    infile.open( filename, ios::in | ios::binary );
+    if( !infile.is_open() ) {
+        CommandError( ERROR_OPENING_FILE );
+        return 1;
+    }
+
+    vector<uchar> buffer( xload_flash_size( flash_type ) );
+    size_t ready = 0;
+
+    cout << "Erasing flash..." << endl;
 
-        if( code != 0 )
-            cout << "X";
+    int dots = 0;
+    auto progress = [ & ]( uint32_t done, uint32_t ) {
+        if( done == 0 ) {
+            cout << "Writing... (ESC cancels)" << endl;
+            return;
+        }
 
-        if( i % 8 == 7 ) {
+        if( done % 8 == 0 ) {
             cout << ".";
             dots++;
         }
@@ -421,17 +1094,39 @@ int SetFlashDump( string filename, uint baudrate, FLASH_TYPE flash_type ) {
             cout << endl;
             dots = 0;
         }
-    }
+    };
+
+    xload::Status st;
+    uint32_t bad_pages = 0;
+    {
+        xload::Executor ex;
+        auto cancel = ex.MakeCancel();
 
-    // Check return code
-    st = FT_Read( ft_port, &code, 1, &len );
-    if( st != FT_OK || code != 0 ) {
-        cout << "Error writing image.";
-        return 11;
+        ex.Spawn( ReadAhead( ex, infile, buffer, ready ) );
+        st = RunCancellable( ex, xload::Flash( ex, g_device, flash_type, &buffer[ 0 ], buffer.size(), progress,
+                                               cancel.Token(), &ready, &bad_pages ), cancel );
     }
 
     infile.close();
 
+    if( st == XLOAD_ERROR_CANCELLED ) {
+        cout << endl;
+        CommandError( ERROR_CANCELLED );
+        return 2;
+    }
+
+    if( st != XLOAD_OK ) {
+        CommandError( ERROR_WRITING_IMAGE, st );
+        return 2;
+    }
+
+    if( bad_pages ) {
+        cout << endl;
+        CommandError( ERROR_IMAGE_PAGES );
+        cout << bad_pages << "." << endl;
+        return 2;
+    }
+
     CloseDevice();
     return 0;
 }
@@ -440,75 +1135,92 @@ int SetFlashDump( string filename, uint baudrate, FLASH_TYPE flash_type ) {
 // InitializeBank()
 //
 //---------------------------------------------------------------------------------------------------------------------
-int InitializeBank() {
-    FT_STATUS st;
-    DWORD len;
-    uchar buffer[ PRG_BUFFER ];
-
-    // Send 'bank erase' command to device
-    uchar cmd = '$';
-    st = FT_Write( ft_port, &cmd, 1, &len );
-    if( st != FT_OK )
-        return 1;
+xload::Status InitializeBank() {
+    InvalidateBankCache();
 
-    // Twiddle thumbs
-    for( int i = 0; i < 128; ++i ) {
-        ::Sleep( 100 );
+    // Twiddle thumbs while the device erases
+    auto progress = []( uint32_t done, uint32_t ) {
         cout << ".";
-        if( i % 64 == 63 )
+        if( done % 64 == 0 )
             cout << endl;
-    }
-
-    // Wait for status response
-    st = FT_Read( ft_port, &buffer, 1, &len );
-    if( st != FT_OK )
-        return 2;
-
-    if( buffer[ 0 ] != OK_CODE ) {
-        return 3;
-    }
+    };
 
-    return 0;
+    return g_device.EraseBank( progress );
 }
 
 //---------------------------------------------------------------------------------------------------------------------
 // GetBank()
 //
 //---------------------------------------------------------------------------------------------------------------------
+int ReadBank( uchar* bank, bool progress ) {
+    auto dots = []( uint32_t done, uint32_t ) {
+        cout << ".";
+        if( done % 64 == 0 )
+            cout << endl;
+    };
+
+    if( g_device.ReadBank( bank, progress ? xload::Progress( dots ) : xload::Progress() ) != XLOAD_OK )
+        return 1;
+
+    SetBankCache( bank );
+    return 0;
+}
+
 int GetBank( string filename ) {
 
     ofstream outfile;
     outfile.open( filename, ios::out | ios::binary );
 
     if( !outfile.is_open() ) {
-        cout << ERROR_OPENING_FILE;
+        CommandError( ERROR_OPENING_FILE );
         return 1;
     }
 
-    // Prepare buffer
-    uchar buffer[ PRG_BUFFER ];
+    vector<uchar> bank( BANK_SIZE );
 
-    DWORD len;
-    FT_STATUS st;
+    int err = ReadBank( &bank[ 0 ], true );
+    if( err ) {
+        CommandError( ERROR_READING_BANK );
+        return err;
+    }
 
+    // Write to file
+    outfile.write( (const char*) &bank[ 0 ], BANK_SIZE );
+    outfile.close();
 
-    // Send 'Reset EEPROM byte counter'
-    uchar cmd = '>';
+    return 0;
+}
 
-    st = FT_Write( ft_port, &cmd, 1, &len );
-    if( st != FT_OK )
+//---------------------------------------------------------------------------------------------------------------------
+// PutBank()
+//
+//---------------------------------------------------------------------------------------------------------------------
+// One program into the bank. The cache takes it in memory only, callers save it once the batch is done; after a failed
+// write nobody knows what the slot holds, so the cache goes.
+int PutBankSlot( uint slot, const uchar* program ) {
+    if( g_device.WriteBankProgram( slot, program ) != XLOAD_OK ) {
+        InvalidateBankCache();
         return 1;
+    }
+
+    UpdateBankCache( slot, program );
+    return 0;
+}
+
+xload::Task<xload::Status> WriteBank( xload::Executor& ex, const uchar* bank, xload::CancelToken token ) {
 
+    // Iterate thru all programs, stopping between slots when cancelled
+    for( uint j = 0; j < NUM_PROGRAMS; ++j ) {
+        if( token.Cancelled() )
+            co_return XLOAD_ERROR_CANCELLED;
 
-    // Loop thru all programs
-    for( int j = 0; j < NUM_PROGRAMS; ++j ) {
-        // Get two pages
-        st = FT_Read( ft_port, buffer, 512, &len );
-        if( st != FT_OK )
-            return 3;
+        xload::Status st = co_await xload::WriteBankProgram( ex, g_device, j, &bank[ j * PRG_BUFFER ] );
+        if( st != XLOAD_OK ) {
+            InvalidateBankCache();
+            co_return st;
+        }
 
-        // Write to file
-        outfile.write( (const char*) buffer, PRG_BUFFER );
+        UpdateBankCache( j, &bank[ j * PRG_BUFFER ] );
 
         // Show some progress
         cout << ".";
@@ -516,137 +1228,217 @@ int GetBank( string filename ) {
             cout << endl;
     }
 
-    outfile.close();
-
-    return 0;
+    co_return XLOAD_OK;
 }
 
-//---------------------------------------------------------------------------------------------------------------------
-// PutBank()
-//
-//---------------------------------------------------------------------------------------------------------------------
 int PutBank( string filename ) {
 
     ifstream infile;
     infile.open( filename, ios::in | ios::binary );
     if( !infile.is_open() ) {
-        cout << ERROR_OPENING_FILE;
+        CommandError( ERROR_OPENING_FILE );
         return 1;
     }
 
-    const uint PAGE_SIZE = 128;
-    char buffer[ PAGE_SIZE ];
-    DWORD len;
-    FT_STATUS st;
-
-
-    // Iterate thru all programs
-    for( int j = 0; j < NUM_PROGRAMS; ++j ) {
-        uchar data[ 2 ];
+    vector<uchar> bank( BANK_SIZE, 0 );
+    infile.read( (char*) &bank[ 0 ], BANK_SIZE );
+    infile.close();
 
-        // Send 'WriteProgramToEEPROM' msg and program number
-        data[ 0 ] = '}';
-        data[ 1 ] = uchar( j );
+    xload::Executor ex;
+    auto cancel = ex.MakeCancel();
 
-        st = FT_Write( ft_port, data, 2, &len );
-        if( st != FT_OK )
-            return 2;
+    xload::Status st = RunCancellable( ex, WriteBank( ex, &bank[ 0 ], cancel.Token() ), cancel );
+    SaveBankCache();
+    if( st == XLOAD_ERROR_CANCELLED ) {
+        cout << endl;
+        CommandError( ERROR_CANCELLED );
+    }
+    else if( st != XLOAD_OK ) {
+        CommandError( ERROR_WRITING_BANK, st );
+    }
 
-        // Check return code
-        uchar code;
-        st = FT_Read( ft_port, &code, 1, &len );
-        if( st != FT_OK )
-            return 3;
+    return st == XLOAD_OK ? 0 : 1;
+}
 
-        if( code != data[ 1 ] ) {
-            return 4;
-        }
+//---------------------------------------------------------------------------------------------------------------------
+// PipelineBench
+//
+// 'pipe [count]' times 'count' parameter reads answered one by one, then pipelined at growing depths (xload_submit).
+//---------------------------------------------------------------------------------------------------------------------
+void PipelineBench( string str ) {
+    auto elem = split( str, " " );
+    uint count = elem.size() > 1 && is_numeric( elem[ 1 ] ) ? atol( elem[ 1 ].c_str() ) : 500;
+    if( count == 0 )
+        return;
 
-        // Iterate thru all four chunks for each program (512 bytes = 128x4)
-        for( uint i = 0; i < 4; ++i ) {
-            infile.read( buffer, PAGE_SIZE );
+    stringstream s;
+    s << fixed << setprecision( 2 );
 
-            st = FT_Write( ft_port, buffer, PAGE_SIZE, &len );
-            if( st != FT_OK )
-                return 5;
+    auto report = [ & ]( const string& name, chrono::duration<double, milli> elapsed, uint failed ) {
+        s << "  " << left << setw( 12 ) << name << right << setw( 9 ) << elapsed.count() << " ms " << setw( 10 )
+          << count * 1000.0 / elapsed.count() << " cmd/s";
+        if( failed )
+            s << "  (" << failed << " failed)";
 
+        s << endl;
+    };
+
+    // Blocking: write, then wait for the reply
+    uint failed = 0;
+    auto start = chrono::steady_clock::now();
+    for( uint i = 0; i < count; ++i ) {
+        uchar data[ xload::protocol::GetParam::max_request ], code;
+        size_t n = xload::protocol::GetParam::Encode( data, uint16_t( i % 255 ) );
+        if( g_device.Write( data, n ) != XLOAD_OK || g_device.Read( &code, 1 ) != XLOAD_OK )
+            failed++;
+    }
+    report( "blocking", chrono::steady_clock::now() - start, failed );
 
-            // Check return code
-            uchar code;
-            st = FT_Read( ft_port, &code, 1, &len );
-            if( st != FT_OK )
-                return 6;
+    uchar code;
+    for( uint depth = 1; depth <= PIPELINE_DEPTH; depth *= 2 ) {
+        failed = 0;
+        g_device.SetPipelineDepth( depth );
+
+        start = chrono::steady_clock::now();
+        for( uint i = 0; i < count; ++i ) {
+            uchar data[ xload::protocol::GetParam::max_request ];
+            size_t n = xload::protocol::GetParam::Encode( data, uint16_t( i % 255 ) );
+            g_device.Submit( data, n, &code, 1, [ & ]( xload::Status st ) { failed += st != XLOAD_OK; } );
+        }
+        g_device.Drain();
+        report( "depth " + to_string( depth ), chrono::steady_clock::now() - start, failed );
+    }
 
-            if( code != 0x80 ) {
-                return 7;
-            }
+    g_device.SetPipelineDepth( PIPELINE_DEPTH );
+    cout << s.str();
+}
 
-            ::Sleep( 20 );
-        }
+//---------------------------------------------------------------------------------------------------------------------
+// Program shadow
+//
+// Host copy of the active program: filled by one 'd', then kept current by our own s, j, r and i, so 'g', 'n' and
+// 'd' are answered from memory. Edits made on the device itself are not seen: '-f' reads the device instead, and
+// 'shadow' compares the copy with the device. While a take streams the copy is all there is: no 'd' goes out.
+//---------------------------------------------------------------------------------------------------------------------
+const uchar* ShadowProgram( bool force ) {
+    if( force || !g_shadow.valid ) {
+        if( g_take.active )
+            return nullptr;
+
+        g_shadow.valid = DumpProgram( g_shadow.program ) == 0;
+        if( !g_shadow.valid )
+            return nullptr;
+    }
 
-        // Show some progress
-        cout << ".";
-        if( j % 64 == 63 )
-            cout << endl;
+    return g_shadow.program;
+}
+
+void SetShadow( const uchar* program ) {
+    memcpy( g_shadow.program, program, PRG_BUFFER );
+    g_shadow.valid = true;
+}
+
+void SetShadowParam( uint prm, uchar value ) {
+    if( g_shadow.valid )
+        g_shadow.program[ prm ] = value;
+}
+
+void InvalidateShadow() {
+    g_shadow.valid = false;
+}
+
+// 'shadow' re-reads the active program and reports what the copy missed, 'shadow clear' drops it
+void Shadow( string str ) {
+    auto elem = split( str, " " );
+
+    if( elem.size() > 1 && elem[ 1 ] == "clear" ) {
+        InvalidateShadow();
+        return;
     }
 
-    infile.close();
+    bool was_valid = g_shadow.valid;
+    uchar old[ PRG_BUFFER ];
+    memcpy( old, g_shadow.program, PRG_BUFFER );
+
+    if( !ShadowProgram( true ) ) {
+        CommandError( ERROR_READING_PROGRAM );
+        return;
+    }
+
+    if( !was_valid ) {
+        cout << "  Shadow filled from device." << endl;
+        return;
+    }
+
+    uint16_t changed[ PRG_BUFFER ];
+    uint n = DiffPrograms( old, g_shadow.program, changed );
+
+    stringstream s;
+    for( uint i = 0; i < n; ++i )
+        s << "  " << right << setw( 3 ) << changed[ i ] << "  " << int( old[ changed[ i ] ] ) << " -> " << int( g_shadow.program[ changed[ i ] ] ) << endl;
+
+    s << "  " << n << " parameters differed from device, shadow updated." << endl;
+    cout << s.str();
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// InjectProgram
+//
+// Replaces the active program with a full 512-byte image ('j').
+//---------------------------------------------------------------------------------------------------------------------
+int InjectProgram( const uchar* program ) {
+    if( g_device.InjectProgram( program ) != XLOAD_OK )
+        return 1;
 
+    SetShadow( program );
     return 0;
 }
 
 //---------------------------------------------------------------------------------------------------------------------
 // LoadProgram
 //
+// 'i filename' injects a program file, 'i @N' injects result N of the last 'similar', 'i --watch filename' follows
+// a program file as it is edited.
 //---------------------------------------------------------------------------------------------------------------------
-void LoadProgram( string str ) {
-
-    auto elem = split( str, " " );
-    if( elem.size() < 2 )
-        return;
+// Program named by an 'i' argument, a file (read into 'buffer') or '@N'; null (error reported) if there is none
+const uchar* ProgramSource( const string& arg, uchar* buffer ) {
+    if( arg[ 0 ] == '@' ) {
+        string rank = arg.substr( 1 );
+        uint n = is_numeric( rank ) && !rank.empty() ? atol( rank.c_str() ) : 0;
+        if( n == 0 || n > g_similar.size() || g_similar[ n - 1 ] >= g_library.entries.size() ) {
+            CommandError( ERROR_INVALID_RESULT );
+            return nullptr;
+        }
 
-    char buffer[ PRG_BUFFER ];
-    DWORD len;
-    FT_STATUS st;
+        return &g_library.programs[ size_t( g_similar[ n - 1 ] ) * PRG_BUFFER ];
+    }
 
     ifstream infile;
-    infile.open( elem[ 1 ], ios::out | ios::binary );
+    infile.open( arg, ios::in | ios::binary );
 
-    if( infile.is_open() ) {
-        infile.read( buffer, PRG_BUFFER );
-        infile.close();
+    if( !infile.is_open() ) {
+        CommandError( ERROR_OPENING_FILE );
+        return nullptr;
+    }
 
-        // Send inject command
-        uchar cmd = 'j';
-        st = FT_Write( ft_port, &cmd, 1, &len );
-        if( st != FT_OK ) {
-            cout << ERROR_LOADING_PROGRAM;
-            return;
-        }
+    infile.read( (char*) buffer, PRG_BUFFER );
+    infile.close();
+    return buffer;
+}
 
+void LoadProgram( string str ) {
 
-        // Send data
-        st = FT_Write( ft_port, buffer, PRG_BUFFER, &len );
-        if( st != FT_OK ) {
-            cout << ERROR_LOADING_PROGRAM;
-            return;
-        }
+    auto elem = split( str, " " );
+    if( elem.size() < 2 )
+        return;
 
-        // Check return code
-        uchar code;
-        st = FT_Read( ft_port, &code, 1, &len );
-        if( st != FT_OK ) {
-            cout << ERROR_LOADING_PROGRAM;
-            return;
-        }
+    uchar buffer[ PRG_BUFFER ];
+    const uchar* program = ProgramSource( elem[ 1 ], buffer );
+    if( !program )
+        return;
 
-        if( buffer[ 0 ] != OK_CODE ) {
-            cout << ERROR_LOADING_PROGRAM;
-            return;
-        }
-    }
-    else {
-        cout << ERROR_OPENING_FILE;
+    if( InjectProgram( program ) != 0 ) {
+        CommandError( ERROR_LOADING_PROGRAM );
     }
 }
 
@@ -657,32 +1449,19 @@ void LoadProgram( string str ) {
 void Initialize( string str ) {
     auto elem = split( str, " " );
 
-    DWORD len;
-    FT_STATUS st;
-
     if( elem.size() == 1 ) {
 
-        // Send initialize command  
-        uchar cmd = 'i';
-        st = FT_Write( ft_port, &cmd, 1, &len );
-        if( st != FT_OK ) {
-            cout << ERROR_INITIALIZING;
-            return;
-        }
-
-        // Check return code
-        uchar code;
-        st = FT_Read( ft_port, &code, 1, &len );
-        if( st != FT_OK ) {
-            cout << ERROR_INITIALIZING;
-            return;
-        }
+        // Default program contents are not known here
+        InvalidateShadow();
 
-        if( code != 0 ) {
-            cout << ERROR_INITIALIZING;
+        if( g_device.InitProgram() != XLOAD_OK ) {
+            CommandError( ERROR_INITIALIZING );
             return;
         }
     }
+    else if( elem[ 1 ] == "--watch" && elem.size() > 2 ) {
+        WatchProgramFile( elem[ 2 ] );
+    }
     else {
         LoadProgram( str );
     }
@@ -692,30 +1471,47 @@ void Initialize( string str ) {
 // GetProgramDump
 //
 //---------------------------------------------------------------------------------------------------------------------
-void GetProgramDump( string str ) {
+int DumpProgram( uchar* buffer ) {
+    return g_device.DumpProgram( buffer ) == XLOAD_OK ? 0 : 1;
+}
 
-    auto elem = split( str, " " );
+// Parameter name from xload_params.hpp, or 'pN'
+string ParamLabel( uint prm ) {
+    auto info = xload::params::Describe( uint16_t( prm ) );
+    return info.name.empty() ? "p" + to_string( prm ) : string( info.name );
+}
 
-    DWORD len;
-    FT_STATUS st;
+// Value in the parameter's display format
+string ParamValue( uint prm, uchar value ) {
+    if( xload::params::Describe( uint16_t( prm ) ).format == xload::params::Format::Char && isprint( value ) )
+        return string( "'" ) + char( value ) + "'";
 
-    // Send dump command
-    uchar cmd = 'd';
-    st = FT_Write( ft_port, &cmd, 1, &len );
-    if( st != FT_OK ) {
-        return;
-    }
+    return to_string( value );
+}
 
+void GetProgramDump( const Command& cmd ) {
 
-    // Get data
-    uchar buffer[ PRG_BUFFER ];
-    st = FT_Read( ft_port, buffer, PRG_BUFFER, &len );
-    if( st != FT_OK ) {
+    // 'd -f' reads the device, the shadow otherwise
+    const uchar* buffer = ShadowProgram( cmd.force );
+    if( !buffer ) {
+        CommandError( ERROR_READING_PROGRAM );
         return;
     }
 
 
-    if( elem.size() == 1 ) {
+    if( cmd.args.empty() && cmd.labels ) {
+        // To display, one labeled parameter per line ('d -l')
+        //
+
+        stringstream s;
+        for( uint i = 0; i < PRG_BUFFER; ++i ) {
+            s << "  " << setw( 3 ) << i << "  " << setw( 8 ) << left << ParamLabel( i ) << right << " "
+              << ParamValue( i, buffer[ i ] ) << endl;
+        }
+
+        cout << s.str();
+    }
+    else if( cmd.args.empty() ) {
         // To display
         //
 
@@ -736,7 +1532,7 @@ void GetProgramDump( string str ) {
         //
 
         ofstream outfile;
-        outfile.open( elem[ 1 ], ios::out | ios::binary );
+        outfile.open( string( cmd.args[ 0 ] ), ios::out | ios::binary );
         if( outfile.is_open() ) {
             for( uint i = 0; i < PRG_BUFFER; ++i )
                 outfile << buffer[ i ];
@@ -744,7 +1540,7 @@ void GetProgramDump( string str ) {
             outfile.close();
         }
         else {
-            cout << ERROR_OPENING_FILE;
+            CommandError( ERROR_OPENING_FILE );
         }
     }
 }
@@ -753,578 +1549,4348 @@ void GetProgramDump( string str ) {
 // GetParam
 //
 //---------------------------------------------------------------------------------------------------------------------
-void GetParam( string str ) {
-
-    auto elem = split( str, " " );
-
-    if( elem.size() < 2 )
-        return;
+void GetParam( const Command& cmd ) {
 
-    if( !is_numeric( elem[ 1 ] ) )
-        return;
+    vector<uint16_t> params;
+    for( uint prm : cmd.numbers ) {
+        if( prm >= PRG_BUFFER ) {
+            CommandError( ERROR_INVALID_PARAM_NUMBER );
+            return;
+        }
 
-    int prm = atol( elem[ 1 ].c_str() );
-    if( prm >= PRG_BUFFER ) {
-        cout << ERROR_INVALID_PARAM_NUMBER;
-        return;
+        params.push_back( uint16_t( prm ) );
     }
 
-    uchar data[ 3 ];
-    data[ 0 ] = 'g';
-    data[ 1 ] = prm > 255 ? 255 : uchar( prm );
-    data[ 2 ] = prm > 255 ? uchar( prm - 256 ) : 0;
-
-    DWORD len;
-    FT_STATUS st;
-
-    st = FT_Write( ft_port, data, 2, &len );
-    if( st != FT_OK ) {
-        return;
-    }
+    stringstream s;
+
+    // From the shadow, unless forced ('g N [N ...] -f')
+    if( !cmd.force ) {
+        const uchar* program = ShadowProgram( false );
+        if( program ) {
+            for( auto prm : params ) {
+                if( cmd.labels )
+                    s << "  " << ParamLabel( prm ) << " = " << ParamValue( prm, program[ prm ] ) << endl;
+                else
+                    s << "  " << int( program[ prm ] ) << endl;
+            }
 
-    if( prm > 255 ) {
-        st = FT_Write( ft_port, &data[ 2 ], 1, &len );
-        if( st != FT_OK ) {
+            cout << s.str();
             return;
         }
     }
 
-    // Check return code
-    uchar code;
-    st = FT_Read( ft_port, &code, 1, &len );
-    if( st != FT_OK ) {
+    // All queries in flight at once
+    vector<uchar> values( params.size() );
+    if( g_device.GetParams( &params[ 0 ], &values[ 0 ], params.size() ) != XLOAD_OK ) {
+        CommandError( ERROR_READING_PARAMS );
         return;
     }
 
-    cout << "  " << int( code ) << endl;
+    for( uint i = 0; i < params.size(); ++i ) {
+        SetShadowParam( params[ i ], values[ i ] );
+        if( cmd.labels )
+            s << "  " << ParamLabel( params[ i ] ) << " = " << ParamValue( params[ i ], values[ i ] ) << endl;
+        else
+            s << "  " << int( values[ i ] ) << endl;
+    }
+
+    cout << s.str();
 }
 
 //---------------------------------------------------------------------------------------------------------------------
 // SetParam
 //
+// 's P1 V1 [P2 V2 ...]' sends every change in one write, 's' commands back to back. Batches touching more than
+// g_inject_fraction of the program are applied to the shadow and sent as one 'j' inject instead.
 //---------------------------------------------------------------------------------------------------------------------
-void SetParam( string str ) {
-    using namespace std;
-
-    auto elem = split( str, " " );
+struct ParamChange {
+    uint prm;
+    uchar value;
+};
 
-    if( elem.size() < 3 )
-        return;
+int SetParams( const vector<ParamChange>& changes ) {
+    if( changes.empty() )
+        return 0;
 
-    if( !is_numeric( elem[ 1 ] ) || !is_numeric( elem[ 2 ] ) )
-        return;
+    // Large batch: one full image (its status reply cannot come back while audio streams)
+    if( changes.size() > g_inject_fraction * PRG_BUFFER && !g_take.active ) {
+        const uchar* shadow = ShadowProgram( false );
+        if( shadow ) {
+            uchar program[ PRG_BUFFER ];
+            memcpy( program, shadow, PRG_BUFFER );
+            for( auto& c : changes )
+                program[ c.prm ] = c.value;
 
-    int prm = atol( elem[ 1 ].c_str() );
-    if( prm >= PRG_BUFFER ) {
-        cout << ERROR_INVALID_PARAM_NUMBER;
-        return;
+            return InjectProgram( program );
+        }
     }
 
+    vector<uint16_t> params;
+    vector<uchar> values;
+    for( auto& c : changes ) {
+        params.push_back( uint16_t( c.prm ) );
+        values.push_back( c.value );
+    }
 
-    int value = atol( elem[ 2 ].c_str() );
-    if( value > 255 ) {
-        cout << ERROR_INVALID_PARAM_VALUE;
-        return;
+    MarkTake( &params[ 0 ], &values[ 0 ], changes.size() );
+    if( g_device.SetParams( &params[ 0 ], &values[ 0 ], changes.size() ) != XLOAD_OK ) {
+        InvalidateShadow();
+        return 1;
     }
 
-    uchar data[ 4 ];
-    data[ 0 ] = 's';
-    data[ 1 ] = prm > 255 ? 255 : uchar( prm );
-    data[ 2 ] = prm > 255 ? uchar( prm - 256 ) : 0;
-    data[ 3 ] = uchar( value );
+    for( auto& c : changes )
+        SetShadowParam( c.prm, c.value );
 
-    DWORD len;
-    FT_STATUS st;
+    return 0;
+}
 
-    // Send setparam command, and the parameter number  
-    st = FT_Write( ft_port, data, 2, &len );
-    if( st != FT_OK ) {
-        return;
-    }
+//---------------------------------------------------------------------------------------------------------------------
+// Parameter queue
+//
+// With 'queue on', 's' only records the values: one pending value per parameter, a newer one replacing it, so a knob
+// streaming faster than the link keeps at most PRG_BUFFER writes pending and the latest one always goes next. The
+// flusher thread sends everything pending as one batch, then waits for the link to carry it (at BAUDRATE, and no
+// less than a USB microframe) before the next. Other commands first wait for the queue to drain, see ProcessLine().
+//---------------------------------------------------------------------------------------------------------------------
+void FlushParams( ParamQueue& q ) {
+    vector<uint16_t> params;
+    vector<uchar> values;
 
-    // Handle parameter numbers > 255
-    if( prm > 255 ) {
-        st = FT_Write( ft_port, &data[ 2 ], 1, &len );
-        if( st != FT_OK ) {
+    unique_lock<mutex> l( q.lock );
+    for( ;; ) {
+        q.changed.wait( l, [ & ]() { return q.stop || !q.order.empty(); } );
+        if( q.stop )
             return;
+
+        // Everything pending, oldest first
+        auto now = chrono::steady_clock::now();
+        size_t bytes = 0;
+        params.clear();
+        values.clear();
+        for( auto prm : q.order ) {
+            params.push_back( prm );
+            values.push_back( q.values[ prm ] );
+            q.pending[ prm ] = false;
+            bytes += prm > 255 ? 4 : 3;
+
+            auto waited = now - q.since[ prm ];
+            q.latency += waited;
+            if( waited > q.worst )
+                q.worst = waited;
+        }
+
+        q.order.clear();
+        q.busy = true;
+        l.unlock();
+
+        auto start = chrono::steady_clock::now();
+        xload::Status st;
+        {
+            lock_guard<mutex> device( q.device );
+            MarkTake( &params[ 0 ], &values[ 0 ], params.size() );
+            st = g_device.SetParams( &params[ 0 ], &values[ 0 ], params.size() );
+            if( st == XLOAD_OK ) {
+                for( size_t i = 0; i < params.size(); ++i )
+                    SetShadowParam( params[ i ], values[ i ] );
+            }
+            else
+                InvalidateShadow();
         }
+
+        // 10 bits a byte on the wire. The sleep may last a timer tick longer: what comes meanwhile joins the next batch
+        auto wire = chrono::nanoseconds( uint64_t( bytes ) * 10 * 1000000000 / BAUDRATE );
+        auto frame = chrono::microseconds( AUTOMATE_FRAME_US );
+        auto next = start + ( wire > frame ? wire : frame );
+        this_thread::sleep_until( next );
+
+        l.lock();
+        q.busy = false;
+        q.writes++;
+        if( st == XLOAD_OK )
+            q.sent += params.size();
+        else
+            q.failed += params.size();
+
+        q.changed.notify_all();
     }
+}
 
-    // Send parameter value
-    st = FT_Write( ft_port, &data[ 3 ], 1, &len );
-    if( st != FT_OK ) {
-        return;
+void EnqueueParams( const vector<ParamChange>& changes ) {
+    auto& q = g_param_queue;
+    auto now = chrono::steady_clock::now();
+
+    {
+        lock_guard<mutex> l( q.lock );
+        for( auto& c : changes ) {
+            q.received++;
+            if( q.pending[ c.prm ] )
+                q.superseded++;
+            else {
+                q.pending[ c.prm ] = true;
+                q.since[ c.prm ] = now;
+                q.order.push_back( uint16_t( c.prm ) );
+            }
+
+            q.values[ c.prm ] = c.value;
+        }
+
+        if( q.order.size() > q.peak )
+            q.peak = q.order.size();
     }
+
+    q.changed.notify_one();
 }
 
-//---------------------------------------------------------------------------------------------------------------------
-// ReadProgram
-//
-//---------------------------------------------------------------------------------------------------------------------
-void ReadProgram( string str ) {
+// Waits until everything queued is written
+void WaitParams() {
+    auto& q = g_param_queue;
+    unique_lock<mutex> l( q.lock );
+    q.changed.wait( l, [ & ]() { return q.order.empty() && !q.busy; } );
+}
 
-    auto elem = split( str, " " );
+// WaitParams(), then keeps the flusher off the device while the lock is held
+unique_lock<mutex> DrainParams() {
+    WaitParams();
+    return unique_lock<mutex>( g_param_queue.device );
+}
 
-    if( elem.size() < 2 )
+// Starts the flusher, for 'queue on' and again after a command reopened the device
+void StartParamQueue() {
+    auto& q = g_param_queue;
+    if( q.enabled )
         return;
 
-    if( !is_numeric( elem[ 1 ] ) )
-        return;
+    q.stop = false;
+    q.flusher = thread( FlushParams, ref( q ) );
+    q.enabled = true;
+}
 
-    int prm = atol( elem[ 1 ].c_str() );
-    if( prm >= NUM_PROGRAMS ) {
-        cout << ERROR_INVALID_PROGRAM_NUMBER;
+// Sends what is queued and ends the flusher; also called by CloseDevice(), from within commands
+void StopParamQueue() {
+    auto& q = g_param_queue;
+    if( !q.flusher.joinable() )
         return;
+
+    WaitParams();
+    {
+        lock_guard<mutex> l( q.lock );
+        q.stop = true;
     }
 
-    uchar data[ 2 ];
-    data[ 0 ] = 'r';
-    data[ 1 ] = uchar( prm );
+    q.changed.notify_all();
+    q.flusher.join();
+    q.enabled = false;
+}
 
-    DWORD len;
-    FT_STATUS st;
+// 'queue' shows the state and counts, 'queue on|off' switches queuing of 's', 'queue reset' clears the counts
+void ParamQueueCommand( const Command& cmd ) {
+    auto& q = g_param_queue;
+    string_view what = cmd.args.empty() ? string_view() : cmd.args[ 0 ];
 
-    // Send read_program command, and the program number
-    st = FT_Write( ft_port, data, 2, &len );
-    if( st != FT_OK ) {
+    if( what == "on" ) {
+        StartParamQueue();
         return;
     }
 
-    // Check return code
-    uchar code;
-    st = FT_Read( ft_port, &code, 1, &len );
-    if( st != FT_OK || code != 0 ) {
-        cout << ERROR_READING_PROGRAM;
+    if( what == "off" ) {
+        StopParamQueue();
         return;
     }
-}
-
-//---------------------------------------------------------------------------------------------------------------------
-// WriteProgram
-//
-//---------------------------------------------------------------------------------------------------------------------
-void WriteProgram( string str ) {
-    auto elem = split( str, " " );
-
-    if( elem.size() < 2 )
-        return;
 
-    if( !is_numeric( elem[ 1 ] ) )
+    lock_guard<mutex> l( q.lock );
+    if( what == "reset" ) {
+        q.received = q.superseded = q.sent = q.writes = q.failed = 0;
+        q.peak = q.order.size();
+        q.latency = q.worst = chrono::nanoseconds::zero();
         return;
+    }
 
-    int prm = atol( elem[ 1 ].c_str() );
-    if( prm >= NUM_PROGRAMS ) {
-        cout << ERROR_INVALID_PROGRAM_NUMBER;
+    if( !what.empty() ) {
+        CommandError( ERROR_INVALID_ARGUMENTS );
         return;
     }
 
-    uchar data[ 2 ];
-    data[ 0 ] = 'w';
-    data[ 1 ] = uchar( prm );
+    auto ms = []( chrono::nanoseconds d ) { return chrono::duration<double, milli>( d ).count(); };
+    uint64_t taken = q.sent + q.failed;
 
-    DWORD len;
-    FT_STATUS st;
+    stringstream s;
+    s << fixed << setprecision( 2 );
+    s << "  Queue " << ( q.enabled ? "on" : "off" ) << ": " << q.order.size() << " pending (peak " << q.peak << ")"
+      << endl;
+    s << "  " << q.received << " received, " << q.superseded << " superseded, " << q.sent << " sent in " << q.writes
+      << " writes" << endl;
+    if( taken )
+        s << "  latency avg " << ms( q.latency ) / taken << " ms, max " << ms( q.worst ) << " ms" << endl;
 
-    // Send write_program command, and the program number
-    st = FT_Write( ft_port, data, 2, &len );
-    if( st != FT_OK ) {
-        return;
+    cout << s.str();
+
+    if( q.failed ) {
+        CommandError( ERROR_QUEUE_WRITE );
+        cout << q.failed << " parameters.\n";
     }
+}
 
-    // Check return code
-    uchar code;
-    st = FT_Read( ft_port, &code, 1, &len );
-    if( st != FT_OK || code != 0 ) {
-        cout << ERROR_WRITING_PROGRAM;
-        return;
+// The 's' pairs of 'cmd', false (error reported) on a bad parameter or value
+bool ParamChanges( const Command& cmd, vector<ParamChange>& changes ) {
+    for( uint i = 0; i + 1 < cmd.numbers.size(); i += 2 ) {
+        uint prm = cmd.numbers[ i ];
+        if( prm >= PRG_BUFFER ) {
+            CommandError( ERROR_INVALID_PARAM_NUMBER );
+            return false;
+        }
+
+        // Range from the parameter table, 0-255 for parameters without an entry
+        uint value = cmd.numbers[ i + 1 ];
+        auto info = xload::params::Describe( uint16_t( prm ) );
+        if( value < info.min || value > info.max ) {
+            CommandError( ERROR_PARAM_RANGE );
+            cout << ParamLabel( prm ) << " (" << int( info.min ) << "-" << int( info.max ) << ").\n";
+            return false;
+        }
+
+        changes.push_back( { prm, uchar( value ) } );
     }
+
+    return true;
 }
 
-//---------------------------------------------------------------------------------------------------------------------
-// SetChannel
-//
-//---------------------------------------------------------------------------------------------------------------------
-void SetChannel( string str ) {
+void SetParam( const Command& cmd ) {
+    vector<ParamChange> changes;
+    if( !ParamChanges( cmd, changes ) )
+        return;
 
-    DWORD len;
-    FT_STATUS st;
+    if( g_param_queue.enabled )
+        EnqueueParams( changes );
+    else if( SetParams( changes ) != 0 )
+        CommandError( ERROR_WRITING_PARAMS );
+}
 
+// 'batch' shows the inject threshold, 'batch F' sets it, 'batch bench [N]' times N writes (current values, so the
+// sound does not change) sent one write per parameter, as one batch, and as one inject
+void Batch( string str ) {
     auto elem = split( str, " " );
 
-    if( elem.size() < 2 ) {
-        // Get MIDI Channel
+    if( elem.size() == 1 ) {
+        cout << "  Batches above " << uint( g_inject_fraction * PRG_BUFFER ) << " parameters (" << g_inject_fraction
+             << ") are injected." << endl;
+        return;
+    }
 
-        uchar cmd = '!';
-        st = FT_Write( ft_port, &cmd, 1, &len );
-        if( st != FT_OK ) {
+    if( elem[ 1 ] != "bench" ) {
+        double f = atof( elem[ 1 ].c_str() );
+        if( f <= 0 || f > 1 ) {
+            CommandError( ERROR_INVALID_FRACTION );
             return;
         }
 
-        // Check return code
-        uchar code;
-        st = FT_Read( ft_port, &code, 1, &len );
-        if( st != FT_OK ) {
-            return;
-        }
+        g_inject_fraction = f;
+        return;
+    }
+
+    uint count = elem.size() > 2 && is_numeric( elem[ 2 ] ) ? atol( elem[ 2 ].c_str() ) : 64;
+    if( count == 0 || count > PROGRAM_NAME_OFFSET )
+        count = PROGRAM_NAME_OFFSET;
 
-        cout << int( code ) << endl;
+    const uchar* shadow = ShadowProgram( true );
+    if( !shadow ) {
+        CommandError( ERROR_READING_PROGRAM );
+        return;
     }
-    else {
-        // Set MIDI Channel
-        for( uint i = 1; i < elem.size(); ++i ) {
-            auto ch = elem[ i ];
 
-            if( !is_numeric( ch ) )
-                return;
+    uchar program[ PRG_BUFFER ];
+    memcpy( program, shadow, PRG_BUFFER );
 
-            int prm = atol( ch.c_str() );
-            if( prm > 16 ) {
-                cout << ERROR_INVALID_CHANNEL;
-                return;
-            }
+    // Each run ends with a 'g' round trip, so the device has taken every byte before the clock stops
+    auto sync = [ & ]() {
+        uchar code;
+        g_device.GetParam( 0, code );
+    };
 
-            uchar data[ 3 ];
-            data[ 0 ] = '*';
-            data[ 1 ] = 9 + i;
-            data[ 2 ] = uchar( prm );
+    auto start = chrono::steady_clock::now();
+    for( uint i = 0; i < count; ++i )
+        g_device.SetParam( uint16_t( i ), program[ i ] );
 
+    sync();
+    chrono::duration<double, milli> sequential = chrono::steady_clock::now() - start;
 
+    vector<ParamChange> changes;
+    for( uint i = 0; i < count; ++i )
+        changes.push_back( { i, program[ i ] } );
 
-            // Send set_midi_channel command ( * N ), and the channel number
-            st = FT_Write( ft_port, data, 3, &len );
-            if( st != FT_OK ) {
-                return;
-            }
+    double fraction = g_inject_fraction;
+    g_inject_fraction = 1;
 
-            // Check return code
-            uchar code;
-            st = FT_Read( ft_port, &code, 1, &len );
-            if( st != FT_OK || code != data[ 2 ] ) {
-                cout << ERROR_WRITING_CHANNEL;
-                return;
-            }
-        }
-    }
+    start = chrono::steady_clock::now();
+    SetParams( changes );
+    sync();
+    chrono::duration<double, milli> batched = chrono::steady_clock::now() - start;
+
+    g_inject_fraction = fraction;
+
+    start = chrono::steady_clock::now();
+    InjectProgram( program );
+    chrono::duration<double, milli> injected = chrono::steady_clock::now() - start;
+
+    stringstream s;
+    s << fixed << setprecision( 2 );
+    s << "  " << count << " parameters" << endl;
+    s << "  sequential  " << setw( 8 ) << sequential.count() << " ms  (" << count << " writes)" << endl;
+    s << "  batch       " << setw( 8 ) << batched.count() << " ms  (1 write)" << endl;
+    s << "  inject      " << setw( 8 ) << injected.count() << " ms  (" << PRG_BUFFER << " bytes)" << endl;
+    cout << s.str();
 }
 
 //---------------------------------------------------------------------------------------------------------------------
-// NameProgram
+// Automation
 //
+// 'automate file' plays a timeline of parameter changes, one event per line: time (ms from the start, fractions
+// allowed), parameter (number or name) and value. A dedicated thread at time-critical priority sleeps until
+// AUTOMATE_SPIN_US before each write and spins on the steady clock (QueryPerformanceCounter) for the rest. Events due
+// within one USB microframe of the first, or already due when the write goes out, share one write, the latest value
+// of a parameter winning. The report gives the actual minus the scheduled time of every event.
 //---------------------------------------------------------------------------------------------------------------------
-void NameProgram( string str ) {
+struct AutomationEvent {
+    chrono::nanoseconds at;                 // from the start of playback
+    uint16_t prm;
+    uchar value;
+};
 
-    const uint PROGRAM_NAME_OFFSET = 480;
-    const uint PROGRAM_NAME_LEN = 24;
+struct AutomationResult {
+    vector<chrono::nanoseconds> errors;     // per event: sent minus scheduled
+    vector<chrono::nanoseconds> writes;     // per write: link time
+    size_t coalesced = 0;                   // events that shared a write with an earlier one
+    size_t superseded = 0;                  // of those, values replaced before they were sent
+    bool failed = false;
+};
 
+// Reads 'file', events sorted by time; false (line number in 'bad') on a malformed line
+bool LoadTimeline( const string& file, vector<AutomationEvent>& events, uint& bad ) {
+    ifstream infile( file, ios::in );
+    if( !infile.is_open() )
+        return false;
+
+    string line;
+    for( uint n = 1; getline( infile, line ); ++n ) {
+        line = line.substr( 0, line.find( '#' ) );
+        auto elem = split( line, " \t\r" );
+        if( elem.empty() )
+            continue;
 
-    auto elem = split( str, " " );
+        char* end;
+        double ms = strtod( elem[ 0 ].c_str(), &end );
+        uint prm, value;
+        bad = n;
+        if( elem.size() != 3 || *end || ms < 0 || !ParseParam( elem[ 1 ], prm ) || prm >= PRG_BUFFER ||
+            !ParseNumber( elem[ 2 ], value ) )
+            return false;
 
-    DWORD len;
-    FT_STATUS st;
+        auto info = xload::params::Describe( uint16_t( prm ) );
+        if( value < info.min || value > info.max )
+            return false;
 
-    if( elem.size() == 1 ) {
-        // Display name
+        auto at = chrono::duration_cast<chrono::nanoseconds>( chrono::duration<double, milli>( ms ) );
+        events.push_back( { at, uint16_t( prm ), uchar( value ) } );
+    }
 
-        // Send dump command
-        uchar cmd = 'd';
+    bad = 0;
+    stable_sort( events.begin(), events.end(), []( auto& a, auto& b ) { return a.at < b.at; } );
+    return true;
+}
 
-        st = FT_Write( ft_port, &cmd, 1, &len );
-        if( st != FT_OK ) {
-            return;
-        }
+// Sleeps, then spins, until 'due'; false when 'stop' is cancelled first
+bool WaitUntil( chrono::steady_clock::time_point due, const xload::CancelToken& stop ) {
+    for( ;; ) {
+        if( stop.Cancelled() )
+            return false;
+
+        auto left = due - chrono::steady_clock::now();
+        if( left <= chrono::nanoseconds::zero() )
+            return true;
+
+        // Sleep(N) lasts N to N+1 ms with the 1 ms timer period: whole milliseconds short of the margin only
+        auto sleep = chrono::duration_cast<chrono::milliseconds>( left - chrono::microseconds( AUTOMATE_SPIN_US ) );
+        if( sleep.count() >= 1 )
+            Sleep( DWORD( sleep.count() ) );
+        else
+            YieldProcessor();
+    }
+}
 
+// Playback thread
+void PlayTimeline( const vector<AutomationEvent>& events, AutomationResult& result, xload::CancelToken stop,
+                   xload::CancelSource finished ) {
+    SetThreadPriority( GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL );
+    timeBeginPeriod( 1 );
+
+    // Position in the write of each parameter, so a later value replaces an earlier one
+    vector<int> slot( PRG_BUFFER, -1 );
+    vector<uint16_t> params;
+    vector<uchar> values;
+    vector<chrono::nanoseconds> due;
+
+    auto start = chrono::steady_clock::now() + chrono::milliseconds( AUTOMATE_LEAD_MS );
+    for( size_t i = 0; i < events.size(); ) {
+        if( !WaitUntil( start + events[ i ].at, stop ) )
+            break;
 
-        // Get data
-        char buffer[ PRG_BUFFER ];
+        // Everything due within the frame, or by now
+        auto now = chrono::steady_clock::now();
+        auto until = start + events[ i ].at + chrono::microseconds( AUTOMATE_FRAME_US );
+        if( now > until )
+            until = now;
+
+        size_t first = i;
+        params.clear();
+        values.clear();
+        due.clear();
+        for( ; i < events.size() && start + events[ i ].at <= until; ++i ) {
+            auto& e = events[ i ];
+            if( slot[ e.prm ] < 0 ) {
+                slot[ e.prm ] = int( params.size() );
+                params.push_back( e.prm );
+                values.push_back( e.value );
+            }
+            else {
+                values[ slot[ e.prm ] ] = e.value;
+                result.superseded++;
+            }
 
-        st = FT_Read( ft_port, buffer, PRG_BUFFER, &len );
-        if( st != FT_OK ) {
-            return;
+            due.push_back( e.at );
         }
 
+        for( auto prm : params )
+            slot[ prm ] = -1;
 
-        // Display program name
-        string s( &buffer[ PROGRAM_NAME_OFFSET ], PROGRAM_NAME_LEN );
-        cout << s << endl;
-    }
-    else {
-        // Set name
-        string name = str.substr( 2, str.length() - 2 );
-        auto len = min( name.length(), PROGRAM_NAME_LEN );
+        result.coalesced += i - first - 1;
 
-        for( uint i = 0; i < PROGRAM_NAME_LEN; ++i ) {
-            stringstream arg;
-            arg << "s " << PROGRAM_NAME_OFFSET + i << " ";
+        MarkTake( &params[ 0 ], &values[ 0 ], params.size() );
+        auto sent = chrono::steady_clock::now();
+        xload::Status st = g_device.SetParams( &params[ 0 ], &values[ 0 ], params.size() );
+        result.writes.push_back( chrono::steady_clock::now() - sent );
+        if( st != XLOAD_OK ) {
+            result.failed = true;
+            break;
+        }
 
-            if( i < len ) {
-                arg << (int) name[ i ];
-            }
-            else {
-                arg << 32;
-            }
+        for( size_t k = 0; k < params.size(); ++k )
+            SetShadowParam( params[ k ], values[ k ] );
 
-            SetParam( arg.str() );
-        }
+        for( auto at : due )
+            result.errors.push_back( sent - ( start + at ) );
     }
+
+    timeEndPeriod( 1 );
+    finished.Cancel();
 }
 
-//---------------------------------------------------------------------------------------------------------------------
-// GetAudioChunk
-//
-//---------------------------------------------------------------------------------------------------------------------
-void GetAudioChunk( string str ) {
+// Completes once 'token' is cancelled, from whichever thread
+xload::Task<xload::Status> AwaitCancel( xload::Executor& ex, xload::CancelToken token ) {
+    xload::Status st = co_await ex.Until( [ = ]() { return token.Cancelled(); } );
+    co_return st;
+}
 
-    const int AUDIO_BUFFER = 6 * 64;
+// p-th percentile of sorted 'v', in microseconds
+double Percentile( const vector<chrono::nanoseconds>& v, double p ) {
+    if( v.empty() )
+        return 0;
 
+    size_t i = size_t( p / 100 * ( v.size() - 1 ) + 0.5 );
+    return chrono::duration<double, micro>( v[ i ] ).count();
+}
+
+void Automate( const Command& cmd ) {
+    vector<AutomationEvent> events;
+    uint bad = 0;
+    if( !LoadTimeline( string( cmd.args[ 0 ] ), events, bad ) ) {
+        if( bad ) {
+            CommandError( ERROR_INVALID_EVENT );
+            cout << bad << ".\n";
+        }
+        else
+            CommandError( ERROR_OPENING_FILE );
+
+        return;
+    }
+
+    if( events.empty() )
+        return;
+
+    // The thread owns the device until it finishes or ESC stops it
+    xload::Executor ex;
+    auto stop = ex.MakeCancel();
+    auto finished = ex.MakeCancel();
+    AutomationResult result;
+
+    auto started = chrono::steady_clock::now();
+    thread player( PlayTimeline, cref( events ), ref( result ), stop.Token(), finished );
+    RunCancellable( ex, AwaitCancel( ex, finished.Token() ), stop );
+    player.join();
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - started;
+
+    if( result.failed )
+        InvalidateShadow();
+
+    sort( result.errors.begin(), result.errors.end() );
+    sort( result.writes.begin(), result.writes.end() );
+
+    stringstream s;
+    s << fixed << setprecision( 1 );
+    s << "  " << result.errors.size() << " of " << events.size() << " events in " << result.writes.size()
+      << " writes (" << result.coalesced << " coalesced, " << result.superseded << " superseded), " << elapsed.count()
+      << " ms" << endl;
+    if( !result.errors.empty() ) {
+        s << "  timing error  p50 " << Percentile( result.errors, 50 ) << "  p90 " << Percentile( result.errors, 90 )
+          << "  p99 " << Percentile( result.errors, 99 ) << "  max " << Percentile( result.errors, 100 ) << " us"
+          << endl;
+        s << "  write time    p50 " << Percentile( result.writes, 50 ) << "  p99 " << Percentile( result.writes, 99 )
+          << " us, about " << uint( 1e6 / ( Percentile( result.writes, 50 ) > 1 ? Percentile( result.writes, 50 ) : 1 ) ) << " writes/s" << endl;
+    }
+
+    cout << s.str();
+
+    if( result.failed )
+        CommandError( ERROR_AUTOMATION_WRITE );
+    else if( stop.Cancelled() )
+        CommandError( ERROR_CANCELLED );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Watch
+//
+// 'watch [ms [polls]] [file | tcp:[host:]port]' dumps the active program every 'ms' until ESC (or 'polls' dumps) and
+// reports edits made on the device itself, one 'time param old new' line per changed parameter: to the console, to
+// a file (appended) or over TCP. Dumps are compared 16 bytes at a time (DiffPrograms), so an unchanged poll costs the
+// 512-byte dump and little else, and the output grows with the changes only. The shadow follows the device.
+//---------------------------------------------------------------------------------------------------------------------
+struct WatchStats {
+    uint polls = 0;
+    uint64_t changes = 0;
+    chrono::nanoseconds dump{};             // summed
+    chrono::nanoseconds worst{};
+    chrono::nanoseconds diff{};
+};
+
+xload::Task<xload::Status> WatchProgram( xload::Executor& ex, uint period, uint polls,
+                                         function<bool( const string& )> emit, WatchStats& stats,
+                                         xload::CancelToken cancel ) {
+    uchar last[ PRG_BUFFER ], program[ PRG_BUFFER ];
+    uint16_t changed[ PRG_BUFFER ];
+
+    const uchar* shadow = ShadowProgram( true );
+    if( !shadow )
+        co_return XLOAD_ERROR_READ;
+
+    memcpy( last, shadow, PRG_BUFFER );
+    auto start = chrono::steady_clock::now();
+
+    while( polls == 0 || stats.polls < polls ) {
+        xload::Status st = co_await ex.Delay( period, cancel );
+        if( st != XLOAD_OK )
+            co_return st;
+
+        auto dumped = chrono::steady_clock::now();
+        st = g_device.DumpProgram( program );
+        auto compared = chrono::steady_clock::now();
+        if( st != XLOAD_OK )
+            co_return st;
+
+        uint n = DiffPrograms( last, program, changed );
+        auto done = chrono::steady_clock::now();
+
+        stats.polls++;
+        stats.dump += compared - dumped;
+        stats.diff += done - compared;
+        if( compared - dumped > stats.worst )
+            stats.worst = compared - dumped;
+
+        if( n == 0 )
+            continue;
+
+        stringstream s;
+        s << fixed << setprecision( 1 );
+        double ms = chrono::duration<double, milli>( dumped - start ).count();
+        for( uint i = 0; i < n; ++i ) {
+            uint prm = changed[ i ];
+            s << ms << " " << ParamLabel( prm ) << " " << int( last[ prm ] ) << " " << int( program[ prm ] ) << "\n";
+        }
+
+        stats.changes += n;
+        memcpy( last, program, PRG_BUFFER );
+        SetShadow( program );
+
+        if( !emit( s.str() ) )
+            co_return XLOAD_ERROR_WRITE;
+    }
+
+    co_return XLOAD_OK;
+}
+
+void Watch( const Command& cmd ) {
+    uint period = WATCH_PERIOD_MS;
+    uint polls = 0;
+    string sink;
+
+    uint numbers = 0;
+    for( auto arg : cmd.args ) {
+        uint value;
+        bool number = ParseNumber( arg, value );
+        if( number && numbers < 2 && sink.empty() )
+            ( numbers++ ? polls : period ) = value;
+        else if( !number && sink.empty() )
+            sink = string( arg );
+        else {
+            CommandError( ERROR_INVALID_ARGUMENTS );
+            return;
+        }
+    }
+
+    // Event sink
+    ofstream outfile;
+    SOCKET socket_out = INVALID_SOCKET;
+    function<bool( const string& )> emit;
+
+    if( sink.empty() ) {
+        emit = []( const string& events ) {
+            stringstream s;
+            size_t pos = 0;
+            for( size_t end; ( end = events.find( '\n', pos ) ) != string::npos; pos = end + 1 )
+                s << "  " << events.substr( pos, end + 1 - pos );
+
+            cout << s.str() << flush;
+            return true;
+        };
+    }
+    else if( sink.compare( 0, 4, "tcp:" ) == 0 ) {
+        WSADATA wsa;
+        sockaddr_in address;
+        bool winsock = WSAStartup( MAKEWORD( 2, 2 ), &wsa ) == 0;
+        if( winsock && ParseEndpoint( sink.substr( 4 ), address ) ) {
+            socket_out = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+            if( socket_out != INVALID_SOCKET &&
+                connect( socket_out, (sockaddr*) &address, sizeof( address ) ) == SOCKET_ERROR ) {
+                closesocket( socket_out );
+                socket_out = INVALID_SOCKET;
+            }
+        }
+
+        if( socket_out == INVALID_SOCKET ) {
+            if( winsock )
+                WSACleanup();
+
+            CommandError( ERROR_WATCH_CONNECT );
+            return;
+        }
+
+        // send() may take part of the buffer, the rest goes in the next calls
+        emit = [ & ]( const string& events ) {
+            for( size_t sent = 0; sent < events.size(); ) {
+                int n = send( socket_out, &events[ sent ], int( events.size() - sent ), 0 );
+                if( n <= 0 )
+                    return false;
+
+                sent += n;
+            }
+
+            return true;
+        };
+    }
+    else {
+        outfile.open( sink, ios::out | ios::app );
+        if( !outfile.is_open() ) {
+            CommandError( ERROR_OPENING_FILE );
+            return;
+        }
+
+        emit = [ & ]( const string& events ) {
+            outfile << events << flush;
+            return bool( outfile );
+        };
+    }
+
+    xload::Executor ex;
+    auto cancel = ex.MakeCancel();
+    WatchStats stats;
+
+    auto start = chrono::steady_clock::now();
+    xload::Status st = RunCancellable( ex, WatchProgram( ex, period, polls, emit, stats, cancel.Token() ), cancel );
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+
+    if( socket_out != INVALID_SOCKET ) {
+        closesocket( socket_out );
+        WSACleanup();
+    }
+
+    auto ms = []( chrono::nanoseconds d ) { return chrono::duration<double, milli>( d ).count(); };
+    uint n = stats.polls ? stats.polls : 1;
+
+    stringstream s;
+    s << fixed << setprecision( 2 );
+    s << "  " << stats.polls << " polls in " << elapsed.count() << " ms, " << stats.changes << " changes" << endl;
+    double kbps = stats.polls * PRG_BUFFER / ( elapsed.count() > 1 ? elapsed.count() : 1 );
+    s << "  dump avg " << ms( stats.dump ) / n << " ms (max " << ms( stats.worst ) << "), diff avg "
+      << ms( stats.diff ) * 1000 / n << " us, " << kbps << " KB/s read" << endl;
+    cout << s.str();
+
+    if( st == XLOAD_ERROR_WRITE )
+        CommandError( ERROR_WATCH_SINK );
+    else if( st != XLOAD_OK && st != XLOAD_ERROR_CANCELLED )
+        CommandError( ERROR_READING_PROGRAM );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Program file watch
+//
+// 'i --watch filename' injects the file, then follows it until ESC: each time the file is written and has stayed
+// unchanged for WATCH_DEBOUNCE_MS, the parameters that differ from the last image sent go out as one 's' batch (a
+// 'j' inject above g_inject_fraction, see SetParams()). Changes come from ReadDirectoryChangesW on the folder, as
+// editors often save by replacing the file. A file shorter than a program is never sent: one found mid-save at the
+// start is injected on its first whole write.
+//---------------------------------------------------------------------------------------------------------------------
+bool SameFileName( const WCHAR* name, size_t length, const wstring& target ) {
+    if( length != target.size() )
+        return false;
+
+    for( size_t i = 0; i < length; ++i ) {
+        if( towlower( name[ i ] ) != towlower( target[ i ] ) )
+            return false;
+    }
+
+    return true;
+}
+
+// Asks for the next changes in 'folder', completing on 'overlapped'
+void RequestChanges( HANDLE folder, OVERLAPPED& overlapped, vector<DWORD>& buffer ) {
+    const DWORD FILTER = FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE;
+    ::ReadDirectoryChangesW( folder, &buffer[ 0 ], DWORD( buffer.size() * sizeof( DWORD ) ), FALSE, FILTER, NULL,
+                             &overlapped, NULL );
+}
+
+// Takes the completed changes of 'folder', true when they name 'target' (or overflowed), then asks for the next
+bool FileChanged( HANDLE folder, OVERLAPPED& overlapped, vector<DWORD>& buffer, const wstring& target ) {
+    DWORD bytes = 0;
+    bool changed = false;
+    if( ::GetOverlappedResult( folder, &overlapped, &bytes, FALSE ) ) {
+        changed = bytes == 0;
+        for( DWORD pos = 0; !changed && pos < bytes; ) {
+            auto info = (const FILE_NOTIFY_INFORMATION*) ( (const uchar*) &buffer[ 0 ] + pos );
+            changed = SameFileName( info->FileName, info->FileNameLength / sizeof( WCHAR ), target );
+            if( info->NextEntryOffset == 0 )
+                break;
+
+            pos += info->NextEntryOffset;
+        }
+    }
+
+    RequestChanges( folder, overlapped, buffer );
+    return changed;
+}
+
+// 'last' is the program the device holds, unless 'loaded' is false: then the first whole file read is injected
+xload::Task<xload::Status> FollowProgramFile( xload::Executor& ex, const string& file, uchar* last, bool loaded,
+                                              xload::CancelToken cancel ) {
+    filesystem::path path = filesystem::absolute( file );
+    wstring target = path.filename().wstring();
+
+    HANDLE folder = ::CreateFileA( path.parent_path().string().c_str(), FILE_LIST_DIRECTORY,
+                                   FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+                                   FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL );
+    if( folder == INVALID_HANDLE_VALUE )
+        co_return XLOAD_ERROR_ARGUMENT;
+
+    OVERLAPPED overlapped = {};
+    overlapped.hEvent = ::CreateEventA( NULL, TRUE, FALSE, NULL );
+    vector<DWORD> buffer( 1024 );           // DWORD aligned
+    RequestChanges( folder, overlapped, buffer );
+
+    xload::Status st = XLOAD_OK;
+    while( st == XLOAD_OK ) {
+        st = co_await ex.Signal( overlapped.hEvent, cancel );
+        if( st != XLOAD_OK || !FileChanged( folder, overlapped, buffer, target ) )
+            continue;
+
+        // Debounce: until a whole period passes without another write
+        auto written = chrono::steady_clock::now();
+        for( ;; ) {
+            st = co_await ex.Delay( WATCH_DEBOUNCE_MS, cancel );
+            if( st != XLOAD_OK || ::WaitForSingleObject( overlapped.hEvent, 0 ) != WAIT_OBJECT_0 )
+                break;
+
+            if( FileChanged( folder, overlapped, buffer, target ) )
+                written = chrono::steady_clock::now();
+        }
+
+        if( st != XLOAD_OK )
+            break;
+
+        // A file caught half written is taken on its next write
+        uchar program[ PRG_BUFFER ];
+        ifstream infile( file, ios::in | ios::binary );
+        if( !infile.read( (char*) program, PRG_BUFFER ) )
+            continue;
+
+        if( !loaded ) {
+            if( InjectProgram( program ) != 0 ) {
+                st = XLOAD_ERROR_WRITE;
+                break;
+            }
+
+            memcpy( last, program, PRG_BUFFER );
+            loaded = true;
+            cout << "  Program loaded." << endl;
+            continue;
+        }
+
+        uint16_t changed[ PRG_BUFFER ];
+        uint n = DiffPrograms( last, program, changed );
+        if( n == 0 )
+            continue;
+
+        vector<ParamChange> changes;
+        for( uint i = 0; i < n; ++i )
+            changes.push_back( { changed[ i ], program[ changed[ i ] ] } );
+
+        auto sent = chrono::steady_clock::now();
+        if( SetParams( changes ) != 0 ) {
+            st = XLOAD_ERROR_WRITE;
+            break;
+        }
+
+        auto done = chrono::steady_clock::now();
+        memcpy( last, program, PRG_BUFFER );
+
+        stringstream s;
+        s << fixed << setprecision( 2 );
+        s << "  " << n << ( n == 1 ? " parameter" : " parameters" )
+          << ( n > g_inject_fraction * PRG_BUFFER ? " (injected)" : "" ) << ", sent in "
+          << chrono::duration<double, milli>( done - sent ).count() << " ms, "
+          << chrono::duration<double, milli>( done - written ).count() << " ms after the last write" << endl;
+        cout << s.str() << flush;
+    }
+
+    ::CancelIoEx( folder, &overlapped );
+    ::CloseHandle( overlapped.hEvent );
+    ::CloseHandle( folder );
+    co_return st;
+}
+
+void WatchProgramFile( const string& file ) {
+    uchar last[ PRG_BUFFER ];
+    ifstream infile( file, ios::in | ios::binary );
+    if( !infile.is_open() ) {
+        CommandError( ERROR_OPENING_FILE );
+        return;
+    }
+
+    // A file caught mid-save is loaded on its next write
+    infile.read( (char*) last, PRG_BUFFER );
+    bool loaded = infile.gcount() == PRG_BUFFER;
+    infile.close();
+
+    if( loaded && InjectProgram( last ) != 0 ) {
+        CommandError( ERROR_LOADING_PROGRAM );
+        return;
+    }
+
+    cout << "  Watching " << file << ( loaded ? "" : ", not loaded until it is whole" ) << " (ESC stops)." << endl;
+
+    xload::Executor ex;
+    auto cancel = ex.MakeCancel();
+
+    timeBeginPeriod( 1 );
+    xload::Status st = RunCancellable( ex, FollowProgramFile( ex, file, last, loaded, cancel.Token() ), cancel );
+    timeEndPeriod( 1 );
+
+    if( st == XLOAD_ERROR_ARGUMENT )
+        CommandError( ERROR_OPENING_FILE );
+    else if( st == XLOAD_ERROR_WRITE )
+        CommandError( ERROR_LOADING_PROGRAM );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Program history
+//
+// After every command the host copy of the program is recorded when it changed. Snapshots are HISTORY_BLOCK-byte
+// blocks shared with the previous snapshot unless they differ, so an edit of one parameter costs one block: 'undo',
+// 'redo' and 'ab' move between snapshots and send only what differs, blocks shared by both being skipped unread.
+// At most HISTORY_SIZE snapshots are kept, the oldest going first; 'snap name' names the current one. Snapshots
+// are numbered in the order they were taken. The two of an 'ab' pair stay while it is set, even when an edit drops
+// the undone snapshots after them: 'undo' then passes through them.
+//---------------------------------------------------------------------------------------------------------------------
+uint32_t AddBlock( const uchar* data ) {
+    auto& h = g_history;
+    uint32_t b = uint32_t( h.blocks.size() );
+    if( h.unused.empty() ) {
+        h.blocks.emplace_back();
+        h.refs.push_back( 0 );
+    }
+    else {
+        b = h.unused.back();
+        h.unused.pop_back();
+    }
+
+    memcpy( h.blocks[ b ].data(), data, HISTORY_BLOCK );
+    return b;
+}
+
+void DropSnapshot( const ProgramSnapshot& snapshot ) {
+    auto& h = g_history;
+    for( auto b : snapshot.blocks ) {
+        if( --h.refs[ b ] == 0 )
+            h.unused.push_back( b );
+    }
+
+    h.names.erase( snapshot.number );
+}
+
+const uchar* BlockData( uint32_t b ) {
+    return g_history.blocks[ b ].data();
+}
+
+// 'program' as a snapshot, sharing the blocks 'previous' has unchanged
+ProgramSnapshot MakeSnapshot( const uchar* program, const ProgramSnapshot* previous ) {
+    ProgramSnapshot snapshot;
+    for( uint b = 0; b < HISTORY_BLOCKS; ++b ) {
+        const uchar* data = &program[ b * HISTORY_BLOCK ];
+        if( previous && memcmp( BlockData( previous->blocks[ b ] ), data, HISTORY_BLOCK ) == 0 )
+            snapshot.blocks[ b ] = previous->blocks[ b ];
+        else
+            snapshot.blocks[ b ] = AddBlock( data );
+
+        g_history.refs[ snapshot.blocks[ b ] ]++;
+    }
+
+    snapshot.number = g_history.next++;
+    return snapshot;
+}
+
+ProgramSnapshot& CurrentSnapshot() {
+    return g_history.entries[ g_history.position ];
+}
+
+// One of the 'ab' pair
+bool PairSnapshot( const ProgramSnapshot& snapshot ) {
+    auto& h = g_history;
+    return h.ab_set && ( snapshot.number == h.ab[ 0 ] || snapshot.number == h.ab[ 1 ] );
+}
+
+// Records the host copy when it differs from the current snapshot; later snapshots (undone) are dropped
+void RecordHistory() {
+    auto& h = g_history;
+    if( !g_shadow.valid )
+        return;
+
+    const ProgramSnapshot* current = h.entries.empty() ? nullptr : &CurrentSnapshot();
+    if( current ) {
+        uint b = 0;
+        while( b < HISTORY_BLOCKS &&
+               memcmp( BlockData( current->blocks[ b ] ), &g_shadow.program[ b * HISTORY_BLOCK ], HISTORY_BLOCK ) == 0 )
+            ++b;
+
+        if( b == HISTORY_BLOCKS )
+            return;
+
+        for( size_t i = h.entries.size() - 1; i > h.position; --i ) {
+            if( !PairSnapshot( h.entries[ i ] ) ) {
+                DropSnapshot( h.entries[ i ] );
+                h.entries.erase( h.entries.begin() + i );
+            }
+        }
+    }
+
+    auto snapshot = MakeSnapshot( g_shadow.program, h.entries.empty() ? nullptr : &CurrentSnapshot() );
+    h.entries.push_back( snapshot );
+    if( h.entries.size() > HISTORY_SIZE ) {
+        size_t oldest = 0;
+        while( PairSnapshot( h.entries[ oldest ] ) )
+            oldest++;
+
+        DropSnapshot( h.entries[ oldest ] );
+        h.entries.erase( h.entries.begin() + oldest );
+    }
+
+    h.position = h.entries.size() - 1;
+}
+
+// Index of snapshot 'number', -1 if it is gone
+int SnapshotIndex( uint64_t number ) {
+    auto& h = g_history;
+    auto i = lower_bound( h.entries.begin(), h.entries.end(), number,
+                          []( const ProgramSnapshot& e, uint64_t n ) { return e.number < n; } );
+
+    return i != h.entries.end() && i->number == number ? int( i - h.entries.begin() ) : -1;
+}
+
+// Index of a snapshot by number or name, -1 if there is none
+int FindSnapshot( string_view id ) {
+    auto& h = g_history;
+    uint n;
+    if( ParseNumber( id, n ) )
+        return SnapshotIndex( n );
+
+    for( auto& n : h.names ) {
+        if( n.second == id )
+            return SnapshotIndex( n.first );
+    }
+
+    return -1;
+}
+
+// Sends what differs between the current snapshot and snapshot 'index', which becomes current
+void Checkout( size_t index ) {
+    auto& h = g_history;
+    const ProgramSnapshot& from = CurrentSnapshot();
+    const ProgramSnapshot& to = h.entries[ index ];
+
+    vector<ParamChange> changes;
+    uint16_t changed[ HISTORY_BLOCK ];
+    for( uint b = 0; b < HISTORY_BLOCKS; ++b ) {
+        if( from.blocks[ b ] == to.blocks[ b ] )
+            continue;
+
+        const uchar* data = BlockData( to.blocks[ b ] );
+        uint n = DiffBytes( BlockData( from.blocks[ b ] ), data, HISTORY_BLOCK, changed );
+        for( uint i = 0; i < n; ++i )
+            changes.push_back( { b * HISTORY_BLOCK + changed[ i ], data[ changed[ i ] ] } );
+    }
+
+    auto start = chrono::steady_clock::now();
+    if( SetParams( changes ) != 0 ) {
+        CommandError( ERROR_LOADING_PROGRAM );
+        return;
+    }
+
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    h.position = index;
+
+    stringstream s;
+    s << fixed << setprecision( 2 );
+    s << "  #" << to.number;
+    if( h.names.count( to.number ) )
+        s << " (" << h.names[ to.number ] << ")";
+
+    s << ": " << changes.size() << ( changes.size() == 1 ? " parameter" : " parameters" ) << " sent in "
+      << elapsed.count() << " ms" << endl;
+    cout << s.str();
+}
+
+// Brings the history up to date with the device's program, false when it cannot be read
+bool SyncHistory() {
+    if( !ShadowProgram( false ) ) {
+        CommandError( ERROR_READING_PROGRAM );
+        return false;
+    }
+
+    RecordHistory();
+    return true;
+}
+
+// 'undo [N]', 'redo [N]': N snapshots back or forward
+void Undo( const Command& cmd ) {
+    if( !SyncHistory() )
+        return;
+
+    auto& h = g_history;
+    size_t steps = cmd.numbers.empty() ? 1 : cmd.numbers[ 0 ];
+    bool back = cmd.name == "undo";
+    size_t room = back ? h.position : h.entries.size() - 1 - h.position;
+    if( steps > room )
+        steps = room;
+
+    if( steps == 0 ) {
+        cout << "  Nothing to " << cmd.name << "." << endl;
+        return;
+    }
+
+    Checkout( back ? h.position - steps : h.position + steps );
+}
+
+// 'ab A B' switches to snapshot A (number or name) and remembers B; 'ab' then flips between the two
+void AB( const Command& cmd ) {
+    if( !SyncHistory() )
+        return;
+
+    auto& h = g_history;
+    if( cmd.args.size() == 2 ) {
+        int a = FindSnapshot( cmd.args[ 0 ] );
+        int b = FindSnapshot( cmd.args[ 1 ] );
+        if( a < 0 || b < 0 ) {
+            CommandError( ERROR_INVALID_SNAPSHOT );
+            return;
+        }
+
+        h.ab[ 0 ] = h.entries[ a ].number;
+        h.ab[ 1 ] = h.entries[ b ].number;
+        h.ab_set = true;
+        Checkout( a );
+        return;
+    }
+
+    // Without a pair: the current snapshot and the one before it
+    if( !h.ab_set || SnapshotIndex( h.ab[ 0 ] ) < 0 || SnapshotIndex( h.ab[ 1 ] ) < 0 ) {
+        if( h.position == 0 ) {
+            CommandError( ERROR_INVALID_SNAPSHOT );
+            return;
+        }
+
+        h.ab[ 0 ] = CurrentSnapshot().number;
+        h.ab[ 1 ] = h.entries[ h.position - 1 ].number;
+        h.ab_set = true;
+    }
+
+    // To whichever of the two the program is not at
+    Checkout( SnapshotIndex( CurrentSnapshot().number == h.ab[ 1 ] ? h.ab[ 0 ] : h.ab[ 1 ] ) );
+}
+
+// 'snap name' names the current snapshot
+void Snap( const Command& cmd ) {
+    if( !SyncHistory() || g_history.entries.empty() )
+        return;
+
+    g_history.names[ CurrentSnapshot().number ] = string( cmd.args[ 0 ] );
+    cout << "  #" << CurrentSnapshot().number << " is '" << cmd.args[ 0 ] << "'." << endl;
+}
+
+// 'history [N]': the last N snapshots, and the memory they share
+void History( const Command& cmd ) {
+    auto& h = g_history;
+    size_t count = cmd.numbers.empty() ? 20 : cmd.numbers[ 0 ];
+    size_t from = h.entries.size() > count ? h.entries.size() - count : 0;
+
+    stringstream s;
+    uint16_t changed[ HISTORY_BLOCK ];
+    for( size_t i = from; i < h.entries.size(); ++i ) {
+        auto& e = h.entries[ i ];
+
+        uint n = 0;
+        for( uint b = 0; i > 0 && b < HISTORY_BLOCKS; ++b ) {
+            uint32_t before = h.entries[ i - 1 ].blocks[ b ];
+            if( e.blocks[ b ] != before )
+                n += DiffBytes( BlockData( before ), BlockData( e.blocks[ b ] ), HISTORY_BLOCK, changed );
+        }
+
+        s << ( i == h.position ? "> #" : "  #" ) << left << setw( 6 ) << e.number << right;
+        s << setw( 4 ) << n << " changed  " << ( h.names.count( e.number ) ? h.names[ e.number ] : "" ) << endl;
+    }
+
+    size_t blocks = h.blocks.size() - h.unused.size();
+    size_t bytes = h.blocks.size() * ( HISTORY_BLOCK + sizeof( uint32_t ) );
+    bytes += h.entries.size() * sizeof( ProgramSnapshot );
+    s << "  " << h.entries.size() << " snapshots in " << blocks << " blocks, " << bytes / 1024 << " KB ("
+      << h.entries.size() * PRG_BUFFER / 1024 << " KB as copies)" << endl;
+    cout << s.str();
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// ReadProgram
+//
+//---------------------------------------------------------------------------------------------------------------------
+// The slot is now the active program: take it from the bank cache when this session read or wrote the bank, else
+// from the device (a cache file from an earlier session misses edits made on the device since)
+void ShadowSlot( uint prg ) {
+    if( LoadBankCache() && g_bank_cache.current )
+        SetShadow( &g_bank_cache.bank[ prg * PRG_BUFFER ] );
+    else
+        ShadowProgram( true );
+}
+
+xload::Status ReadProgramSlot( uint prg ) {
+    xload::Status st = g_device.ReadProgram( prg );
+    if( st != XLOAD_OK ) {
+        InvalidateShadow();
+        return st;
+    }
+
+    ShadowSlot( prg );
+    return XLOAD_OK;
+}
+
+void ReadProgram( const Command& cmd ) {
+
+    uint prm = cmd.numbers[ 0 ];
+    if( prm >= NUM_PROGRAMS ) {
+        CommandError( ERROR_INVALID_PROGRAM_NUMBER );
+        return;
+    }
+
+    xload::Status st = ReadProgramSlot( prm );
+    if( st != XLOAD_OK ) {
+        CommandError( ERROR_READING_PROGRAM, st );
+    }
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// WriteProgram
+//
+//---------------------------------------------------------------------------------------------------------------------
+void WriteProgram( const Command& cmd ) {
+    uint prm = cmd.numbers[ 0 ];
+    if( prm >= NUM_PROGRAMS ) {
+        CommandError( ERROR_INVALID_PROGRAM_NUMBER );
+        return;
+    }
+
+    xload::Status st = g_device.WriteProgram( prm );
+    if( st != XLOAD_OK ) {
+        InvalidateBankCache();
+        CommandError( ERROR_WRITING_PROGRAM, st );
+        return;
+    }
+
+    // The slot now holds the active program: keep the cached bank current from the shadow, or drop it
+    if( g_shadow.valid ) {
+        UpdateBankCache( prm, g_shadow.program );
+        SaveBankCache();
+    }
+    else
+        InvalidateBankCache();
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// SetChannel
+//
+//---------------------------------------------------------------------------------------------------------------------
+void SetChannel( const Command& cmd ) {
+
+    if( cmd.args.empty() ) {
+        // Get MIDI Channel
+        uchar channel;
+        xload::Status st = g_device.GetChannel( channel );
+        if( st != XLOAD_OK ) {
+            CommandError( ERROR_READING_CHANNEL, st );
+            return;
+        }
+
+        cout << int( channel ) << endl;
+    }
+    else {
+        // Set MIDI Channel
+        for( uint i = 0; i < cmd.numbers.size(); ++i ) {
+            uint prm = cmd.numbers[ i ];
+            if( prm > 16 ) {
+                CommandError( ERROR_INVALID_CHANNEL );
+                return;
+            }
+
+            // Part N takes set_midi_channel ( * 9+N ), the device echoes the channel
+            xload::Status st = g_device.SetChannel( i + 1, prm );
+            if( st != XLOAD_OK ) {
+                CommandError( ERROR_WRITING_CHANNEL, st );
+                return;
+            }
+        }
+    }
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Device groups
+//
+// 'group name serial ...' (or 'all') makes a group of XVA1 devices, each on its own link with its own I/O thread, and
+// '@name s ...', '@name i [file | @N]', '@name r prg' and '@name * ...' go to every member. The command is checked and
+// encoded once; the threads take the same bytes and spin until a release time GROUP_LEAD_US after posting, so the
+// writes go out together whatever the group size. The write spread is that of the moments the writes returned on the
+// host, reported per command against one USB microframe: it tells when the bytes went to each driver, not when the
+// devices took them. Answers not in within GROUP_TIMEOUT_MS fail the member, late ones are dropped before its next
+// command. The terminal's device can be a member (it keeps its link and its shadow), as can a device of another group.
+// 'group' lists devices and groups, 'group name clear' closes one.
+//---------------------------------------------------------------------------------------------------------------------
+DeviceGroup::~DeviceGroup() {
+    {
+        lock_guard<mutex> l( lock );
+        stop = true;
+    }
+
+    changed.notify_all();
+    for( auto& m : members ) {
+        if( m->io.joinable() )
+            m->io.join();
+    }
+}
+
+// Waits for 'size' bytes from 'device' until 'deadline', as reads do not time out
+xload::Status AwaitAnswer( xload_device* device, size_t size, chrono::steady_clock::time_point deadline ) {
+    for( ;; ) {
+        size_t queued = 0;
+        xload::Status st = xload_available( device, &queued );
+        if( st != XLOAD_OK || queued >= size )
+            return st;
+
+        if( chrono::steady_clock::now() >= deadline )
+            return XLOAD_ERROR_READ;
+
+        Sleep( 1 );
+    }
+}
+
+// I/O thread of member 'm': writes every frame posted to 'g', then reads and checks its answers
+void GroupIo( DeviceGroup& g, GroupMember& m ) {
+    SetThreadPriority( GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL );
+    timeBeginPeriod( 1 );
+
+    vector<uchar> reply;
+    uint64_t done = 0;
+    for( ;; ) {
+        {
+            unique_lock<mutex> l( g.lock );
+            g.changed.wait( l, [ & ] { return g.stop || g.generation != done; } );
+            if( g.stop )
+                break;
+
+            done = g.generation;
+        }
+
+        const GroupFrame& f = g.frame;
+        xload_device* device = m.shared ? g_device.Handle() : m.device->Handle();
+
+        // Answers that came after the last command timed out
+        size_t stale = 0;
+        if( m.timed_out && xload_available( device, &stale ) == XLOAD_OK && stale ) {
+            reply.resize( stale );
+            xload_read( device, &reply[ 0 ], stale );
+        }
+
+        WaitUntil( f.release, {} );
+        m.start = chrono::steady_clock::now();
+        xload::Status st = xload_write( device, &f.data[ 0 ], f.data.size() );
+        m.sent = chrono::steady_clock::now();
+
+        // One answer per command, in order
+        m.timed_out = false;
+        if( st == XLOAD_OK && f.reply ) {
+            reply.resize( f.reply );
+            st = AwaitAnswer( device, reply.size(), f.release + chrono::milliseconds( GROUP_TIMEOUT_MS ) );
+            m.timed_out = st == XLOAD_ERROR_READ;
+            if( st == XLOAD_OK )
+                st = xload_read( device, &reply[ 0 ], reply.size() );
+
+            for( size_t i = 0, at = 0; st == XLOAD_OK && i < f.commands.size(); at += f.replies[ i++ ].reply ) {
+                if( !xload::protocol::Accept( f.replies[ i ], &f.data[ f.commands[ i ] ], &reply[ at ] ) )
+                    st = XLOAD_ERROR_REPLY;
+            }
+        }
+
+        lock_guard<mutex> l( g.lock );
+        m.status = st;
+        if( ++g.finished == g.members.size() )
+            g.changed.notify_all();
+    }
+
+    timeEndPeriod( 1 );
+}
+
+// Appends opcode 'Op' to 'f'
+template<class Op, class... Args>
+void AddCommand( GroupFrame& f, Args... args ) {
+    size_t at = f.data.size();
+    f.data.resize( at + Op::max_request );
+    f.data.resize( at + Op::EncodeAt( &f.data[ at ], args... ) );
+
+    if( Op::reply ) {
+        f.commands.push_back( at );
+        f.replies.push_back( Op::descriptor );
+        f.reply += Op::reply;
+    }
+}
+
+// Runs 'cmd' (s, i, r or *) on every member of group 'name'
+void RunGroup( string_view name, const Command& cmd ) {
+    auto found = g_groups.find( name );
+    if( found == g_groups.end() ) {
+        CommandError( ERROR_NO_GROUP );
+        return;
+    }
+
+    DeviceGroup& g = *found->second;
+
+    GroupFrame f;
+    vector<ParamChange> changes;
+    uchar buffer[ PRG_BUFFER ];
+    const uchar* program = nullptr;
+    uint slot = 0;
+
+    switch( cmd.name[ 0 ] ) {
+        case 's':
+            if( !ParamChanges( cmd, changes ) )
+                return;
+
+            for( auto& c : changes )
+                AddCommand<xload::protocol::SetParam>( f, uint16_t( c.prm ), c.value );
+            break;
+
+        case 'i':
+            if( cmd.args.size() > 1 ) {
+                CommandError( ERROR_GROUP_COMMAND );
+                return;
+            }
+
+            if( cmd.args.empty() ) {
+                AddCommand<xload::protocol::InitProgram>( f );
+                break;
+            }
+
+            program = ProgramSource( string( cmd.args[ 0 ] ), buffer );
+            if( !program )
+                return;
+
+            AddCommand<xload::protocol::InjectProgram>( f, program );
+            break;
+
+        case 'r':
+            slot = cmd.numbers[ 0 ];
+            if( slot >= NUM_PROGRAMS ) {
+                CommandError( ERROR_INVALID_PROGRAM_NUMBER );
+                return;
+            }
+
+            AddCommand<xload::protocol::ReadProgram>( f, uchar( slot ) );
+            break;
+
+        default:
+            if( cmd.args.empty() ) {
+                CommandError( ERROR_GROUP_COMMAND );
+                return;
+            }
+
+            for( uint i = 0; i < cmd.numbers.size(); ++i ) {
+                if( cmd.numbers[ i ] > 16 ) {
+                    CommandError( ERROR_INVALID_CHANNEL );
+                    return;
+                }
+
+                AddCommand<xload::protocol::SetChannel>( f, uchar( i + 1 ), uchar( cmd.numbers[ i ] ) );
+            }
+            break;
+    }
+
+    {
+        unique_lock<mutex> l( g.lock );
+        g.frame = move( f );
+        g.frame.release = chrono::steady_clock::now() + chrono::microseconds( GROUP_LEAD_US );
+        g.finished = 0;
+        g.generation++;
+        g.changed.notify_all();
+        g.changed.wait( l, [ & ] { return g.finished == g.members.size(); } );
+    }
+
+    auto first = g.members[ 0 ]->sent;
+    auto last = first;
+    GroupMember* shared = nullptr;
+    for( auto& m : g.members ) {
+        first = m->sent < first ? m->sent : first;
+        last = m->sent > last ? m->sent : last;
+        if( m->shared )
+            shared = m.get();
+
+        if( m->timed_out ) {
+            CommandError( ERROR_GROUP_TIMEOUT );
+            cout << m->serial << ".\n";
+        }
+        else if( m->status != XLOAD_OK ) {
+            CommandError( ERROR_GROUP_MEMBER );
+            cout << m->serial << " (" << xload::StatusText( m->status ) << ").\n";
+        }
+    }
+
+    chrono::nanoseconds spread = last - first;
+    g.frames++;
+    g.spread += spread;
+    g.worst = spread > g.worst ? spread : g.worst;
+    g.late += spread > chrono::microseconds( GROUP_FRAME_US );
+
+    stringstream s;
+    s << fixed << setprecision( 1 ) << "  " << g.members.size() << " devices, write spread "
+      << chrono::duration<double, micro>( spread ).count() << " us"
+      << ( spread > chrono::microseconds( GROUP_FRAME_US ) ? " (over one USB frame)" : "" ) << endl;
+    cout << s.str();
+
+    // The terminal's device took part: keep its shadow as the single-device command would
+    if( !shared )
+        return;
+
+    if( shared->status != XLOAD_OK ) {
+        InvalidateShadow();
+        return;
+    }
+
+    if( cmd.name[ 0 ] == 's' ) {
+        for( auto& c : changes )
+            SetShadowParam( c.prm, c.value );
+    }
+    else if( cmd.name[ 0 ] == 'i' ) {
+        if( program )
+            SetShadow( program );
+        else
+            InvalidateShadow();
+    }
+    else if( cmd.name[ 0 ] == 'r' ) {
+        ShadowSlot( slot );
+    }
+}
+
+// Link of an open member 'serial' of any group, to share rather than open the device twice
+shared_ptr<xload::Device> GroupLink( const string& serial ) {
+    for( auto& [ name, g ] : g_groups ) {
+        for( auto& m : g->members ) {
+            if( m->serial == serial && m->device )
+                return m->device;
+        }
+    }
+
+    return nullptr;
+}
+
+void Group( const Command& cmd ) {
+    auto attached = xload::List();
+
+    if( cmd.args.empty() ) {
+        stringstream s;
+        s << fixed << setprecision( 1 ) << "  Devices:";
+        for( auto& serial : attached )
+            s << " " << serial << ( serial == g_device_serial ? " (terminal)" : "" );
+        s << endl;
+
+        for( auto& [ name, g ] : g_groups ) {
+            s << "  " << name << ":";
+            for( auto& m : g->members )
+                s << " " << m->serial;
+
+            if( g->frames ) {
+                s << "  " << g->frames << " commands, write spread "
+                  << chrono::duration<double, micro>( g->spread ).count() / g->frames << " us mean, " << chrono::duration<double, micro>( g->worst ).count() << " us worst, " << g->late
+                  << " over one USB frame";
+            }
+            s << endl;
+        }
+
+        cout << s.str();
+        return;
+    }
+
+    if( cmd.args.size() < 2 ) {
+        CommandError( ERROR_INVALID_ARGUMENTS );
+        return;
+    }
+
+    // Closed first: its members may be listed again
+    string name( cmd.args[ 0 ] );
+    g_groups.erase( name );
+    if( cmd.args[ 1 ] == "clear" )
+        return;
+
+    vector<string> serials;
+    for( size_t i = 1; i < cmd.args.size(); ++i ) {
+        if( cmd.args[ i ] == "all" )
+            serials.insert( serials.end(), attached.begin(), attached.end() );
+        else
+            serials.push_back( string( cmd.args[ i ] ) );
+    }
+
+    auto g = make_unique<DeviceGroup>();
+    for( auto& serial : serials ) {
+        bool listed = false;
+        for( auto& m : g->members )
+            listed |= m->serial == serial;
+
+        if( listed )
+            continue;
+
+        auto m = make_unique<GroupMember>();
+        m->serial = serial;
+        m->shared = g_device.IsOpen() && serial == g_device_serial;
+        if( !m->shared )
+            m->device = GroupLink( serial );
+
+        if( !m->shared && !m->device ) {
+            m->device = make_shared<xload::Device>();
+            xload::Status st = m->device->OpenSerial( serial.c_str(), BAUDRATE, LATENCY_STD );
+            if( st != XLOAD_OK ) {
+                CommandError( ERROR_GROUP_DEVICE );
+                cout << serial << " (" << xload::StatusText( st ) << ").\n";
+                return;
+            }
+        }
+
+        g->members.push_back( move( m ) );
+    }
+
+    if( g->members.empty() ) {
+        CommandError( ERROR_INVALID_ARGUMENTS );
+        return;
+    }
+
+    for( auto& m : g->members )
+        m->io = thread( GroupIo, ref( *g ), ref( *m ) );
+
+    cout << "  " << name << ": " << g->members.size() << " devices." << endl;
+    g_groups[ name ] = move( g );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// NameProgram
+//
+//---------------------------------------------------------------------------------------------------------------------
+void NameProgram( const Command& cmd ) {
+
+    if( cmd.args.empty() ) {
+        // Display name, from the shadow unless forced ('n -f')
+        const uchar* buffer = ShadowProgram( cmd.force );
+        if( !buffer ) {
+            CommandError( ERROR_READING_PROGRAM );
+            return;
+        }
+
+
+        // Display program name
+        string s( (const char*) &buffer[ PROGRAM_NAME_OFFSET ], PROGRAM_NAME_LEN );
+        cout << s << endl;
+    }
+    else {
+        // Set name, all characters in one batch
+        string_view name = cmd.rest;
+
+        vector<ParamChange> changes;
+        for( uint i = 0; i < PROGRAM_NAME_LEN; ++i )
+            changes.push_back( { PROGRAM_NAME_OFFSET + i, uchar( i < name.length() ? name[ i ] : ' ' ) } );
+
+        if( SetParams( changes ) != 0 )
+            CommandError( ERROR_WRITING_PARAMS );
+    }
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Audio recording
+//
+// '. filename' records the audio stream to a WAV file in the background and returns to the prompt; '.' stops. The
+// link thread reads the stream a chunk at a time straight into the capture ring, the disk thread writes the ring to
+// the file, so neither waits on the other and the terminal waits on neither. The XVA1 stream has no framing to carry
+// replies, so during a take only commands that write without an answer run (s, n, undo, automate, the parameter
+// queue), see CMD_TAKE; g, d and n answer from the host copy, filled before the stream starts. A take still running
+// when a command list ends stops on ESC, as '.' used to.
+//
+// Each write is marked with the number of sample frames recorded when it went out. A mark appends its cue point and
+// label to chunk images kept next to the marks, so the audio path never sees them and finishing the file appends
+// both images as they are: a 'cue ' chunk and a LIST 'adtl' chunk of 'labl' entries after the data. The marks also
+// go to 'filename.json' with the format, length and dropped samples of the take.
+//
+// '. filename share' also publishes the stream in shared memory (xload_ring.hpp): the link thread copies every chunk
+// into a block other processes read, two thirds of a millisecond after it arrived. The file is written from the
+// process's own ring, never from the shared one. Readers keep their own cursors and are never waited for; the ones
+// the stream laps are counted in the take summary.
+//
+// The file survives a crash. It is valid from the start, an empty WAV, and its space is reserved TAKE_EXTENT at a
+// time so it grows in few large pieces. The audio starts on a page boundary (a JUNK chunk pads the header to WAV_DATA)
+// and goes out in TAKE_BLOCK writes at their own offsets. Every commit period ('. filename 250': 250 ms) the disk
+// thread writes the partial block, flushes, writes the header lengths that count it and flushes again, so a killed
+// process or a dead machine leaves a file that plays up to the last commit. Finishing the take cuts the reserve off.
+//---------------------------------------------------------------------------------------------------------------------
+// Little-endian 32-bit value, and a chunk header, appended to 'out'
+void PutU32( vector<uchar>& out, uint32_t value ) {
+    for( int i = 0; i < 4; ++i )
+        out.push_back( uchar( value >> ( 8 * i ) ) );
+}
+
+void PutChunk( vector<uchar>& out, const char* id, uint32_t size ) {
+    out.insert( out.end(), id, id + 4 );
+    PutU32( out, size );
+}
+
+// 'size' bytes of 'data' at 'offset' of a file
+bool WriteAt( HANDLE file, uint64_t offset, const void* data, size_t size ) {
+    LARGE_INTEGER at;
+    at.QuadPart = LONGLONG( offset );
+    DWORD written = 0;
+    return SetFilePointerEx( file, at, NULL, FILE_BEGIN ) && WriteFile( file, data, DWORD( size ), &written, NULL ) &&
+           written == size;
+}
+
+bool SetFileSize( HANDLE file, uint64_t size ) {
+    LARGE_INTEGER at;
+    at.QuadPart = LONGLONG( size );
+    return SetFilePointerEx( file, at, NULL, FILE_BEGIN ) && SetEndOfFile( file );
+}
+
+// Header of a take without audio: format, JUNK up to WAV_DATA, an empty 'data' chunk
+bool WriteWavHeader( HANDLE file ) {
+    vector<uchar> header;
+    PutChunk( header, "RIFF", WAV_DATA - 8 );
+    header.insert( header.end(), { 'W', 'A', 'V', 'E' } );
+
+    // PCM, 2 channels, 96 kHz, 6 bytes per frame, 24 bits, no extension
+    PutChunk( header, "fmt ", 18 );
+    PutU32( header, 1 | 2 << 16 );
+    PutU32( header, 96000 );
+    PutU32( header, 96000 * AUDIO_FRAME );
+    PutU32( header, AUDIO_FRAME | 24 << 16 );
+    header.insert( header.end(), { 0, 0 } );
+
+    PutChunk( header, "JUNK", uint32_t( WAV_DATA - header.size() - 16 ) );
+    header.resize( WAV_DATA - 8, 0 );
+    PutChunk( header, "data", 0 );
+
+    return WriteAt( file, 0, header.data(), header.size() );
+}
+
+// Lengths of a take holding 'bytes' of audio and 'extra' bytes of chunks after it
+bool WriteWavLengths( HANDLE file, uint64_t bytes, size_t extra ) {
+    vector<uchar> riff, data;
+    PutU32( riff, uint32_t( WAV_DATA - 8 + bytes + extra ) );
+    PutU32( data, uint32_t( bytes ) );
+    return WriteAt( file, 4, riff.data(), 4 ) && WriteAt( file, WAV_DATA - 4, data.data(), 4 );
+}
+
+// Appends 'chunks' (whole chunks) after 'bytes' of audio, sets the lengths and the real size, and closes the file
+bool FinishWav( HANDLE file, uint64_t bytes, const vector<vector<uchar>>& chunks = {} ) {
+    bool ok = true;
+    size_t extra = 0;
+    for( auto& chunk : chunks ) {
+        ok = ok && WriteAt( file, WAV_DATA + bytes + extra, chunk.data(), chunk.size() );
+        extra += chunk.size();
+    }
+
+    ok = ok && SetFileSize( file, WAV_DATA + bytes + extra ) && WriteWavLengths( file, bytes, extra ) &&
+         FlushFileBuffers( file );
+    CloseHandle( file );
+    return ok;
+}
+
+// Text as a JSON string
+string JsonString( string_view text ) {
+    string out = "\"";
+    for( char c : text ) {
+        if( c == '"' || c == '\\' )
+            out += '\\';
+
+        if( uchar( c ) < 32 ) {
+            char code[ 8 ];
+            snprintf( code, sizeof( code ), "\\u%04x", c );
+            out += code;
+        }
+        else
+            out += c;
+    }
+
+    return out + "\"";
+}
+
+// Link thread: the stream into the ring, whole chunks, until 'stop'
+void TakeLink( AudioTake& t ) {
+    SetThreadPriority( GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL );
+
+    uchar spill[ AUDIO_CHUNK ];
+    xload::Status st = XLOAD_OK;
+    bool shared = t.shared.Mapped();
+    while( !t.stop ) {
+        uint64_t head = t.head.load( memory_order_relaxed );
+        bool room = head - t.tail.load( memory_order_acquire ) + AUDIO_CHUNK <= TAKE_RING;
+
+        // The stream cannot wait: without room the chunk is read and dropped
+        st = g_device.AudioRead( room ? &t.ring[ head % TAKE_RING ] : spill, AUDIO_CHUNK );
+        if( st != XLOAD_OK )
+            break;
+
+        // A chunk is a block of the shared ring: readers see it once it is whole
+        if( room ) {
+            if( shared )
+                t.shared.Write( head / AUDIO_CHUNK, &t.ring[ head % TAKE_RING ] );
+
+            t.head.store( head + AUDIO_CHUNK, memory_order_release );
+        }
+        else
+            t.dropped += AUDIO_CHUNK;
+
+        t.ready.notify_one();
+    }
+
+    xload::Status stopped = g_device.AudioStop();
+    t.status = st != XLOAD_OK ? st : stopped;
+
+    lock_guard<mutex> l( t.lock );
+    t.finished = true;
+    t.waiter.Cancel();
+    t.ready.notify_one();
+}
+
+// 'size' bytes of the block staged for audio byte 'at', a whole one or the part filled so far. The file grows by a
+// whole extent first, SetEndOfFile allocating its clusters. The writes go in order from the end of the valid data, so
+// NTFS has nothing to zero ahead of them.
+void StoreBlock( AudioTake& t, uint64_t at, size_t size ) {
+    uint64_t offset = WAV_DATA + at;
+    if( t.write_failed || !size )
+        return;
+
+    if( offset + TAKE_BLOCK > t.reserved ) {
+        while( offset + TAKE_BLOCK > t.reserved )
+            t.reserved += TAKE_EXTENT;
+
+        if( !SetFileSize( t.out, t.reserved ) ) {
+            t.write_failed = true;
+            return;
+        }
+
+    }
+
+    t.write_failed = !WriteAt( t.out, offset, t.block.data(), size );
+}
+
+// Makes the audio received so far part of the file: audio first, then the lengths that count it, each flushed. A crash
+// in between leaves the last commit standing.
+void CommitTake( AudioTake& t ) {
+    uint64_t bytes = t.tail.load( memory_order_relaxed );
+    if( bytes == t.committed || t.write_failed )
+        return;
+
+    StoreBlock( t, bytes - bytes % TAKE_BLOCK, size_t( bytes % TAKE_BLOCK ) );
+    if( t.write_failed || !FlushFileBuffers( t.out ) || !WriteWavLengths( t.out, bytes, 0 ) ||
+        !FlushFileBuffers( t.out ) ) {
+        t.write_failed = true;
+        return;
+    }
+
+    t.committed = bytes;
+}
+
+// Disk thread: the ring into file blocks, every full one written at once, and a commit every commit period
+void TakeDisk( AudioTake& t ) {
+    auto commit = chrono::steady_clock::now() + t.commit_period;
+    for( ;; ) {
+        bool last = t.finished;
+        uint64_t tail = t.tail.load( memory_order_relaxed );
+        uint64_t head = t.head.load( memory_order_acquire );
+
+        if( head != tail ) {
+            size_t at = size_t( tail % TAKE_RING );
+            size_t fill = size_t( tail % TAKE_BLOCK );
+            size_t n = size_t( head - tail < TAKE_RING - at ? head - tail : TAKE_RING - at );
+            n = n < TAKE_BLOCK - fill ? n : TAKE_BLOCK - fill;
+
+            memcpy( &t.block[ fill ], &t.ring[ at ], n );
+            t.tail.store( tail + n, memory_order_release );
+            if( fill + n == TAKE_BLOCK )
+                StoreBlock( t, tail + n - TAKE_BLOCK, TAKE_BLOCK );
+        }
+        else if( last )
+            break;
+
+        if( chrono::steady_clock::now() >= commit ) {
+            CommitTake( t );
+            commit += t.commit_period;
+        }
+
+        // The file ends at the last commit: the stream stops, StopTake() reports it
+        if( t.write_failed ) {
+            t.stop = true;
+            return;
+        }
+
+        if( head == tail ) {
+            unique_lock<mutex> l( t.lock );
+            t.ready.wait_for( l, chrono::milliseconds( 10 ) );
+        }
+    }
+
+    uint64_t bytes = t.tail.load( memory_order_relaxed );
+    StoreBlock( t, bytes - bytes % TAKE_BLOCK, size_t( bytes % TAKE_BLOCK ) );
+}
+
+// Logs a parameter write about to go out, labeled with the running command line (or as an 's' line from the
+// automation and queue threads)
+void MarkTake( const uint16_t* params, const uchar* values, size_t count ) {
+    if( !g_take.active )
+        return;
+
+    TakeMark mark;
+    if( !g_command_line.empty() )
+        mark.command = string( g_command_line );
+    else {
+        mark.command = "s";
+        for( size_t i = 0; i < count; ++i )
+            mark.command += " " + to_string( params[ i ] ) + " " + to_string( values[ i ] );
+    }
+
+    lock_guard<mutex> l( g_take.lock );
+
+    // Position taken under the lock, so marks from several threads stay in order
+    mark.sample = g_take.head.load( memory_order_acquire ) / AUDIO_FRAME;
+    mark.at = chrono::steady_clock::now() - g_take.started;
+
+    // Cue point: id, position, 'data', chunk start, block start, sample offset
+    uint32_t id = uint32_t( g_take.marks.size() + 1 );
+    PutU32( g_take.cues, id );
+    PutU32( g_take.cues, uint32_t( mark.sample ) );
+    g_take.cues.insert( g_take.cues.end(), { 'd', 'a', 't', 'a' } );
+    PutU32( g_take.cues, 0 );
+    PutU32( g_take.cues, 0 );
+    PutU32( g_take.cues, uint32_t( mark.sample ) );
+
+    // Label: id, text with its zero, padded to an even size
+    uint32_t size = uint32_t( 4 + mark.command.size() + 1 );
+    PutChunk( g_take.labels, "labl", size );
+    PutU32( g_take.labels, id );
+    g_take.labels.insert( g_take.labels.end(), mark.command.begin(), mark.command.end() );
+    g_take.labels.push_back( 0 );
+    if( size & 1 )
+        g_take.labels.push_back( 0 );
+
+    mark.labels = g_take.labels.size();
+    g_take.marks.push_back( move( mark ) );
+}
+
+void StartTake( const string& file, bool share, uint commit_ms ) {
+    AudioTake& t = g_take;
+
+    t.out = CreateFileA( file.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL,
+                         NULL );
+    if( t.out == INVALID_HANDLE_VALUE || !WriteWavHeader( t.out ) ) {
+        if( t.out != INVALID_HANDLE_VALUE )
+            CloseHandle( t.out );
+
+        CommandError( ERROR_OPENING_FILE );
+        return;
+    }
+
+    if( share && !t.shared.Open( xload::ring::NAME, AUDIO_CHUNK, TAKE_RING / AUDIO_CHUNK, 96000, 2, 24 ) ) {
+        CloseHandle( t.out );
+        CommandError( ERROR_TAKE_RING );
+        return;
+    }
+
+    // The host copy answers g, d and n while the device streams
+    if( !ShadowProgram( false ) ) {
+        CloseHandle( t.out );
+        t.shared.Close();
+        CommandError( ERROR_TAKE_SHADOW );
+        return;
+    }
+
+    xload::Status st = g_device.AudioStart();
+    if( st != XLOAD_OK ) {
+        CloseHandle( t.out );
+        t.shared.Close();
+        CommandError( ERROR_TAKE_STREAM );
+        cout << xload::StatusText( st ) << ".\n";
+        return;
+    }
+
+    t.file = file;
+    t.memory.assign( TAKE_RING, 0 );
+    t.ring = t.memory.data();
+
+    t.block.assign( TAKE_BLOCK, 0 );
+    t.reserved = 0;
+    t.committed = 0;
+    t.commit_period = chrono::milliseconds( commit_ms );
+    t.write_failed = false;
+
+    t.head = 0;
+    t.tail = 0;
+    t.stop = false;
+    t.finished = false;
+    t.status = XLOAD_OK;
+    t.dropped = 0;
+    t.marks.clear();
+    t.cues.clear();
+    t.labels.clear();
+    t.started = chrono::steady_clock::now();
+    t.link = thread( TakeLink, ref( t ) );
+    t.disk = thread( TakeDisk, ref( t ) );
+    t.active = true;
+
+    Color( 12 );
+    cout << "  Recording... ";
+    Color( 10 );
+    cout << "('.' to finish, commands keep working).\n";
+}
+
+void StopTake() {
+    AudioTake& t = g_take;
+    if( !t.active )
+        return;
+
+    t.stop = true;
+    t.link.join();
+    t.disk.join();
+    t.active = false;
+
+    // After a write error the file holds what the last commit counted, and the marks inside it
+    uint64_t bytes = t.write_failed ? t.committed : t.tail.load();
+    uint64_t samples = bytes / AUDIO_FRAME;
+    size_t kept = 0;
+    while( kept < t.marks.size() && t.marks[ kept ].sample <= samples )
+        kept++;
+
+    if( kept < t.marks.size() ) {
+        t.cues.resize( kept * 24 );
+        t.labels.resize( kept ? t.marks[ kept - 1 ].labels : 0 );
+        t.marks.resize( kept );
+    }
+
+    // Markers: the chunk images as they are, behind their headers
+    vector<vector<uchar>> chunks;
+    if( !t.marks.empty() ) {
+        chunks.resize( 4 );
+        PutChunk( chunks[ 0 ], "cue ", uint32_t( 4 + t.cues.size() ) );
+        PutU32( chunks[ 0 ], uint32_t( t.marks.size() ) );
+        chunks[ 1 ] = move( t.cues );
+        PutChunk( chunks[ 2 ], "LIST", uint32_t( 4 + t.labels.size() ) );
+        chunks[ 2 ].insert( chunks[ 2 ].end(), { 'a', 'd', 't', 'l' } );
+        chunks[ 3 ] = move( t.labels );
+    }
+
+    if( !FinishWav( t.out, bytes, chunks ) )
+        t.write_failed = true;
+
+    t.out = INVALID_HANDLE_VALUE;
+
+    filesystem::path sidecar( t.file );
+    sidecar.replace_extension( ".json" );
+    ofstream json( sidecar, ios::out );
+    json << fixed << setprecision( 3 ) << "{\n  \"file\": "
+         << JsonString( filesystem::path( t.file ).filename().string() ) << ",\n  \"sample_rate\": 96000,\n  \"channels\": 2,\n  \"bits\": 24,\n  \"samples\": " << samples
+         << ",\n  \"dropped\": " << t.dropped / AUDIO_FRAME << ",\n  \"markers\": [";
+
+    for( size_t i = 0; i < t.marks.size(); ++i ) {
+        auto& m = t.marks[ i ];
+        json << ( i ? "," : "" ) << "\n    { \"id\": " << i + 1 << ", \"sample\": " << m.sample << ", \"ms\": "
+             << chrono::duration<double, milli>( m.at ).count() << ", \"command\": " << JsonString( m.command ) << " }";
+    }
+
+    json << ( t.marks.empty() ? "" : "\n  " ) << "]\n}\n";
+
+    if( t.status != XLOAD_OK ) {
+        CommandError( ERROR_TAKE_STREAM );
+        cout << xload::StatusText( t.status ) << ".\n";
+    }
+
+    if( t.write_failed )
+        CommandError( ERROR_TAKE_WRITE );
+
+    stringstream s;
+    s << fixed << setprecision( 2 ) << "  " << double( samples ) / 96000 << " s recorded, " << t.marks.size()
+      << " markers (" << sidecar.filename().string() << ")";
+    if( t.dropped )
+        s << ", " << t.dropped / AUDIO_FRAME << " samples dropped (disk too slow)";
+    if( t.shared.Mapped() ) {
+        s << ", " << t.shared.Readers() << " readers on " << xload::ring::NAME;
+        if( t.shared.Lapped() )
+            s << " (" << t.shared.Lapped() << " blocks overwritten before a reader had them)";
+    }
+    s << "." << endl;
+    cout << s.str();
+
+    t.shared.Close();
+    t.ring = nullptr;
+    t.memory = {};
+    t.block = {};
+    t.marks = {};
+    t.cues = {};
+    t.labels = {};
+}
+
+xload::Task<xload::Status> AwaitTake( xload::Executor& ex, xload::CancelToken token, xload::CancelToken finished ) {
+    xload::Status st = co_await ex.Until( [ = ]() { return token.Cancelled() || finished.Cancelled(); } );
+    co_return st;
+}
+
+// A take left running by a command list: until ESC, or the stream stops
+void WaitTake() {
+    if( !g_take.active )
+        return;
+
+    cout << "  Hit ESC to finish.\n";
+
+    xload::Executor ex;
+    auto cancel = ex.MakeCancel();
+    auto finished = ex.MakeCancel();
+    {
+        lock_guard<mutex> l( g_take.lock );
+        g_take.waiter = finished;
+        if( g_take.finished )
+            finished.Cancel();
+    }
+
+    RunCancellable( ex, AwaitTake( ex, cancel.Token(), finished.Token() ), cancel );
+
+    // The executor's event goes with it
+    {
+        lock_guard<mutex> l( g_take.lock );
+        g_take.waiter = xload::CancelSource();
+    }
+
+    StopTake();
+}
+
+void Record( const Command& cmd ) {
+    if( cmd.args.empty() ) {
+        if( !g_take.active )
+            CommandError( ERROR_NOT_RECORDING );
+
+        StopTake();
+        return;
+    }
+
+    if( g_take.active ) {
+        CommandError( ERROR_RECORDING );
+        return;
+    }
+
+    // After the file name: 'share' and the commit period, in either order
+    bool share = false;
+    uint commit_ms = TAKE_COMMIT_MS;
+    for( size_t i = 1; i < cmd.args.size(); ++i ) {
+        if( cmd.args[ i ] == "share" )
+            share = true;
+        else if( !ParseNumber( cmd.args[ i ], commit_ms ) || commit_ms < TAKE_COMMIT_MIN_MS ) {
+            CommandError( ERROR_INVALID_ARGUMENTS );
+            return;
+        }
+    }
+
+    StartTake( string( cmd.args[ 0 ] ), share, commit_ms );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Program library
+//
+// Bank files and program files held in memory, one program after the other, for searching without the device.
+//---------------------------------------------------------------------------------------------------------------------
+string ProgramName( const uchar* program ) {
+    string name( (const char*) &program[ PROGRAM_NAME_OFFSET ], PROGRAM_NAME_LEN );
+    for( auto& c : name ) {
+        if( c < 32 || c > 126 )
+            c = ' ';
+    }
+
+    return name.substr( 0, name.find_last_not_of( ' ' ) + 1 );
+}
+
+uint AddLibraryImage( const string& name, const uchar* data, uint count ) {
+    size_t first = g_library.entries.size();
+
+    g_library.programs.insert( g_library.programs.end(), data, data + size_t( count ) * PRG_BUFFER );
+
+    uint file = uint( g_library.files.size() );
+    g_library.files.push_back( { name, count } );
+
+    g_library.sketches.resize( ( first + count ) * SKETCH_SIZE );
+    for( uint i = 0; i < count; ++i ) {
+        g_library.entries.push_back( { file, i } );
+        ComputeSketch( &g_library.programs[ ( first + i ) * PRG_BUFFER ], &g_library.sketches[ ( first + i ) * SKETCH_SIZE ] );
+    }
+
+    return count;
+}
+
+uint AddLibraryFile( const string& filename ) {
+    error_code ec;
+    auto size = filesystem::file_size( filename, ec );
+    if( ec || ( size != PRG_BUFFER && size != BANK_SIZE ) )
+        return 0;
+
+    ifstream infile;
+    infile.open( filename, ios::in | ios::binary );
+    if( !infile.is_open() )
+        return 0;
+
+    vector<uchar> data( size );
+    infile.read( (char*) &data[ 0 ], size );
+    if( !infile )
+        return 0;
+
+    return AddLibraryImage( filename, &data[ 0 ], uint( size / PRG_BUFFER ) );
+}
+
+uint AddLibraryPath( const string& path ) {
+
+    // Bank read back from the device
+    if( path == "device" ) {
+        vector<uchar> bank( BANK_SIZE );
+        if( ReadBank( &bank[ 0 ], false ) != 0 )
+            return 0;
+
+        return AddLibraryImage( path, &bank[ 0 ], NUM_PROGRAMS );
+    }
+
+    error_code ec;
+    if( !filesystem::is_directory( path, ec ) )
+        return AddLibraryFile( path );
+
+    uint count = 0;
+    for( filesystem::recursive_directory_iterator it( path, ec ), end; !ec && it != end; it.increment( ec ) ) {
+        if( it->is_regular_file( ec ) )
+            count += AddLibraryFile( it->path().string() );
+    }
+
+    return count;
+}
+
+string LibrarySource( uint entry ) {
+    auto& e = g_library.entries[ entry ];
+    auto& f = g_library.files[ e.file ];
+
+    return f.programs > 1 ? f.name + ":" + to_string( e.slot ) : f.name;
+}
+
+void Library( string str ) {
+    auto elem = split( str, " " );
+
+    if( elem.size() == 2 && elem[ 1 ] == "clear" ) {
+        g_library = ProgramLibrary();
+        g_columns = ColumnStore();
+        g_similar.clear();
+    }
+    else if( elem.size() > 2 && elem[ 1 ] == "add" ) {
+        for( uint i = 2; i < elem.size(); ++i ) {
+            uint count = AddLibraryPath( elem[ i ] );
+            if( count == 0 ) {
+                CommandError( elem[ i ] == "device" ? ERROR_READING_PROGRAM : ERROR_OPENING_FILE );
+                continue;
+            }
+
+            cout << "  " << elem[ i ] << ": " << count << " programs." << endl;
+        }
+    }
+
+    cout << "  " << g_library.entries.size() << " programs in " << g_library.files.size() << " files." << endl;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Similar
+//
+// k-nearest programs of the library. Without 'full', candidates are visited in order of their sketch lower bound and
+// the scan stops as soon as no remaining candidate can beat the k-th best, so results are the same as a full scan.
+//---------------------------------------------------------------------------------------------------------------------
+struct SimilarOptions {
+    uint k = 10;
+    bool l2 = false;
+    bool full = false;
+    vector<uint16_t> weights;               // PRG_BUFFER weights, or empty for unweighted
+};
+
+bool LoadWeights( const string& filename, vector<uint16_t>& weights ) {
+    uchar buffer[ PRG_BUFFER ];
+
+    ifstream infile;
+    infile.open( filename, ios::in | ios::binary );
+    if( !infile.is_open() )
+        return false;
+
+    infile.read( (char*) buffer, PRG_BUFFER );
+    if( !infile )
+        return false;
+
+    const uchar* m = SoundMask();
+    weights.resize( PRG_BUFFER );
+    for( uint i = 0; i < PRG_BUFFER; ++i )
+        weights[ i ] = m[ i ] ? buffer[ i ] : 0;
+
+    return true;
+}
+
+vector<pair<uint64_t, uint>> FindSimilar( const uchar* query, const SimilarOptions& opt, uint& compared ) {
+    const uint16_t* w = opt.weights.empty() ? nullptr : opt.weights.data();
+    uint n = uint( g_library.entries.size() );
+
+    auto distance = [ & ]( uint entry ) {
+        const uchar* p = &g_library.programs[ size_t( entry ) * PRG_BUFFER ];
+        if( w )
+            return opt.l2 ? DistanceL2W( query, p, w ) : DistanceL1W( query, p, w );
+
+        return opt.l2 ? DistanceL2( query, p ) : DistanceL1( query, p );
+    };
+
+    // Max-heap of the k best so far, worst on top
+    vector<pair<uint64_t, uint>> best;
+    auto offer = [ & ]( uint64_t d, uint entry ) {
+        if( best.size() < opt.k ) {
+            best.push_back( { d, entry } );
+            push_heap( best.begin(), best.end() );
+        }
+        else if( d < best.front().first ) {
+            pop_heap( best.begin(), best.end() );
+            best.back() = { d, entry };
+            push_heap( best.begin(), best.end() );
+        }
+    };
+
+    compared = 0;
+    if( opt.full ) {
+        for( uint e = 0; e < n; ++e )
+            offer( distance( e ), e );
+
+        compared = n;
+    }
+    else {
+        uint16_t qs[ SKETCH_SIZE ];
+        ComputeSketch( query, qs );
+
+        // Smallest weight of each sketch group keeps the bound exact for weighted distances
+        uint16_t gw[ SKETCH_SIZE ];
+        for( uint g = 0; g < SKETCH_SIZE; ++g ) {
+            gw[ g ] = 1;
+            if( w ) {
+                gw[ g ] = 0xFFFF;
+                for( uint i = 0; i < 8; ++i ) {
+                    if( w[ g * 8 + i ] < gw[ g ] )
+                        gw[ g ] = w[ g * 8 + i ];
+                }
+            }
+        }
+
+        vector<pair<uint64_t, uint>> bounds( n );
+        for( uint e = 0; e < n; ++e ) {
+            const uint16_t* es = &g_library.sketches[ size_t( e ) * SKETCH_SIZE ];
+            bounds[ e ] = { opt.l2 ? SketchBoundL2( qs, es, gw ) : SketchBoundL1( qs, es, gw ), e };
+        }
+
+        // Min-heap of candidates by lower bound
+        auto end = bounds.end();
+        make_heap( bounds.begin(), end, greater<>() );
+
+        while( end != bounds.begin() ) {
+            auto candidate = bounds.front();
+            if( best.size() == opt.k && candidate.first >= best.front().first )
+                break;
+
+            pop_heap( bounds.begin(), end, greater<>() );
+            --end;
+
+            offer( distance( candidate.second ), candidate.second );
+            compared++;
+        }
+    }
+
+    sort_heap( best.begin(), best.end() );
+    return best;
+}
+
+void Similar( string str ) {
+    auto elem = split( str, " " );
+    if( elem.size() < 2 )
+        return;
+
+    if( g_library.entries.empty() ) {
+        CommandError( ERROR_LIBRARY_EMPTY );
+        return;
+    }
+
+    SimilarOptions opt;
+    for( uint i = 2; i < elem.size(); ++i ) {
+        if( is_numeric( elem[ i ] ) ) {
+            opt.k = atol( elem[ i ].c_str() );
+        }
+        else if( elem[ i ] == "l1" || elem[ i ] == "l2" ) {
+            opt.l2 = elem[ i ] == "l2";
+        }
+        else if( elem[ i ] == "full" ) {
+            opt.full = true;
+        }
+        else if( elem[ i ] == "w" && i + 1 < elem.size() ) {
+            if( !LoadWeights( elem[ ++i ], opt.weights ) ) {
+                CommandError( ERROR_OPENING_FILE );
+                return;
+            }
+        }
+    }
+
+    if( opt.k == 0 )
+        opt.k = 1;
+
+    // Query: a program file, or an EEPROM slot of the device
+    uchar query[ PRG_BUFFER ];
+
+    if( is_numeric( elem[ 1 ] ) ) {
+        uint prg = atol( elem[ 1 ].c_str() );
+        if( prg >= NUM_PROGRAMS ) {
+            CommandError( ERROR_INVALID_PROGRAM_NUMBER );
+            return;
+        }
+
+        if( ReadProgramSlot( prg ) != XLOAD_OK || DumpProgram( query ) != 0 ) {
+            CommandError( ERROR_READING_PROGRAM );
+            return;
+        }
+    }
+    else {
+        ifstream infile;
+        infile.open( elem[ 1 ], ios::in | ios::binary );
+        if( !infile.is_open() ) {
+            CommandError( ERROR_OPENING_FILE );
+            return;
+        }
+
+        infile.read( (char*) query, PRG_BUFFER );
+        if( !infile ) {
+            CommandError( ERROR_OPENING_FILE );
+            return;
+        }
+    }
+
+    auto start = chrono::steady_clock::now();
+    uint compared;
+    auto result = FindSimilar( query, opt, compared );
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+
+    g_similar.clear();
+
+    stringstream s;
+    s << "  #   distance    name                      source" << endl;
+    for( uint i = 0; i < result.size(); ++i ) {
+        g_similar.push_back( result[ i ].second );
+
+        s << "  " << left << setw( 4 ) << i + 1 << setw( 12 ) << result[ i ].first
+          << setw( 26 ) << ProgramName( &g_library.programs[ size_t( result[ i ].second ) * PRG_BUFFER ] )
+          << LibrarySource( result[ i ].second ) << endl;
+    }
+
+    s << "  " << g_library.entries.size() << " programs, " << compared << " compared, "
+      << fixed << setprecision( 2 ) << elapsed.count() << " ms. ('i @N' loads result N)" << endl;
+    cout << s.str();
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Query
+//
+// Column scans over the library: 'query count|list|hist P|distinct P [where P op V [and ...]]'. Every filter is an
+// inclusive byte range (or its complement for '!='), evaluated 16 programs at a time into a row mask.
+//---------------------------------------------------------------------------------------------------------------------
+struct QueryFilter {
+    uint param;
+    uchar lo, hi;
+    bool negate;
+};
+
+void BuildColumns() {
+    size_t rows = g_library.entries.size();
+    if( g_columns.rows == rows )
+        return;
+
+    g_columns.rows = rows;
+    g_columns.columns.resize( rows * PRG_BUFFER );
+    ProgramsToColumns( g_library.programs.data(), rows, g_columns.columns.data() );
+}
+
+const uchar* Column( uint param ) {
+    return &g_columns.columns[ size_t( param ) * g_columns.rows ];
+}
+
+void FilterColumn( const uchar* column, size_t rows, const QueryFilter& f, uchar* mask ) {
+    size_t r = 0;
+
+#ifdef XLOAD_SSE2
+    const __m128i lo = _mm_set1_epi8( char( f.lo ) );
+    const __m128i hi = _mm_set1_epi8( char( f.hi ) );
+    const __m128i flip = _mm_set1_epi8( f.negate ? char( 0xFF ) : 0 );
+
+    for( ; r + 16 <= rows; r += 16 ) {
+        __m128i v = _mm_loadu_si128( (const __m128i*) &column[ r ] );
+
+        // lo <= v <= hi, unsigned: max( v, lo ) == v and min( v, hi ) == v
+        __m128i in = _mm_and_si128( _mm_cmpeq_epi8( _mm_max_epu8( v, lo ), v ), _mm_cmpeq_epi8( _mm_min_epu8( v, hi ), v ) );
+        __m128i m = _mm_loadu_si128( (const __m128i*) &mask[ r ] );
+        _mm_storeu_si128( (__m128i*) &mask[ r ], _mm_and_si128( m, _mm_xor_si128( in, flip ) ) );
+    }
+#endif
+
+    for( ; r < rows; ++r ) {
+        bool in = column[ r ] >= f.lo && column[ r ] <= f.hi;
+        if( in == f.negate )
+            mask[ r ] = 0;
+    }
+}
+
+size_t CountMask( const uchar* mask, size_t rows ) {
+    size_t count = 0;
+    size_t r = 0;
+
+#ifdef XLOAD_SSE2
+    const __m128i one = _mm_set1_epi8( 1 );
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+
+    for( ; r + 16 <= rows; r += 16 ) {
+        __m128i m = _mm_and_si128( _mm_loadu_si128( (const __m128i*) &mask[ r ] ), one );
+        acc = _mm_add_epi64( acc, _mm_sad_epu8( m, zero ) );
+    }
+
+    alignas( 16 ) uint64_t lanes[ 2 ];
+    _mm_store_si128( (__m128i*) lanes, acc );
+    count = size_t( lanes[ 0 ] + lanes[ 1 ] );
+#endif
+
+    for( ; r < rows; ++r )
+        count += mask[ r ] & 1;
+
+    return count;
+}
+
+void Histogram( const uchar* column, const uchar* mask, size_t rows, uint* hist ) {
+
+    // Four interleaved tables avoid store-to-load stalls on runs of equal values
+    vector<uint> h( 4 * 256, 0 );
+    size_t r = 0;
+
+    for( ; r + 4 <= rows; r += 4 ) {
+        h[ 0 * 256 + column[ r + 0 ] ] += mask[ r + 0 ] & 1;
+        h[ 1 * 256 + column[ r + 1 ] ] += mask[ r + 1 ] & 1;
+        h[ 2 * 256 + column[ r + 2 ] ] += mask[ r + 2 ] & 1;
+        h[ 3 * 256 + column[ r + 3 ] ] += mask[ r + 3 ] & 1;
+    }
+
+    for( ; r < rows; ++r )
+        h[ column[ r ] ] += mask[ r ] & 1;
+
+    for( uint v = 0; v < 256; ++v )
+        hist[ v ] = h[ v ] + h[ 256 + v ] + h[ 512 + v ] + h[ 768 + v ];
+}
+
+
+// Filters: P op V, with op one of < <= > >= = == != and V a value or a lo..hi range ('=' only), joined by 'and'
+bool ParseFilters( const vector<string>& elem, size_t first, vector<QueryFilter>& filters ) {
+    string text;
+    for( size_t i = first; i < elem.size(); ++i )
+        text += elem[ i ] + " ";
+
+    size_t i = 0;
+    auto skip = [ & ]() {
+        while( i < text.size() && text[ i ] == ' ' )
+            ++i;
+    };
+    auto number = [ & ]( uint& value ) {
+        skip();
+        size_t j = i;
+        while( j < text.size() && isdigit( uchar( text[ j ] ) ) )
+            ++j;
+
+        if( j == i || j - i > 3 )
+            return false;
+
+        value = atol( text.substr( i, j - i ).c_str() );
+        i = j;
+        return true;
+    };
+
+    for( ;; ) {
+        skip();
+        if( i < text.size() && ( text[ i ] == 'p' || text[ i ] == 'P' ) )
+            ++i;
+
+        uint param, value;
+        if( !number( param ) || param >= PRG_BUFFER )
+            return false;
+
+        skip();
+        string op;
+        while( i < text.size() && strchr( "<>=!", text[ i ] ) )
+            op += text[ i++ ];
+
+        if( !number( value ) || value > 255 )
+            return false;
+
+        QueryFilter f = { param, uchar( value ), uchar( value ), false };
+        const QueryFilter none = { param, 0, 255, true };
+
+        if( op == "<" )
+            f = value == 0 ? none : QueryFilter { param, 0, uchar( value - 1 ), false };
+        else if( op == "<=" )
+            f.lo = 0;
+        else if( op == ">" )
+            f = value == 255 ? none : QueryFilter { param, uchar( value + 1 ), 255, false };
+        else if( op == ">=" )
+            f.hi = 255;
+        else if( op == "!=" )
+            f.negate = true;
+        else if( op == "=" || op == "==" ) {
+            if( text.compare( i, 2, ".." ) == 0 ) {
+                i += 2;
+                uint hi;
+                if( !number( hi ) || hi > 255 || hi < value )
+                    return false;
+
+                f.hi = uchar( hi );
+            }
+        }
+        else
+            return false;
+
+        filters.push_back( f );
+
+        skip();
+        if( i >= text.size() )
+            break;
+
+        if( text.compare( i, 3, "and" ) == 0 )
+            i += 3;
+        else if( text.compare( i, 2, "&&" ) == 0 )
+            i += 2;
+        else if( text[ i ] == '&' || text[ i ] == ',' )
+            i += 1;
+        else
+            return false;
+    }
+
+    return true;
+}
+
+void Query( string str ) {
     auto elem = split( str, " " );
     if( elem.size() < 2 )
         return;
 
-    // Flush
+    if( g_library.entries.empty() ) {
+        CommandError( ERROR_LIBRARY_EMPTY );
+        return;
+    }
+
+    string what = elem[ 1 ];
+    size_t next = 2;
+    uint param = 0;
+
+    if( what == "hist" || what == "distinct" ) {
+        if( elem.size() < 3 || !ParseParam( elem[ 2 ], param ) || param >= PRG_BUFFER ) {
+            CommandError( ERROR_INVALID_PARAM_NUMBER );
+            return;
+        }
+
+        next = 3;
+    }
+    else if( what != "count" && what != "list" ) {
+        CommandError( ERROR_INVALID_QUERY );
+        return;
+    }
+
+    vector<QueryFilter> filters;
+    if( next < elem.size() ) {
+        if( elem[ next ] != "where" || !ParseFilters( elem, next + 1, filters ) ) {
+            CommandError( ERROR_INVALID_QUERY );
+            return;
+        }
+    }
+
+    auto start = chrono::steady_clock::now();
+
+    BuildColumns();
+    size_t rows = g_columns.rows;
+
+    vector<uchar> mask( rows, 0xFF );
+    for( auto& f : filters )
+        FilterColumn( Column( f.param ), rows, f, mask.data() );
+
+    size_t count = CountMask( mask.data(), rows );
+
+    uint hist[ 256 ];
+    if( what == "hist" || what == "distinct" )
+        Histogram( Column( param ), mask.data(), rows, hist );
+
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+
+    stringstream s;
+    if( what == "list" ) {
+        const size_t LIST_MAX = 100;
+        size_t shown = 0;
+
+        for( size_t r = 0; r < rows && shown < LIST_MAX; ++r ) {
+            if( !mask[ r ] )
+                continue;
+
+            s << "  " << left << setw( 26 ) << ProgramName( &g_library.programs[ r * PRG_BUFFER ] ) << LibrarySource( uint( r ) ) << endl;
+            shown++;
+        }
+
+        if( count > shown )
+            s << "  (" << count - shown << " more)" << endl;
+    }
+    else if( what == "hist" ) {
+        for( uint v = 0; v < 256; ++v ) {
+            if( hist[ v ] )
+                s << "  " << right << setw( 3 ) << v << "  " << setw( 8 ) << hist[ v ] << endl;
+        }
+    }
+    else if( what == "distinct" ) {
+        uint distinct = 0;
+        for( uint v = 0; v < 256; ++v )
+            distinct += hist[ v ] ? 1 : 0;
+
+        s << "  " << distinct << " distinct values:";
+        for( uint v = 0; v < 256; ++v ) {
+            if( hist[ v ] )
+                s << " " << v;
+        }
+
+        s << endl;
+    }
+
+    s << "  " << count << " of " << rows << " programs, " << fixed << setprecision( 2 ) << elapsed.count() << " ms." << endl;
+    cout << s.str();
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Transform
+//
+// 'xform <bank | device> <rules> [out.bank] [push]' applies a rules file to a whole bank in memory, then writes back
+// only the programs that actually changed. Rules, one per line ('#' starts a comment):
+//
+//   set P V          P = V
+//   add P D          P = P + D (D may be negative, saturates at 0 and 255)
+//   scale P PCT      P = P * PCT / 100 (in 1/256 steps, saturates at 255)
+//   clamp P LO HI    P = min( max( P, LO ), HI )
+//   copy P Q         P = Q
+//
+// Each may end in 'where ...' (same filters as 'query'). Rules run in order on the column-major bank, 16 programs at
+// a time.
+//---------------------------------------------------------------------------------------------------------------------
+enum class RULE_OP {
+    SET,
+    ADD,
+    SCALE,
+    CLAMP,
+    COPY
+};
+
+struct TransformRule {
+    RULE_OP op;
+    uint param;
+    int a, b;                               // value, delta, 8.8 factor, lo/hi or source parameter
+    vector<QueryFilter> where;
+};
+
+bool ParseInt( const string& token, int& value ) {
+    size_t digits = !token.empty() && token[ 0 ] == '-' ? 1 : 0;
+    if( token.size() == digits || token.size() > digits + 5 || !is_numeric( token.substr( digits ) ) )
+        return false;
+
+    value = atol( token.c_str() );
+    return true;
+}
+
+bool ParseRule( string line, TransformRule& rule ) {
+    auto elem = split( line, " \t" );
+    if( elem.size() < 3 )
+        return false;
+
+    const string& op = elem[ 0 ];
+    size_t args = op == "clamp" ? 2 : 1;
+    size_t next = 2 + args;
+
+    if( elem.size() < next || !ParseParam( elem[ 1 ], rule.param ) || rule.param >= PRG_BUFFER )
+        return false;
+
+    int a = 0, b = 0;
+    uint source;
+    if( op == "copy" ) {
+        if( !ParseParam( elem[ 2 ], source ) || source >= PRG_BUFFER )
+            return false;
+
+        a = int( source );
+    }
+    else if( !ParseInt( elem[ 2 ], a ) || ( args == 2 && !ParseInt( elem[ 3 ], b ) ) ) {
+        return false;
+    }
+
+    if( op == "set" && a >= 0 && a <= 255 ) {
+        rule.op = RULE_OP::SET;
+    }
+    else if( op == "add" && a >= -255 && a <= 255 ) {
+        rule.op = RULE_OP::ADD;
+    }
+    else if( op == "scale" && a >= 0 && a <= 12800 ) {
+        rule.op = RULE_OP::SCALE;
+        a = ( a * 256 + 50 ) / 100;
+    }
+    else if( op == "clamp" && a >= 0 && b <= 255 && a <= b ) {
+        rule.op = RULE_OP::CLAMP;
+    }
+    else if( op == "copy" ) {
+        rule.op = RULE_OP::COPY;
+    }
+    else {
+        return false;
+    }
+
+    rule.a = a;
+    rule.b = b;
+    rule.where.clear();
+
+    if( next < elem.size() ) {
+        if( elem[ next ] != "where" || !ParseFilters( elem, next + 1, rule.where ) )
+            return false;
+    }
+
+    return true;
+}
+
+uchar ApplyRuleValue( const TransformRule& rule, uchar v ) {
+    int r = v;
+    switch( rule.op ) {
+        case RULE_OP::SET:      r = rule.a; break;
+        case RULE_OP::ADD:      r = v + rule.a; break;
+        case RULE_OP::SCALE:    r = ( v * rule.a ) >> 8; break;
+        case RULE_OP::CLAMP:    r = v < rule.a ? rule.a : v > rule.b ? rule.b : v; break;
+        case RULE_OP::COPY:     break;
+    }
+
+    return uchar( r < 0 ? 0 : r > 255 ? 255 : r );
+}
+
+void ApplyRule( uchar* columns, size_t rows, const TransformRule& rule ) {
+    vector<uchar> mask( rows, 0xFF );
+    for( auto& f : rule.where )
+        FilterColumn( &columns[ f.param * rows ], rows, f, mask.data() );
+
+    uchar* col = &columns[ rule.param * rows ];
+    const uchar* src = rule.op == RULE_OP::COPY ? &columns[ rule.a * rows ] : col;
+    size_t r = 0;
+
+#ifdef XLOAD_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i a8 = _mm_set1_epi8( char( rule.a < 0 ? -rule.a : rule.a ) );
+    const __m128i b8 = _mm_set1_epi8( char( rule.b ) );
+    const __m128i f16 = _mm_set1_epi16( short( rule.a ) );
+
+    for( ; r + 16 <= rows; r += 16 ) {
+        __m128i v = _mm_loadu_si128( (const __m128i*) &src[ r ] );
+        __m128i old = _mm_loadu_si128( (const __m128i*) &col[ r ] );
+        __m128i n = v;
+
+        switch( rule.op ) {
+            case RULE_OP::SET:
+                n = a8;
+                break;
+
+            case RULE_OP::ADD:
+                n = rule.a < 0 ? _mm_subs_epu8( v, a8 ) : _mm_adds_epu8( v, a8 );
+                break;
+
+            case RULE_OP::SCALE: {
+                // ( v << 8 ) * f >> 16 == v * f >> 8, at most 255 * 128, packed with unsigned saturation
+                __m128i lo = _mm_mulhi_epu16( _mm_unpacklo_epi8( zero, v ), f16 );
+                __m128i hi = _mm_mulhi_epu16( _mm_unpackhi_epi8( zero, v ), f16 );
+                n = _mm_packus_epi16( lo, hi );
+                break;
+            }
+
+            case RULE_OP::CLAMP:
+                n = _mm_min_epu8( _mm_max_epu8( v, a8 ), b8 );
+                break;
+
+            case RULE_OP::COPY:
+                break;
+        }
+
+        __m128i m = _mm_loadu_si128( (const __m128i*) &mask[ r ] );
+        _mm_storeu_si128( (__m128i*) &col[ r ], _mm_or_si128( _mm_and_si128( m, n ), _mm_andnot_si128( m, old ) ) );
+    }
+#endif
+
+    for( ; r < rows; ++r ) {
+        if( mask[ r ] )
+            col[ r ] = ApplyRuleValue( rule, src[ r ] );
+    }
+}
+
+void Transform( string str ) {
+    auto elem = split( str, " " );
+    if( elem.size() < 3 )
+        return;
+
+    bool push = false;
+    string outname;
+    for( uint i = 3; i < elem.size(); ++i ) {
+        if( elem[ i ] == "push" )
+            push = true;
+        else
+            outname = elem[ i ];
+    }
+
+    // Rules
+    ifstream rules;
+    rules.open( elem[ 2 ], ios::in );
+    if( !rules.is_open() ) {
+        CommandError( ERROR_OPENING_FILE );
+        return;
+    }
+
+    vector<TransformRule> program_rules;
+    string line;
+    for( uint n = 1; getline( rules, line ); ++n ) {
+        line = line.substr( 0, line.find( '#' ) );
+        if( line.find_first_not_of( " \t\r" ) == string::npos )
+            continue;
+
+        TransformRule rule;
+        if( !ParseRule( line, rule ) ) {
+            CommandError( ERROR_INVALID_RULE );
+            cout << n << ": " << line << endl;
+            return;
+        }
+
+        program_rules.push_back( rule );
+    }
+
+    // Source bank
+    vector<uchar> bank;
+    if( !LoadBankSource( elem[ 1 ], bank ) )
+        return;
+
+    // Apply
+    auto start = chrono::steady_clock::now();
+
+    vector<uchar> columns( BANK_SIZE );
+    vector<uchar> result( BANK_SIZE );
+    ProgramsToColumns( &bank[ 0 ], NUM_PROGRAMS, &columns[ 0 ] );
+
+    for( auto& rule : program_rules )
+        ApplyRule( &columns[ 0 ], NUM_PROGRAMS, rule );
+
+    ColumnsToPrograms( &columns[ 0 ], NUM_PROGRAMS, &result[ 0 ] );
+
+    vector<uint> changed;
+    uint params = 0;
+    for( uint j = 0; j < NUM_PROGRAMS; ++j ) {
+        uint n = DiffPrograms( &bank[ j * PRG_BUFFER ], &result[ j * PRG_BUFFER ], nullptr );
+        if( n ) {
+            changed.push_back( j );
+            params += n;
+        }
+    }
+
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+
+    stringstream s;
+    for( auto j : changed )
+        s << "  " << left << setw( 4 ) << j << ProgramName( &result[ j * PRG_BUFFER ] ) << endl;
+
+    s << "  " << changed.size() << " of " << NUM_PROGRAMS << " programs changed (" << params << " parameters), "
+      << fixed << setprecision( 2 ) << elapsed.count() << " ms." << endl;
+    cout << s.str();
+
+    // Save
+    if( !outname.empty() ) {
+        ofstream outfile;
+        outfile.open( outname, ios::out | ios::binary );
+        if( !outfile.is_open() ) {
+            CommandError( ERROR_OPENING_FILE );
+            return;
+        }
+
+        outfile.write( (const char*) &result[ 0 ], BANK_SIZE );
+        outfile.close();
+    }
+
+    // Push changed programs only, in one session
+    if( push ) {
+        start = chrono::steady_clock::now();
+
+        for( auto j : changed ) {
+            if( PutBankSlot( j, &result[ j * PRG_BUFFER ] ) != 0 ) {
+                CommandError( ERROR_WRITING_PROGRAM );
+                return;
+            }
+
+            cout << ".";
+        }
+
+        SaveBankCache();
+        elapsed = chrono::steady_clock::now() - start;
+        cout << endl << "  " << changed.size() << " programs written, " << fixed << setprecision( 0 ) << elapsed.count() << " ms." << endl;
+    }
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// DiffBank
+//
+// 'diff_bank <a> <b> [base <ancestor>] [out]' compares two banks (files or 'device') slot by slot. With a base it
+// merges per parameter: a change on one side is taken, the same change on both sides is taken once, different changes
+// keep 'a' and are reported as conflicts. The slots where the result differs from 'a' become the transfer plan, which
+// 'put_bank plan' writes to the device.
+//---------------------------------------------------------------------------------------------------------------------
+// A bank from the device or a file, reporting why it could not be had. A file must be exactly one bank: a short one
+// would become zeroed programs.
+bool LoadBankSource( const string& name, vector<uchar>& bank ) {
+    bank.assign( BANK_SIZE, 0 );
+
+    if( name == "device" ) {
+        if( ReadBank( &bank[ 0 ], false ) == 0 )
+            return true;
+
+        CommandError( ERROR_READING_PROGRAM );
+        return false;
+    }
+
+    ifstream infile;
+    infile.open( name, ios::in | ios::binary );
+    if( !infile.is_open() ) {
+        CommandError( ERROR_OPENING_FILE );
+        return false;
+    }
+
+    infile.read( (char*) &bank[ 0 ], BANK_SIZE );
+    if( infile.gcount() != BANK_SIZE || infile.peek() != ifstream::traits_type::eof() ) {
+        CommandError( ERROR_BANK_FILE_SIZE );
+        cout << name << endl;
+        return false;
+    }
+
+    return true;
+}
+
+void PrintParams( stringstream& s, const uint16_t* params, uint count ) {
+    const uint MAX_SHOWN = 16;
+
+    for( uint i = 0; i < count && i < MAX_SHOWN; ++i )
+        s << " " << params[ i ];
+
+    if( count > MAX_SHOWN )
+        s << " ...";
+}
+
+void DiffBank( string str ) {
+    auto elem = split( str, " " );
+    if( elem.size() < 3 )
+        return;
+
+    string basename, outname;
+    for( uint i = 3; i < elem.size(); ++i ) {
+        if( elem[ i ] == "base" && i + 1 < elem.size() )
+            basename = elem[ ++i ];
+        else
+            outname = elem[ i ];
+    }
+
+    vector<uchar> a, b, base;
+    if( !LoadBankSource( elem[ 1 ], a ) || !LoadBankSource( elem[ 2 ], b ) ||
+        ( !basename.empty() && !LoadBankSource( basename, base ) ) )
+        return;
+
+    auto start = chrono::steady_clock::now();
+
+    // Merge: start from 'a' and take the parameters only 'b' changed
+    vector<uchar> result = b;
+    vector<vector<uint16_t>> conflicts( NUM_PROGRAMS );
+    if( !base.empty() ) {
+        result = a;
+
+        uint16_t changed[ PRG_BUFFER ];
+        for( uint j = 0; j < NUM_PROGRAMS; ++j ) {
+            const uint offset = j * PRG_BUFFER;
+            uint n = DiffPrograms( &base[ offset ], &b[ offset ], changed );
+
+            for( uint i = 0; i < n; ++i ) {
+                uint p = offset + changed[ i ];
+                if( a[ p ] == base[ p ] )
+                    result[ p ] = b[ p ];
+                else if( a[ p ] != b[ p ] )
+                    conflicts[ j ].push_back( changed[ i ] );
+            }
+        }
+    }
+
+    // Plan: slots of the result that differ from 'a'
+    g_plan.source = elem[ 1 ];
+    g_plan.from = a;
+    g_plan.bank = result;
+    g_plan.slots.clear();
+
+    stringstream s;
+    uint params = 0, conflicted = 0;
+    uint16_t changed[ PRG_BUFFER ];
+    for( uint j = 0; j < NUM_PROGRAMS; ++j ) {
+        const uint offset = j * PRG_BUFFER;
+        uint n = DiffPrograms( &a[ offset ], &result[ offset ], changed );
+
+        if( n ) {
+            g_plan.slots.push_back( j );
+            params += n;
+
+            s << "  " << right << setw( 3 ) << j << "  " << left << setw( PROGRAM_NAME_LEN + 1 ) << ProgramName( &a[ offset ] )
+              << "-> " << setw( PROGRAM_NAME_LEN + 1 ) << ProgramName( &result[ offset ] ) << n << ":";
+            PrintParams( s, changed, n );
+            s << endl;
+        }
+
+        if( !conflicts[ j ].empty() ) {
+            conflicted++;
+            s << "  " << right << setw( 3 ) << j << "  " << left << setw( PROGRAM_NAME_LEN + 1 ) << ProgramName( &a[ offset ] )
+              << "conflicts " << conflicts[ j ].size() << ":";
+            PrintParams( s, &conflicts[ j ][ 0 ], uint( conflicts[ j ].size() ) );
+            s << endl;
+        }
+    }
+
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+
+    s << "  " << g_plan.slots.size() << " of " << NUM_PROGRAMS << " programs differ (" << params << " parameters)";
+    if( !base.empty() )
+        s << ", " << conflicted << " with conflicts (kept " << elem[ 1 ] << ")";
+
+    s << ", " << fixed << setprecision( 2 ) << elapsed.count() << " ms." << endl;
+    if( !g_plan.slots.empty() )
+        s << "  'put_bank plan' writes these " << g_plan.slots.size() << " programs." << endl;
+
+    cout << s.str();
+
+    // Save the merged (or 'b') bank
+    if( !outname.empty() ) {
+        ofstream outfile;
+        outfile.open( outname, ios::out | ios::binary );
+        if( !outfile.is_open() ) {
+            CommandError( ERROR_OPENING_FILE );
+            return;
+        }
+
+        outfile.write( (const char*) &result[ 0 ], BANK_SIZE );
+        outfile.close();
+    }
+}
+
+// Executes the plan left by 'diff_bank', one PutBankSlot per planned program
+int PutBankPlan() {
+    if( g_plan.bank.empty() ) {
+        CommandError( ERROR_NO_PLAN );
+        return 1;
+    }
+
+    // A plan is only valid while the device holds what was compared, whether that came from the device or a file.
+    // The cache answers when this session read or wrote the bank, otherwise the bank is read again (a cache file from
+    // an earlier session misses edits made on the device since).
+    vector<uchar> current;
+    if( LoadBankCache() && g_bank_cache.current )
+        current = g_bank_cache.bank;
+    else if( !LoadBankSource( "device", current ) )
+        return 1;
+
+    if( current != g_plan.from ) {
+        CommandError( ERROR_PLAN_STALE );
+        return 1;
+    }
+
+    auto start = chrono::steady_clock::now();
+
+    for( auto j : g_plan.slots ) {
+        int err = PutBankSlot( j, &g_plan.bank[ j * PRG_BUFFER ] );
+        if( err ) {
+            CommandError( ERROR_WRITING_PROGRAM );
+            return err + 1;
+        }
+
+        cout << ".";
+    }
+
+    SaveBankCache();
+
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    cout << endl << "  " << g_plan.slots.size() << " programs written, " << fixed << setprecision( 0 ) << elapsed.count() << " ms." << endl;
+
+    g_plan = TransferPlan();
+    return 0;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Bank cache
+//
+// Host copy of the device EEPROM bank, one per device serial number, kept in memory and in
+// %LOCALAPPDATA%\XLoad\<serial>.bank (a plain bank file). Every bulk bank read refreshes it, XLoad's own EEPROM
+// writes keep it current or invalidate it. Edits made on the device itself are not seen: 'ls -r' re-reads.
+//---------------------------------------------------------------------------------------------------------------------
+string BankCachePath() {
+    char dir[ MAX_PATH ];
+    DWORD n = ::GetEnvironmentVariableA( "LOCALAPPDATA", dir, MAX_PATH );
+    if( n == 0 || n >= MAX_PATH || g_device_serial.empty() )
+        return "";
+
+    auto path = filesystem::path( dir ) / "XLoad";
+
+    error_code ec;
+    filesystem::create_directories( path, ec );
+    return ( path / ( g_device_serial + ".bank" ) ).string();
+}
+
+// Writes the cache file when the cache changed: once per bank read, batch of bank writes or 'w'
+void SaveBankCache() {
+    string path = BankCachePath();
+    if( path.empty() || !g_bank_cache.valid || !g_bank_cache.dirty )
+        return;
+
+    // Write aside and rename, so a cache file is always a whole bank
+    ofstream outfile;
+    outfile.open( path + ".tmp", ios::out | ios::binary );
+    if( !outfile.is_open() )
+        return;
+
+    outfile.write( (const char*) &g_bank_cache.bank[ 0 ], BANK_SIZE );
+    outfile.close();
+
+    error_code ec;
+    filesystem::rename( path + ".tmp", path, ec );
+    g_bank_cache.dirty = false;
+}
+
+bool LoadBankCache() {
+    if( g_bank_cache.valid && g_bank_cache.serial == g_device_serial )
+        return true;
+
+    g_bank_cache.valid = false;
+    g_bank_cache.current = false;
+    g_bank_cache.serial = g_device_serial;
+    g_bank_cache.bank.assign( BANK_SIZE, 0 );
+
+    string path = BankCachePath();
+    if( path.empty() )
+        return false;
+
+    ifstream infile;
+    infile.open( path, ios::in | ios::binary );
+    if( !infile.is_open() )
+        return false;
+
+    infile.read( (char*) &g_bank_cache.bank[ 0 ], BANK_SIZE );
+    g_bank_cache.valid = bool( infile );
+    return g_bank_cache.valid;
+}
+
+void SetBankCache( const uchar* bank ) {
+    g_bank_cache.serial = g_device_serial;
+    g_bank_cache.bank.assign( bank, bank + BANK_SIZE );
+    g_bank_cache.valid = true;
+    g_bank_cache.dirty = true;
+    g_bank_cache.current = true;
+    SaveBankCache();
+}
+
+void UpdateBankCache( uint slot, const uchar* program ) {
+    if( !LoadBankCache() )
+        return;
+
+    memcpy( &g_bank_cache.bank[ slot * PRG_BUFFER ], program, PRG_BUFFER );
+    g_bank_cache.dirty = true;
+}
+
+void InvalidateBankCache() {
+    g_bank_cache.valid = false;
+    g_bank_cache.dirty = false;
+    g_bank_cache.current = false;
+
+    string path = BankCachePath();
+    if( !path.empty() ) {
+        error_code ec;
+        filesystem::remove( path, ec );
+    }
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// ListPrograms
+//
+// 'ls [-r] [text]' lists the program names of the device bank from the cache, reading the bank once when the cache
+// is cold. 'text' keeps the names containing it (case insensitive).
+//---------------------------------------------------------------------------------------------------------------------
+void ListPrograms( string str ) {
+    auto elem = split( str, " " );
+
+    bool refresh = false;
+    string filter;
+    for( uint i = 1; i < elem.size(); ++i ) {
+        if( elem[ i ] == "-r" )
+            refresh = true;
+        else
+            filter += ( filter.empty() ? "" : " " ) + elem[ i ];
+    }
+
+    auto lower = []( string text ) {
+        for( auto& c : text )
+            c = char( tolower( uchar( c ) ) );
+
+        return text;
+    };
+
+    auto start = chrono::steady_clock::now();
+
+    bool cached = !refresh && LoadBankCache();
+    if( !cached ) {
+        vector<uchar> bank( BANK_SIZE );
+        if( ReadBank( &bank[ 0 ], false ) != 0 ) {
+            CommandError( ERROR_READING_PROGRAM );
+            return;
+        }
+    }
+
+    filter = lower( filter );
+
+    stringstream s;
+    uint shown = 0;
+    for( uint j = 0; j < NUM_PROGRAMS; ++j ) {
+        string name = ProgramName( &g_bank_cache.bank[ j * PRG_BUFFER ] );
+        if( !filter.empty() && lower( name ).find( filter ) == string::npos )
+            continue;
+
+        s << "  " << right << setw( 3 ) << j << "  " << name << endl;
+        shown++;
+    }
+
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    s << "  " << shown << " of " << NUM_PROGRAMS << " programs (" << ( cached ? "cached" : "read from device" ) << "), "
+      << fixed << setprecision( 2 ) << elapsed.count() << " ms." << endl;
+    cout << s.str();
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Terminal
+//
+//---------------------------------------------------------------------------------------------------------------------
+
+// Understands:
+//
+// g <param> [<param> ...] [-f] [-l]
+// pipe [count]
+// parse [count]
+// s <param> <param value> [<param> <param value> ...]
+// params [text]
+// batch [fraction | bench [count]]
+// automate <filename>
+// queue [on | off | reset]
+// undo [steps]
+// redo [steps]
+// ab [<snapshot> <snapshot>]
+// snap <name>
+// history [count]
+// watch [ms [polls]] [filename | tcp:[host:]port]
+// group [<name> <serial | all> [<serial> ...] | <name> clear]
+// @<group> <s | i | r | * command>
+// r <prg>
+// w <prg>
+// * <channel1> <channel2>
+// . [filename [share] [commit ms]]
+// d [-f] [-l]
+// d <filename> [-f]
+// i
+// i <filename>
+// i @<result>
+// i --watch <filename>
+// n [-f]
+// n <name>
+// shadow [clear]
+// put_bank plan
+// diff_bank <a> <b> [base <ancestor>] [out]
+// ls [-r] [text]
+// lib [add <path | device> | clear]
+// similar <filename | prg> [k] [l1 | l2] [w <weights>] [full]
+// query <count | list | hist <param #> | distinct <param #>> [where <param #> <op> <value> [and ...]]
+// xform <bank filename | device> <rules filename> [out filename] [push]
+// h 
+// q
+
+// Commands that take the whole line
+template<void ( *F )( string )>
+void WithLine( const Command& cmd ) {
+    F( string( cmd.line ) );
+}
+
+// The flash is written on a link of its own: closing the device stops the parameter queue, which goes on afterwards
+void FlashFile( const Command& cmd, xload_flash_type type ) {
+    bool queued = g_param_queue.enabled;
+
     CloseDevice();
-    OpenDevice( BAUDRATE, LATENCY_RT );
+    SetFlashDump( string( cmd.args[ 0 ] ), BAUDRATE, type );
+    if( OpenDevice( BAUDRATE, LATENCY_STD ) == 0 && queued )
+        StartParamQueue();
+}
 
-    DWORD len;
-    FT_STATUS st;
-    uchar buffer[ AUDIO_BUFFER ];
+void LoadTuning( const Command& cmd ) {
+    FlashFile( cmd, XLOAD_FLASH_TUNING );
+}
 
-    union {
-        uint ui;
-        uchar b[ 4 ];
-    } length;
+void LoadWavetable( const Command& cmd ) {
+    FlashFile( cmd, XLOAD_FLASH_WAVETABLE );
+}
 
+void GetBankFile( const Command& cmd ) {
+    GetBank( string( cmd.args[ 0 ] ) );
+}
 
-    ofstream outfile;
-    outfile.open( elem[ 1 ], ios::out | ios::binary );
+void PutBankFile( const Command& cmd ) {
+    if( cmd.args[ 0 ] == "plan" )
+        PutBankPlan();
+    else
+        PutBank( string( cmd.args[ 0 ] ) );
+}
 
-    if( !outfile.is_open() ) {
-        cout << ERROR_OPENING_FILE;
+void InitBank( const Command& ) {
+    xload::Status st = InitializeBank();
+    if( st != XLOAD_OK ) {
+        CommandError( ERROR_INITIALIZING_BANK, st );
         return;
     }
 
-    outfile << "RIFF";
-    outfile << "    ";      // length placeholder
-    outfile << "WAVE";
-    outfile << "fmt ";
+    st = ReadProgramSlot( 0 );
+    if( st != XLOAD_OK )
+        CommandError( ERROR_READING_PROGRAM, st );
+}
 
-    length.ui = 18;
-    outfile << length.b[ 0 ] << length.b[ 1 ] << length.b[ 2 ] << length.b[ 3 ];
+void Help( const Command& ) {
+    cout << "\n  Commands:\n\n";
+    cout << "  i\t\t\tInitializes program.\n";
+    cout << "  i filename\t\tInitializes program from file (load).\n";
+    cout << "  i --watch filename\tInitializes from file, then sends what changes each time it is saved (ESC stops).\n";
+    cout << "  d\t\t\tShows all parameter values for current program ('-l': one labeled per line).\n";
+    cout << "  \t\t\t(g, n and d answer from the host copy of the program, '-f' reads the device)\n";
+    cout << "  d filename\t\tWrites current program to filename (save).\n";
+    cout << "  g N [N ...]\t\tGets parameter N value (several are read pipelined, '-l' labels them).\n";
+    cout << "  \t\t\t(g and s take parameter numbers, or name1-name24 for the program name, see 'params')\n";
+    cout << "  pipe [N]\t\tTimes N parameter reads, blocking and pipelined at growing depths.\n";
+    cout << "  parse [N]\t\tTimes N command lines through the parser, against split() and compares.\n";
+    cout << "  s N V [N V ...]\tSets parameter N to value V, several in one write.\n";
+    cout << "  params [text]\t\tLists named parameters (so far the name characters): number, range, format, value.\n";
+    cout << "  batch [F]\t\tShows or sets the fraction of a program above which 's' injects instead.\n";
+    cout << "  batch bench [N]\tTimes N parameter writes: one per write, batched and injected.\n";
+    cout << "  queue [on|off]\t\tShows or switches queuing of 's': newest value per parameter, sent at link rate.\n";
+    cout << "  undo [N], redo [N]\tGoes N program snapshots back or forward, sending only what differs.\n";
+    cout << "  ab [A B]\t\tSwitches to snapshot A (number or name) and back to B with each 'ab'.\n";
+    cout << "  snap name\t\tNames the current snapshot.\n";
+    cout << "  history [N]\t\tLists the last N snapshots and the memory they take.\n";
+    cout << "  watch [ms [N]] [out]\tPolls the program every ms (N times), shows device-side edits until ESC.\n";
+    cout << "  \t\t\t(out: a file, or 'tcp:[host:]port'; lines are 'time param old new')\n";
+    cout << "  automate filename\tPlays timed parameter changes ('ms param value' lines), reports timing.\n";
+    cout << "  r N\t\t\tReads program N.\n";
+    cout << "  w N\t\t\tWrites current program to memory slot N.\n";
+    cout << "  n\t\t\tGets current program name.\n";
+    cout << "  n new name\t\tSets current program name.\n";
+    cout << "  shadow\t\tRe-reads current program into the host copy, shows what it missed.\n";
+    cout << "  shadow clear\t\tDrops the host copy.\n";
+    cout << "  *\t\t\tDisplays current MIDI channel.\n";
+    cout << "  * N\t\t\tSets MIDI channel to N (0 = omni).\n";
+    cout << "  group\t\t\tLists attached devices and device groups, with their write spread.\n";
+    cout << "  group G S [S ...]\tMakes group G of the devices with serial S ('all': every attached one).\n";
+    cout << "  group G clear\t\tCloses group G.\n";
+    cout << "  @G command\t\tSends s, i, r or * to every device of group G at once, reports the write spread.\n";
+    cout << "  . filename\t\tStarts audio recording, commands that only write keep working ('.' stops).\n";
+    cout << "  \t\t\t(every write is marked at its sample position: WAV cue/labl chunks and a .json file)\n";
+    cout << "  . filename share\tAlso publishes the live stream to other processes (shared ring, xload_ring.hpp).\n";
+    cout << "  . filename N\t\tCommits the file every N ms (50 or more, default 1000): a crash loses no more.\n";
+    cout << "  t filename\t\tWrites a tuning definition file into device.\n";
+    cout << "  get_bank filename\tReads a program bank from device.\n";
+    cout << "  put_bank filename\tWrites a program bank file into device.\n";
+    cout << "  put_bank plan\t\tWrites the programs planned by diff_bank.\n";
+    cout << "  diff_bank A B [out]\tLists programs of bank B differing from A (files or 'device'), plans them.\n";
+    cout << "  \t\t\t('base C' merges A and B against ancestor C, conflicts keep A)\n";
+    cout << "  ls [text]\t\tLists device program names (containing text) from the bank cache.\n";
+    cout << "  ls -r [text]\t\tRe-reads the bank from device first.\n";
+    cout << "  lib add path\t\tAdds bank/program files (or a folder, or 'device') to the library.\n";
+    cout << "  lib clear\t\tEmpties the library.\n";
+    cout << "  similar F|N [k]\tLists the k library programs closest to file F or slot N.\n";
+    cout << "  \t\t\t(options: l1, l2, w weights_file, full)\n";
+    cout << "  i @N\t\t\tInitializes program from result N of 'similar'.\n";
+    cout << "  query count|list\tCounts or lists library programs, e.g. 'query list where 37>200 and 12=0..5'.\n";
+    cout << "  query hist|distinct N\tValue histogram or distinct values of parameter N (accepts 'where').\n";
+    cout << "  xform B rules [out]\tApplies a rules file to bank file B (or 'device'), saves to out.\n";
+    cout << "  \t\t\t('push' writes only the changed programs into device)\n";
+    cout << "  h\t\t\tDisplays this help.\n";
+    cout << "  q\t\t\tQuits.\n\n";
+}
 
-    outfile << uchar( 1 ) << uchar( 0 );
-    outfile << uchar( 2 ) << uchar( 0 );
+// 'params [text]': parameter table entries (whose name contains text), with the host copy's value when there is one
+void ListParams( const Command& cmd ) {
+    string_view text = cmd.args.empty() ? string_view() : cmd.args[ 0 ];
+    const uchar* program = ShadowProgram( false );
 
-    length.ui = 96000;
-    outfile << length.b[ 0 ] << length.b[ 1 ] << length.b[ 2 ] << length.b[ 3 ];
+    stringstream s;
+    for( auto& p : xload::params::PARAMS ) {
+        if( p.name.find( text ) == string_view::npos )
+            continue;
 
-    length.ui = 96000 * 2 * 3;
-    outfile << length.b[ 0 ] << length.b[ 1 ] << length.b[ 2 ] << length.b[ 3 ];
+        s << "  " << setw( 8 ) << left << p.name << right << " p" << setw( 3 ) << left << p.index << right << "  "
+          << setw( 3 ) << int( p.min ) << "-" << setw( 3 ) << left << int( p.max ) << right << "  "
+          << ( p.format == xload::params::Format::Char ? "char  " : "number" );
+        if( program )
+            s << "  " << ParamValue( p.index, program[ p.index ] );
 
-    outfile << uchar( 6 ) << uchar( 0 );
+        s << endl;
+    }
 
-    length.ui = 24;
-    outfile << length.b[ 0 ] << length.b[ 1 ] << length.b[ 2 ] << length.b[ 3 ];
+    cout << s.str();
+}
 
-    outfile << "data";
-    outfile << "    ";      // length placeholder
+void ParseBench( const Command& cmd );
+
+// Name, handler, argument count and schema. Initialize serves both as init from default values and as init from a
+// file (load); GetProgramDump both shows the active program and saves it to a file.
+constexpr CommandSpec COMMANDS[] = {
+    { "i",          WithLine<Initialize>,       0, 2,           "ww",   CMD_GROUP },
+    { "d",          GetProgramDump,             0, 1,           "w",    CMD_FORCE | CMD_LABELS | CMD_TAKE | CMD_FILES },
+    { "g",          GetParam,                   1, ARGS_ANY,    "p*",   CMD_FORCE | CMD_LABELS | CMD_TAKE },
+    { "s",          SetParam,                   2, ARGS_ANY,    "pn*",  CMD_PAIRS | CMD_QUEUED | CMD_GROUP | CMD_TAKE },
+    { "queue",      ParamQueueCommand,          0, 1,           "w",    CMD_QUEUED | CMD_TAKE },
+    { "params",     ListParams,                 0, 1,           "w",    CMD_TAKE },
+    { "automate",   Automate,                   1, 1,           "w",    CMD_TAKE | CMD_CONSOLE },
+    { "watch",      Watch,                      0, 3,           "",     CMD_CONSOLE },
+    { "group",      Group,                      0, ARGS_ANY,    "",     0 },
+    { "undo",       Undo,                       0, 1,           "n",    CMD_TAKE },
+    { "redo",       Undo,                       0, 1,           "n",    CMD_TAKE },
+    { "ab",         AB,                         0, 2,           "ww",   CMD_TAKE },
+    { "snap",       Snap,                       1, 1,           "w",    CMD_TAKE },
+    { "history",    History,                    0, 1,           "n",    CMD_TAKE },
+    { "r",          ReadProgram,                1, 1,           "n",    CMD_GROUP },
+    { "w",          WriteProgram,               1, 1,           "n",    0 },
+    { "n",          NameProgram,                0, ARGS_ANY,    "",     CMD_FORCE | CMD_TAKE },
+    { "pipe",       WithLine<PipelineBench>,    0, 1,           "n",    0 },
+    { "parse",      ParseBench,                 0, 1,           "n",    CMD_TAKE },
+    { "batch",      WithLine<Batch>,            0, 2,           "ww",   0 },
+    { "shadow",     WithLine<Shadow>,           0, 1,           "w",    0 },
+    { "*",          SetChannel,                 0, 2,           "nn",   CMD_GROUP },
+    { "t",          LoadTuning,                 1, 1,           "w",    0 },
+    { "wave",       LoadWavetable,              1, 1,           "w",    0 },
+    { "get_bank",   GetBankFile,                1, 1,           "w",    CMD_FILES },
+    { "put_bank",   PutBankFile,                1, 1,           "w",    0 },
+    { "diff_bank",  WithLine<DiffBank>,         2, ARGS_ANY,    "",     CMD_FILES },
+    { "init_bank",  InitBank,                   0, 0,           "",     0 },
+    { "ls",         WithLine<ListPrograms>,     0, ARGS_ANY,    "",     0 },
+    { "lib",        WithLine<Library>,          0, ARGS_ANY,    "",     0 },
+    { "similar",    WithLine<Similar>,          1, ARGS_ANY,    "",     0 },
+    { "query",      WithLine<Query>,            1, ARGS_ANY,    "",     0 },
+    { "xform",      WithLine<Transform>,        2, ARGS_ANY,    "",     CMD_FILES },
+    { ".",          Record,                     0, 3,           "www",  CMD_TAKE | CMD_FILES },
+    { "h",          Help,                       0, 0,           "",     CMD_TAKE },
+    { "q",          nullptr,                    0, 0,           "",     CMD_QUIT | CMD_TAKE },
+};
 
-    Color( 12 );
-    cout << "  Recording... ";
-    Color( 10 );
-    cout << "(hit ESC to finish).\n";
+constexpr const CommandSpec* FindCommand( string_view name ) {
+    for( auto& spec : COMMANDS ) {
+        if( spec.name == name )
+            return &spec;
+    }
 
+    return nullptr;
+}
 
-    // Send 'initialize streaming' and 'start streaming' commands
+constexpr bool UniqueCommands() {
+    for( auto& spec : COMMANDS ) {
+        if( FindCommand( spec.name ) != &spec )
+            return false;
+    }
 
-    uchar cmd = 'e';
-    st = FT_Write( ft_port, &cmd, 1, &len );
-    if( st != FT_OK ) {
-        return;
+    return true;
+}
+
+static_assert( UniqueCommands(), "COMMANDS names must be unique" );
+
+int ProcessLine( string_view line ) {
+
+    // Reused, so its vectors keep their capacity
+    static thread_local Command cmd;
+
+    Tokenize( line, cmd );
+    if( cmd.name.empty() )
+        return 0;
+
+    // '@name command' goes to device group 'name'
+    string_view group;
+    if( cmd.name[ 0 ] == '@' ) {
+        group = cmd.name.substr( 1 );
+        Tokenize( cmd.rest, cmd );
+    }
+
+    const CommandSpec* spec = FindCommand( cmd.name );
+    if( !spec ) {
+        CommandError( ERROR_UNKNOWN_COMMAND );
+        return 0;
+    }
+
+    if( !group.empty() && !( spec->flags & CMD_GROUP ) ) {
+        CommandError( ERROR_GROUP_COMMAND );
+        return 0;
+    }
+
+    if( !CheckArgs( *spec, cmd ) ) {
+        CommandError( ERROR_INVALID_ARGUMENTS );
+        return 0;
+    }
+
+    // While recording, the link carries audio: no reads from the device
+    if( g_take.active && ( !( spec->flags & CMD_TAKE ) || cmd.force ) ) {
+        CommandError( ERROR_RECORDING );
+        return 0;
+    }
+
+    // Queued writes go out first, and stay off the device while the command runs
+    unique_lock<mutex> device;
+    if( g_param_queue.enabled && ( !( spec->flags & CMD_QUEUED ) || !group.empty() ) )
+        device = DrainParams();
+
+    if( spec->flags & CMD_QUIT )
+        return 1;
+
+    g_command_line = line;
+    if( group.empty() )
+        spec->run( cmd );
+    else
+        RunGroup( group, cmd );
+
+    g_command_line = {};
+
+    // Not while the flusher may be writing the host copy
+    if( !g_param_queue.enabled || device )
+        RecordHistory();
+
+    return 0;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// ParseBench
+//
+// 'parse [count]' times 'count' command lines (a mix of g, s, r, d, n, * and ls) through the line parsing ProcessLine()
+// did before COMMANDS, split() and a chain of compares with a second split() in the handler, and through Tokenize()
+// and the table. Parsing only: nothing is run.
+//---------------------------------------------------------------------------------------------------------------------
+uint SplitParse( string s ) {
+    static const char* names[] = { "i", "d", "g", "s", "r", "w", "n", "pipe", "batch", "shadow", "*", "t", "wave",
+                                   "get_bank", "put_bank", "diff_bank", "init_bank", "ls", "lib", "similar", "query",
+                                   "xform", ".", "h", "q" };
+
+    auto elem = split( s, " " );
+    string e = elem[ 0 ].c_str();
+
+    uint found = 0;
+    while( found < size( names ) && e != names[ found ] )
+        found++;
+
+    // The handler splits again and copies each argument to test it
+    uint sum = found;
+    auto args = split( s, " " );
+    for( uint i = 1; i < args.size(); ++i ) {
+        if( is_numeric( string( args[ i ] ) ) )
+            sum += atol( args[ i ].c_str() );
     }
 
-    cmd = 'h';
-    st = FT_Write( ft_port, &cmd, 1, &len );
-    if( st != FT_OK ) {
+    return sum;
+}
+
+uint TableParse( string_view line, Command& cmd ) {
+    Tokenize( line, cmd );
+
+    const CommandSpec* spec = FindCommand( cmd.name );
+    if( !spec || !CheckArgs( *spec, cmd ) )
+        return 0;
+
+    uint sum = uint( spec - COMMANDS );
+    for( uint n : cmd.numbers )
+        sum += n;
+
+    return sum;
+}
+
+void ParseBench( const Command& cmd ) {
+    uint count = cmd.args.empty() ? 1000000 : cmd.numbers[ 0 ];
+    if( count == 0 )
         return;
+
+    const string lines[] = { "g 37", "s 37 120", "s 37 120 38 64 39 0 40 255", "g 1 2 3 4 5 6 7 8 -f", "r 12", "d",
+                             "n Warm Pad", "* 1 2", "ls piano" };
+    const uint LINES = uint( size( lines ) );
+
+    // Results summed into 'checksum', so the loops are not optimized away
+    static volatile uint checksum;
+
+    auto start = chrono::steady_clock::now();
+    for( uint i = 0; i < count; ++i )
+        checksum = checksum + SplitParse( lines[ i % LINES ] );
+    chrono::duration<double, milli> before = chrono::steady_clock::now() - start;
+
+    Command parsed;
+    start = chrono::steady_clock::now();
+    for( uint i = 0; i < count; ++i )
+        checksum = checksum + TableParse( lines[ i % LINES ], parsed );
+    chrono::duration<double, milli> after = chrono::steady_clock::now() - start;
+
+    stringstream s;
+    s << fixed << setprecision( 2 );
+
+    auto report = [ & ]( const string& name, chrono::duration<double, milli> elapsed ) {
+        s << "  " << left << setw( 12 ) << name << right << setw( 9 ) << elapsed.count() << " ms " << setw( 12 )
+          << uint64_t( count * 1000.0 / elapsed.count() ) << " cmd/s" << endl;
+    };
+
+    report( "split", before );
+    report( "table", after );
+    s << "  " << before.count() / after.count() << "x" << endl;
+    cout << s.str();
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Daemon
+//
+// 'XLoad -daemon' keeps the device open and serves the terminal commands to local clients over the named pipe
+// DAEMON_PIPE, and over TCP with '-tcp [address:]port' (loopback; another address only with '-remote', as clients are
+// not authenticated). A request is a command line; its answer is "<errors> <microseconds> <length>\n" and then the
+// command's console output. Every client has its own request queue and the device thread takes one command from each
+// client in turn, so a long script cannot starve an interactive client. Commands that wait for ESC at the console or
+// write files are refused. 'q' closes the connection, 'daemon stop' ends the daemon.
+//---------------------------------------------------------------------------------------------------------------------
+struct DaemonClient {
+    HANDLE pipe = INVALID_HANDLE_VALUE;     // named pipe client, or
+    SOCKET socket = INVALID_SOCKET;         // TCP client
+    deque<string> requests;                 // received, not run yet
+    deque<string> responses;                // run, not sent yet
+    bool closed = false;
+};
+
+struct DaemonState {
+    mutex lock;
+    condition_variable changed;
+    vector<shared_ptr<DaemonClient>> clients;
+    size_t turn = 0;                        // round robin position in 'clients'
+    bool stop = false;
+};
+
+int ClientRead( DaemonClient& client, char* buffer, uint size ) {
+    if( client.pipe != INVALID_HANDLE_VALUE ) {
+        DWORD len;
+        return ::ReadFile( client.pipe, buffer, size, &len, NULL ) ? int( len ) : -1;
+    }
+
+    return recv( client.socket, buffer, int( size ), 0 );
+}
+
+bool ClientWrite( DaemonClient& client, const string& data ) {
+    for( size_t sent = 0; sent < data.size(); ) {
+        int n;
+        if( client.pipe != INVALID_HANDLE_VALUE ) {
+            DWORD len;
+            n = ::WriteFile( client.pipe, &data[ sent ], DWORD( data.size() - sent ), &len, NULL ) ? int( len ) : -1;
+        }
+        else {
+            n = send( client.socket, &data[ sent ], int( data.size() - sent ), 0 );
+        }
+
+        if( n <= 0 )
+            return false;
+
+        sent += n;
     }
 
+    return true;
+}
 
-    uint bytes = 0;
+void CloseClient( DaemonClient& client, bool server ) {
+    if( client.pipe != INVALID_HANDLE_VALUE ) {
+        if( server ) {
+            ::FlushFileBuffers( client.pipe );
+            ::DisconnectNamedPipe( client.pipe );
+        }
 
-    // Main loop
-    //
+        ::CloseHandle( client.pipe );
+        client.pipe = INVALID_HANDLE_VALUE;
+    }
 
-    for( ;; ) {
-        // Samples
-        st = FT_Read( ft_port, buffer, AUDIO_BUFFER, &len );
-        if( st != FT_OK ) {
-            return;
+    if( client.socket != INVALID_SOCKET ) {
+        closesocket( client.socket );
+        client.socket = INVALID_SOCKET;
+    }
+}
+
+// cout while the daemon runs: what a thread writes goes to its capture buffer when it has one, to the console otherwise,
+// so only the device thread's command output reaches the client
+class CommandOutput : public streambuf {
+public:
+    explicit CommandOutput( streambuf* console ) : console( console ) {}
+
+    static inline thread_local streambuf* capture = nullptr;
+
+protected:
+    int overflow( int c ) override { return c == EOF ? 0 : Target()->sputc( char( c ) ); }
+    streamsize xsputn( const char* text, streamsize n ) override { return Target()->sputn( text, n ); }
+    int sync() override { return Target()->pubsync(); }
+
+private:
+    streambuf* Target() const { return capture ? capture : console; }
+
+    streambuf* console;
+};
+
+// Commands clients cannot run: waiting for ESC at the daemon's console would hold the device thread for good, and files
+// would be written wherever a client names them
+bool ClientRefused( string_view line ) {
+    Command cmd;
+    Tokenize( line, cmd );
+    if( !cmd.name.empty() && cmd.name[ 0 ] == '@' )
+        Tokenize( cmd.rest, cmd );
+
+    const CommandSpec* spec = FindCommand( cmd.name );
+    if( !spec )
+        return false;
+
+    auto& args = cmd.args;
+    if( ( spec->flags & CMD_CONSOLE ) || ( cmd.name == "i" && !args.empty() && args[ 0 ] == "--watch" ) )
+        return true;
+
+    if( !( spec->flags & CMD_FILES ) )
+        return false;
+
+    // xform and diff_bank write the bank named after their two operands, besides 'push' and 'base <bank>'
+    if( cmd.name == "xform" || cmd.name == "diff_bank" ) {
+        for( size_t i = 2; i < args.size(); ++i ) {
+            if( cmd.name == "diff_bank" && args[ i ] == "base" )
+                i++;
+            else if( cmd.name == "diff_bank" || args[ i ] != "push" )
+                return true;
+        }
+
+        return false;
+    }
+
+    return !args.empty();
+}
+
+// Runs one command with its console output captured, answer framed for the client
+string RunCaptured( const string& line ) {
+    stringstream output;
+    uint errors = g_command_errors;
+
+    auto start = chrono::steady_clock::now();
+    CommandOutput::capture = output.rdbuf();
+    if( ClientRefused( line ) )
+        CommandError( ERROR_DAEMON_COMMAND );
+    else
+        ProcessLine( line );
+
+    CommandOutput::capture = nullptr;
+    auto elapsed = chrono::duration_cast<chrono::microseconds>( chrono::steady_clock::now() - start );
+
+    string text = output.str();
+
+    stringstream s;
+    s << g_command_errors - errors << " " << elapsed.count() << " " << text.size() << "\n" << text;
+    return s.str();
+}
+
+// Client connection thread: queues the complete lines of each read, sends their answers back together
+void ServeClient( shared_ptr<DaemonState> state, shared_ptr<DaemonClient> client ) {
+    DaemonState& daemon = *state;
+    char buffer[ 4096 ];
+    string partial;
+    bool quit = false;
+
+    while( !quit ) {
+        int n = ClientRead( *client, buffer, sizeof( buffer ) );
+        if( n <= 0 )
+            break;
+
+        partial.append( buffer, n );
+
+        uint count = 0;
+        {
+            lock_guard<mutex> lock( daemon.lock );
+
+            size_t pos;
+            while( !quit && ( pos = partial.find( '\n' ) ) != string::npos ) {
+                string line = partial.substr( 0, pos );
+                partial.erase( 0, pos + 1 );
+
+                if( !line.empty() && line.back() == '\r' )
+                    line.pop_back();
+
+                if( line == "q" )
+                    quit = true;
+                else if( !line.empty() ) {
+                    client->requests.push_back( line );
+                    count++;
+                }
+            }
         }
 
-        assert( len == AUDIO_BUFFER );
+        if( count == 0 )
+            continue;
+
+        daemon.changed.notify_all();
 
-        for( uint i = 0; i < AUDIO_BUFFER; ++i ) {
-            outfile << buffer[ i ];
-            bytes++;
+        string answers;
+        {
+            unique_lock<mutex> lock( daemon.lock );
+            daemon.changed.wait( lock, [ & ] { return client->responses.size() >= count || daemon.stop; } );
+
+            for( ; !client->responses.empty(); client->responses.pop_front() )
+                answers += client->responses.front();
         }
 
-        if( ::GetAsyncKeyState( VK_ESCAPE ) & 0x80000000 ) {
+        if( !ClientWrite( *client, answers ) )
             break;
+    }
+
+    {
+        lock_guard<mutex> lock( daemon.lock );
+        client->closed = true;
+    }
+
+    daemon.changed.notify_all();
+    CloseClient( *client, true );
+}
+
+void AddClient( const shared_ptr<DaemonState>& daemon, shared_ptr<DaemonClient> client ) {
+    {
+        lock_guard<mutex> lock( daemon->lock );
+        daemon->clients.push_back( client );
+    }
+
+    thread( ServeClient, daemon, client ).detach();
+}
+
+void ListenPipe( shared_ptr<DaemonState> daemon, HANDLE pipe ) {
+    for( ;; ) {
+        if( ::ConnectNamedPipe( pipe, NULL ) || ::GetLastError() == ERROR_PIPE_CONNECTED ) {
+            auto client = make_shared<DaemonClient>();
+            client->pipe = pipe;
+            AddClient( daemon, client );
+        }
+        else {
+            ::CloseHandle( pipe );
         }
+
+        // Next instance for the next client
+        pipe = ::CreateNamedPipeA( DAEMON_PIPE, PIPE_ACCESS_DUPLEX, PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                   PIPE_UNLIMITED_INSTANCES, 4096, 4096, 0, NULL );
+        if( pipe == INVALID_HANDLE_VALUE )
+            return;
+    }
+}
+
+void ListenTcp( shared_ptr<DaemonState> daemon, SOCKET listener ) {
+    for( ;; ) {
+        SOCKET s = accept( listener, NULL, NULL );
+        if( s == INVALID_SOCKET )
+            return;
+
+        // Answers are small and latency bound
+        int one = 1;
+        setsockopt( s, IPPROTO_TCP, TCP_NODELAY, (const char*) &one, sizeof( one ) );
+
+        auto client = make_shared<DaemonClient>();
+        client->socket = s;
+        AddClient( daemon, client );
     }
+}
+
+// '[address:]port', address defaults to loopback
+bool ParseEndpoint( const string& endpoint, sockaddr_in& address ) {
+    string host = "127.0.0.1";
+    string port = endpoint;
 
+    size_t colon = endpoint.rfind( ':' );
+    if( colon != string::npos ) {
+        host = endpoint.substr( 0, colon );
+        port = endpoint.substr( colon + 1 );
+    }
 
-    // Finalize file
-    if( outfile.is_open() ) {
-        // Write 'data' chunk length
-        outfile.seekp( 42 );
-        length.ui = bytes;
-        outfile << length.b[ 0 ] << length.b[ 1 ] << length.b[ 2 ] << length.b[ 3 ];
+    if( port.empty() || !is_numeric( port ) )
+        return false;
 
-        // Write 'RIFF' chunk length
-        outfile.seekp( 4 );
-        length.ui += 38;
-        outfile << length.b[ 0 ] << length.b[ 1 ] << length.b[ 2 ] << length.b[ 3 ];
+    memset( &address, 0, sizeof( address ) );
+    address.sin_family = AF_INET;
+    address.sin_port = htons( u_short( atol( port.c_str() ) ) );
+    return inet_pton( AF_INET, host.c_str(), &address.sin_addr ) == 1;
+}
 
-        outfile.close();
+int Daemon( const string& tcp, bool remote ) {
+    // Shared with the detached connection threads, the last one out frees it
+    auto state = make_shared<DaemonState>();
+    DaemonState& daemon = *state;
+
+    // Named pipe: the first instance fails if another daemon serves it
+    HANDLE pipe = ::CreateNamedPipeA( DAEMON_PIPE, PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                                      PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                      PIPE_UNLIMITED_INSTANCES, 4096, 4096, 0, NULL );
+    if( pipe == INVALID_HANDLE_VALUE ) {
+        PrintError( ERROR_DAEMON_RUNNING );
+        return 1;
     }
 
-    // Send terminate_streaming command
-    cmd = 'f';
-    st = FT_Write( ft_port, &cmd, 1, &len );
-    if( st != FT_OK ) {
-        return;
+    // TCP
+    SOCKET listener = INVALID_SOCKET;
+    if( !tcp.empty() ) {
+        WSADATA wsa;
+        sockaddr_in address;
+
+        if( WSAStartup( MAKEWORD( 2, 2 ), &wsa ) == 0 && ParseEndpoint( tcp, address ) )
+            listener = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+
+        // 127.0.0.0/8
+        if( listener != INVALID_SOCKET && ( ntohl( address.sin_addr.s_addr ) >> 24 ) != 127 && !remote ) {
+            closesocket( listener );
+            ::CloseHandle( pipe );
+            PrintError( ERROR_DAEMON_REMOTE );
+            return 1;
+        }
+
+        if( listener == INVALID_SOCKET || ::bind( listener, (sockaddr*) &address, sizeof( address ) ) == SOCKET_ERROR ||
+            listen( listener, SOMAXCONN ) == SOCKET_ERROR ) {
+            ::CloseHandle( pipe );
+            PrintError( ERROR_DAEMON_TCP );
+            return 1;
+        }
+
+        thread( ListenTcp, state, listener ).detach();
     }
 
-    // Flush    
-    CloseDevice();
-    OpenDevice( BAUDRATE, LATENCY_STD );
+    thread( ListenPipe, state, pipe ).detach();
+
+    cout << "  Serving " << DAEMON_PIPE << ( tcp.empty() ? "" : " and " + tcp );
+    cout << ", 'daemon stop' to end." << endl;
+
+    CommandOutput output( cout.rdbuf() );
+    auto console = cout.rdbuf( &output );
+
+    // Device thread: one command per client in turn
+    for( ;; ) {
+        shared_ptr<DaemonClient> client;
+        string line;
+        {
+            unique_lock<mutex> lock( daemon.lock );
+
+            auto& clients = daemon.clients;
+            clients.erase( remove_if( clients.begin(), clients.end(),
+                                      []( const shared_ptr<DaemonClient>& c ) { return c->closed && c->requests.empty(); } ),
+                           clients.end() );
+
+            daemon.changed.wait( lock, [ & ] {
+                for( auto& c : clients )
+                    if( !c->requests.empty() )
+                        return true;
+
+                return false;
+            } );
+
+            size_t n = clients.size();
+            for( size_t k = 0; k < n && !client; ++k ) {
+                size_t i = ( daemon.turn + k ) % n;
+                if( !clients[ i ]->requests.empty() ) {
+                    client = clients[ i ];
+                    daemon.turn = ( i + 1 ) % n;
+                }
+            }
+
+            line = client->requests.front();
+            client->requests.pop_front();
+        }
+
+        string answer;
+        if( line == "daemon stop" )
+            answer = "0 0 0\n";
+        else
+            answer = RunCaptured( line );
+
+        {
+            lock_guard<mutex> lock( daemon.lock );
+            client->responses.push_back( answer );
+            daemon.stop = line == "daemon stop";
+        }
+
+        daemon.changed.notify_all();
 
-    cout << "  done." << endl;
+        if( daemon.stop ) {
+            // Let the client thread send the last answer
+            unique_lock<mutex> lock( daemon.lock );
+            daemon.changed.wait_for( lock, chrono::seconds( 1 ), [ & ] { return client->closed; } );
+            cout.rdbuf( console );
+            return 0;
+        }
+    }
 }
 
 //---------------------------------------------------------------------------------------------------------------------
-// Terminal
+// Client
 //
+// 'XLoad -c [-tcp [host:]port] [-t] [commands]' forwards commands to a running daemon: the command line ones in one
+// request, or stdin lines one at a time. '-t' reports round trip, device and dispatch time.
 //---------------------------------------------------------------------------------------------------------------------
+// Reads one framed answer, returns false when the connection closed
+bool ReadAnswer( DaemonClient& daemon, string& pending, uint& errors, uint64_t& device_us, string& text ) {
+    char buffer[ 4096 ];
 
-// Understands:
-//
-// g <param #>
-// s <param #> <param value>
-// r <prg>
-// w <prg>
-// * <channel1> <channel2>
-// d
-// d <filename>
-// i
-// i <filename>
-// h 
-// q
+    for( ;; ) {
+        size_t header = pending.find( '\n' );
+        if( header != string::npos ) {
+            stringstream s( pending.substr( 0, header ) );
+            size_t size = 0;
+            s >> errors >> device_us >> size;
+
+            if( pending.size() >= header + 1 + size ) {
+                text = pending.substr( header + 1, size );
+                pending.erase( 0, header + 1 + size );
+                return true;
+            }
+        }
 
-int ProcessLine( string s ) {
+        int n = ClientRead( daemon, buffer, sizeof( buffer ) );
+        if( n <= 0 )
+            return false;
 
-    auto elem = split( s, " " );
-    string e = elem[ 0 ].c_str();
+        pending.append( buffer, n );
+    }
+}
 
-    // Initialize serves both as
-    // a) init from default values, and
-    // b) init from external file values (aka 'load program file').
-    if( e == "i" )
-        Initialize( s );
-
-    // GetProgramDump serves both as
-    // a) Get active program values, and
-    // b) Save active program values to file (aka 'save program file).
-    else if( e == "d" )
-        GetProgramDump( s );
-
-    // GetParam and SetParam
-    else if( e == "g" )
-        GetParam( s );
-    else if( e == "s" )
-        SetParam( s );
-
-    // Read from and Write to the EEPROM
-    else if( e == "r" )
-        ReadProgram( s );
-    else if( e == "w" )
-        WriteProgram( s );
-
-    // Get and Set program name
-    else if( e == "n" )
-        NameProgram( s );
-
-    // Get and Set MIDI channel
-    else if( e == "*" )
-        SetChannel( s );
-
-    // Load tuning definition file
-    else if( e == "t" ) {
-        if( elem.size() > 1 ) {
-            CloseDevice();
-            SetFlashDump( elem[ 1 ], BAUDRATE, FLASH_TYPE::TUNING );
-            OpenDevice( BAUDRATE, LATENCY_STD );
+int Client( const string& tcp, const vector<string>& commands, bool timing ) {
+    DaemonClient daemon;
+
+    if( tcp.empty() ) {
+        for( uint attempt = 0; attempt < 2; ++attempt ) {
+            daemon.pipe = ::CreateFileA( DAEMON_PIPE, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL );
+            if( daemon.pipe != INVALID_HANDLE_VALUE || ::GetLastError() != ERROR_PIPE_BUSY )
+                break;
+
+            ::WaitNamedPipeA( DAEMON_PIPE, 2000 );
         }
     }
-
-    // Load wavetable (unused in XVA1, untested)
-    else if( e == "wave" ) {
-        if( elem.size() > 1 ) {
-            CloseDevice();
-            SetFlashDump( elem[ 1 ], BAUDRATE, FLASH_TYPE::WAVETABLE );
-            OpenDevice( BAUDRATE, LATENCY_STD );
+    else {
+        WSADATA wsa;
+        sockaddr_in address;
+        if( WSAStartup( MAKEWORD( 2, 2 ), &wsa ) == 0 && ParseEndpoint( tcp, address ) ) {
+            daemon.socket = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+            if( daemon.socket != INVALID_SOCKET && connect( daemon.socket, (sockaddr*) &address, sizeof( address ) ) == SOCKET_ERROR )
+                CloseClient( daemon, false );
+
+            int one = 1;
+            if( daemon.socket != INVALID_SOCKET )
+                setsockopt( daemon.socket, IPPROTO_TCP, TCP_NODELAY, (const char*) &one, sizeof( one ) );
         }
     }
 
-    // GetBank and PutBank load a whole EEPROM memory file
-    else if( e == "get_bank" ) {
-        if( elem.size() == 2 )
-            GetBank( elem[ 1 ].c_str() );
+    if( daemon.pipe == INVALID_HANDLE_VALUE && daemon.socket == INVALID_SOCKET ) {
+        PrintError( ERROR_DAEMON_CONNECT );
+        return 1;
     }
-    else if( e == "put_bank" ) {
-        if( elem.size() == 2 ) {
-            PutBank( elem[ 1 ].c_str() );
+
+    uint failed = 0;
+    string pending;
+
+    // Sends 'lines' as one request and prints their answers
+    auto run = [ & ]( const vector<string>& lines ) {
+        string request;
+        for( auto& line : lines )
+            request += line + "\n";
+
+        auto start = chrono::steady_clock::now();
+        if( !ClientWrite( daemon, request ) )
+            return false;
+
+        uint64_t device_total = 0;
+        for( uint i = 0; i < lines.size(); ++i ) {
+            uint errors = 0;
+            uint64_t device_us = 0;
+            string text;
+            if( !ReadAnswer( daemon, pending, errors, device_us, text ) )
+                return false;
+
+            cout << text;
+            failed += errors ? 1 : 0;
+            device_total += device_us;
+        }
+
+        if( timing ) {
+            chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+            double device = device_total / 1000.0;
+            cout << "  " << fixed << setprecision( 3 ) << elapsed.count() << " ms round trip, " << device << " ms device, "
+                 << ( elapsed.count() - device ) / lines.size() << " ms dispatch per command." << endl;
         }
+
+        return true;
+    };
+
+    if( !commands.empty() ) {
+        if( !run( commands ) )
+            PrintError( ERROR_DAEMON_CONNECT );
     }
+    else {
+        for( ;; ) {
+            cout << "# ";
 
-    // InitializeBank, inits all EEPROM programs
-    else if( e == "init_bank" ) {
-        InitializeBank();
-        ReadProgram( "r 0" );
+            string s;
+            if( !getline( cin, s ) || s == "q" )
+                break;
+
+            if( s.empty() )
+                continue;
+
+            if( !run( { s } ) ) {
+                PrintError( ERROR_DAEMON_CONNECT );
+                break;
+            }
+        }
     }
 
-    // USB audio recording (experimental)
-    else if( e == "." ) {
-        GetAudioChunk( s );
+    ClientWrite( daemon, "q\n" );
+    CloseClient( daemon, false );
+    return failed ? 1 : 0;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// RunCommands
+//
+// Runs a list of commands in the already open session, timing each. A command that reports an error stops the run
+// unless 'keep_going' is set or its line starts with '-'. Empty lines and lines starting with '#' are skipped.
+// Returns the number of failed commands.
+//---------------------------------------------------------------------------------------------------------------------
+uint RunCommands( const vector<string>& lines, bool keep_going ) {
+    uint run = 0, failed = 0;
+    auto start = chrono::steady_clock::now();
+
+    for( uint n = 0; n < lines.size(); ++n ) {
+        string_view line = lines[ n ];
+        if( !line.empty() && line.back() == '\r' )
+            line.remove_suffix( 1 );
+
+        size_t first = line.find_first_not_of( " \t" );
+        if( first == string_view::npos || line[ first ] == '#' )
+            continue;
+
+        line.remove_prefix( first );
+
+        bool ignore_error = line[ 0 ] == '-';
+        if( ignore_error )
+            line.remove_prefix( 1 );
+
+        cout << "# " << line << endl;
+
+        uint errors = g_command_errors;
+        auto command_start = chrono::steady_clock::now();
+        int quit = ProcessLine( line );
+        chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - command_start;
+
+        run++;
+        bool error = g_command_errors != errors;
+        cout << "  " << fixed << setprecision( 2 ) << elapsed.count() << " ms" << ( error ? ", failed" : "" ) << endl;
+
+        if( error ) {
+            failed++;
+            if( !keep_going && !ignore_error ) {
+                cout << "  Stopped at line " << n + 1 << "." << endl;
+                break;
+            }
+        }
+
+        if( quit )
+            break;
     }
 
-    // Help
-    else if( e == "h" ) {
-        cout << "\n  Commands:\n\n";
-        cout << "  i\t\t\tInitializes program.\n";
-        cout << "  i filename\t\tInitializes program from file (load).\n";
-        cout << "  d\t\t\tShows all parameter values for current program.\n";
-        cout << "  d filename\t\tWrites current program to filename (save).\n";
-        cout << "  g N\t\t\tGets parameter N value.\n";
-        cout << "  s N V\t\t\tSets parameter N to value V.\n";
-        cout << "  r N\t\t\tReads program N.\n";
-        cout << "  w N\t\t\tWrites current program to memory slot N.\n";
-        cout << "  n\t\t\tGets current program name.\n";
-        cout << "  n new name\t\tSets current program name.\n";
-        cout << "  *\t\t\tDisplays current MIDI channel.\n";
-        cout << "  * N\t\t\tSets MIDI channel to N (0 = omni).\n";
-        cout << "  . filename\t\tStarts audio recording.\n";
-        cout << "  t filename\t\tWrites a tuning definition file into device.\n";
-        cout << "  get_bank filename\tReads a program bank from device.\n";
-        cout << "  put_bank filename\tWrites a program bank file into device.\n";
-        cout << "  h\t\t\tDisplays this help.\n";
-        cout << "  q\t\t\tQuits.\n\n";
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    cout << "  " << run << " commands, " << failed << " failed, " << fixed << setprecision( 2 ) << elapsed.count() << " ms." << endl;
+
+    return failed;
+}
+
+// Script file, or stdin for '-'
+bool ReadScript( const string& filename, vector<string>& lines ) {
+    string line;
+
+    if( filename == "-" ) {
+        while( getline( cin, line ) )
+            lines.push_back( line );
+
+        return true;
     }
 
-    else if( e == "q" )
-        return 1;
+    ifstream infile;
+    infile.open( filename, ios::in );
+    if( !infile.is_open() )
+        return false;
 
-    return 0;
+    while( getline( infile, line ) )
+        lines.push_back( line );
+
+    return true;
 }
 
 void Terminal() {
@@ -1335,7 +5901,8 @@ void Terminal() {
         cout << "# ";
 
         string s;
-        getline( cin, s );
+        if( !getline( cin, s ) )
+            return;
 
         if( s.empty() )
             continue;
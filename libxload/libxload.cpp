@@ -0,0 +1,883 @@
+//---------------------------------------------------------------------------------------------------------------------
+// libxload
+//
+// XVA1 device access behind the C ABI declared in libxload.h. Every call returns an xload_status; data goes to and
+// from the caller's buffers. Nothing is printed: progress is reported through callbacks.
+//---------------------------------------------------------------------------------------------------------------------
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstring>
+
+#include "FTDI\ftd2xx.h"    // includes 'windows.h' (namespaced)
+
+#include "libxload.h"
+#include "xload_protocol.hpp"
+
+
+// Defines
+#define LATENCY_RT          0               // realtime (high driver CPU usage)
+#define PIPELINE_DEPTH      64              // default commands in flight, see xload_set_pipeline_depth()
+
+
+// Types
+using namespace std;
+using uchar = unsigned char;
+using uint = unsigned int;
+
+namespace protocol = xload::protocol;
+
+class CommandPipeline;
+
+struct xload_device {
+    FT_HANDLE port = nullptr;
+    string name;                            // description, or serial number with 'open_by' FT_OPEN_BY_SERIAL_NUMBER
+    DWORD open_by = FT_OPEN_BY_DESCRIPTION;
+    uint baudrate = 0;
+    uint latency = 0;
+    uint depth = PIPELINE_DEPTH;
+    HANDLE rx_event = nullptr;              // see xload_set_rx_event(), kept across reopening
+    atomic<bool> streaming = false;         // audio on the link, from xload_audio_start() to xload_audio_stop()
+    unique_ptr<CommandPipeline> pipeline;   // created by the first xload_submit()
+};
+
+
+//---------------------------------------------------------------------------------------------------------------------
+// Version, status text
+//
+//---------------------------------------------------------------------------------------------------------------------
+uint32_t XLOAD_CALL xload_version( void ) {
+    return XLOAD_VERSION;
+}
+
+const char* XLOAD_CALL xload_status_text( xload_status status ) {
+    switch( status ) {
+        case XLOAD_OK:                  return "ok";
+        case XLOAD_ERROR_OPEN:          return "device not found";
+        case XLOAD_ERROR_CONFIG:        return "error setting device";
+        case XLOAD_ERROR_WRITE:         return "error writing to device";
+        case XLOAD_ERROR_READ:          return "error reading from device";
+        case XLOAD_ERROR_REPLY:         return "device reported an error";
+        case XLOAD_ERROR_ARGUMENT:      return "invalid argument";
+        case XLOAD_ERROR_UNSUPPORTED:   return "command has no fixed-size reply";
+        case XLOAD_ERROR_CANCELLED:     return "cancelled";
+        case XLOAD_ERROR_STREAMING:     return "device is streaming audio";
+    }
+
+    return "unknown status";
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Link
+//
+//---------------------------------------------------------------------------------------------------------------------
+static xload_status Write( xload_device* device, const void* data, size_t size ) {
+    DWORD len;
+    FT_STATUS st = FT_Write( device->port, (LPVOID) data, DWORD( size ), &len );
+    return st == FT_OK && len == size ? XLOAD_OK : XLOAD_ERROR_WRITE;
+}
+
+static xload_status ReadPort( xload_device* device, void* data, size_t size ) {
+    DWORD len;
+    FT_STATUS st = FT_Read( device->port, data, DWORD( size ), &len );
+    return st == FT_OK && len == size ? XLOAD_OK : XLOAD_ERROR_READ;
+}
+
+// Replies: none while audio streams, the stream has no room for them and its reader would take them
+static xload_status Read( xload_device* device, void* data, size_t size ) {
+    if( device->streaming )
+        return XLOAD_ERROR_STREAMING;
+
+    return ReadPort( device, data, size );
+}
+
+// Reads one status byte and checks it against 'expected'
+static xload_status ReadCode( xload_device* device, uchar expected ) {
+    uchar code;
+    xload_status st = Read( device, &code, 1 );
+    if( st != XLOAD_OK )
+        return st;
+
+    return code == expected ? XLOAD_OK : XLOAD_ERROR_REPLY;
+}
+
+// Reads the reply to 'request' and checks it as its opcode describes
+template<class Op>
+static xload_status ReadReply( xload_device* device, const uchar* request, uchar* reply ) {
+    if( Op::reply == 0 )
+        return XLOAD_OK;
+
+    xload_status st = Read( device, reply, Op::reply );
+    if( st != XLOAD_OK )
+        return st;
+
+    return Op::Accept( request, reply ) ? XLOAD_OK : XLOAD_ERROR_REPLY;
+}
+
+static xload_status Configure( xload_device* device ) {
+    FT_STATUS st;
+
+    st = FT_SetBaudRate( device->port, device->baudrate );
+    st |= FT_SetDataCharacteristics( device->port, FT_BITS_8, FT_STOP_BITS_1, FT_PARITY_NONE );
+    st |= FT_SetTimeouts( device->port, UINT_MAX, UINT_MAX );
+    st |= FT_SetLatencyTimer( device->port, uchar( device->latency ) );
+    st |= FT_SetUSBParameters( device->port, 4096, 0 );
+
+    return st == FT_OK ? XLOAD_OK : XLOAD_ERROR_CONFIG;
+}
+
+static void ClosePort( xload_device* device ) {
+    if( device->port ) {
+        FT_SetTimeouts( device->port, 100, 100 );
+        FT_Close( device->port );
+        device->port = nullptr;
+    }
+}
+
+// Closing the port drops whatever the driver still buffers, used around audio streaming
+static xload_status Reopen( xload_device* device, uint latency ) {
+    ClosePort( device );
+
+    if( FT_OpenEx( (PVOID) device->name.c_str(), device->open_by, &device->port ) != FT_OK ) {
+        device->port = nullptr;
+        return XLOAD_ERROR_OPEN;
+    }
+
+    uint standard = device->latency;
+    device->latency = latency;
+    xload_status st = Configure( device );
+    device->latency = standard;
+
+    if( st == XLOAD_OK && device->rx_event )
+        FT_SetEventNotification( device->port, FT_EVENT_RXCHAR, device->rx_event );
+
+    return st;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Command pipeline
+//
+// Keeps up to 'depth' commands in flight instead of waiting for each reply before the next write. The device answers
+// strictly in order, so a reader thread takes the replies off the link in submission order, sized and checked by the
+// opcode's descriptor (xload_protocol.hpp), and completes each command. Callbacks run on the reader thread. Only
+// commands with a fixed-size reply can be queued: '}', '>', '$', the audio and the flash streams keep their own
+// handshakes. A reply that fails to read or to check leaves the link out of step, so the pipeline aborts: every command
+// in flight fails, the receive queue is purged, and submits fail until the submitter drains.
+//---------------------------------------------------------------------------------------------------------------------
+
+class CommandPipeline {
+public:
+    CommandPipeline( xload_device* device, uint depth ) : device( device ), depth( depth ? depth : 1 ) {
+        reader = thread( &CommandPipeline::Reader, this );
+    }
+
+    ~CommandPipeline() {
+        Drain();
+
+        {
+            lock_guard<mutex> lock( queue_lock );
+            stop = true;
+        }
+
+        changed.notify_all();
+        reader.join();
+    }
+
+    // 'done' is called exactly once, also when the command cannot be sent
+    xload_status Submit( const uchar* cmd, size_t size, uchar* reply, size_t capacity, xload_reply_fn done, void* user ) {
+        Pending p;
+        p.buffer = reply;
+        p.done = done;
+        p.user = user;
+
+        p.opcode = size ? protocol::Find( cmd[ 0 ] ) : nullptr;
+        if( !p.opcode || !p.opcode->queued || protocol::RequestSize( *p.opcode, cmd, size ) != size )
+            return Fail( p, XLOAD_ERROR_UNSUPPORTED );
+
+        p.reply = p.opcode->reply;
+        memcpy( p.head, cmd, size < sizeof( p.head ) ? size : sizeof( p.head ) );
+
+        if( reply && capacity < p.reply )
+            return Fail( p, XLOAD_ERROR_ARGUMENT );
+
+        // One submitter at a time, so writes and queue entries stay in the same order
+        lock_guard<mutex> submit( submit_lock );
+
+        {
+            unique_lock<mutex> lock( queue_lock );
+            changed.wait( lock, [ & ] { return broken != XLOAD_OK || pending.size() < depth; } );
+            if( broken != XLOAD_OK )
+                return Fail( p, broken );
+        }
+
+        xload_status st = Write( device, cmd, size );
+        if( st != XLOAD_OK )
+            return Fail( p, st );
+
+        {
+            lock_guard<mutex> lock( queue_lock );
+            pending.push_back( p );
+        }
+
+        changed.notify_all();
+        return XLOAD_OK;
+    }
+
+    // Waits for every submitted command to be answered, and takes submits again after an abort
+    void Drain() {
+        unique_lock<mutex> lock( queue_lock );
+        changed.wait( lock, [ & ] { return pending.empty(); } );
+        broken = XLOAD_OK;
+    }
+
+private:
+    struct Pending {
+        const protocol::Descriptor* opcode = nullptr;
+        uchar head[ 4 ] = {};               // first request bytes, for echo checks
+        size_t reply = 0;
+        uchar* buffer = nullptr;            // caller's reply buffer, or null for 'scratch'
+        xload_reply_fn done = nullptr;
+        void* user = nullptr;
+    };
+
+    static xload_status Fail( Pending& p, xload_status st ) {
+        if( p.done )
+            p.done( p.user, st, nullptr, 0 );
+
+        return st;
+    }
+
+    void Reader() {
+        for( ;; ) {
+            unique_lock<mutex> lock( queue_lock );
+            changed.wait( lock, [ & ] { return stop || !pending.empty(); } );
+            if( pending.empty() )
+                return;
+
+            Pending p = pending.front();
+            lock.unlock();
+
+            uchar* data = p.buffer;
+            if( !data && p.reply ) {
+                scratch.resize( p.reply );
+                data = &scratch[ 0 ];
+            }
+
+            xload_status st = p.reply ? Read( device, data, p.reply ) : XLOAD_OK;
+            if( st == XLOAD_OK && p.reply && !protocol::Accept( *p.opcode, p.head, data ) )
+                st = XLOAD_ERROR_REPLY;
+            if( st != XLOAD_OK ) {
+                Abort( st );
+                continue;
+            }
+
+            if( p.done )
+                p.done( p.user, st, data, st == XLOAD_OK ? p.reply : 0 );
+
+            lock.lock();
+            pending.pop_front();
+            lock.unlock();
+
+            changed.notify_all();
+        }
+    }
+
+    // Fails the commands in flight with 'st'. Their replies cannot be told apart from the ones of later commands, so
+    // nothing is written until one latency period has passed and everything received is purged. Submits see 'broken'
+    // first, so the one holding submit_lock lets go; with it held, 'pending' takes no more commands until it is failed
+    // and cleared, and Drain() only returns once every 'done' has run.
+    void Abort( xload_status st ) {
+        {
+            lock_guard<mutex> lock( queue_lock );
+            broken = st;
+        }
+
+        changed.notify_all();
+
+        {
+            lock_guard<mutex> submit( submit_lock );
+            this_thread::sleep_for( chrono::milliseconds( device->latency ) );
+            FT_Purge( device->port, FT_PURGE_RX );
+
+            deque<Pending> failed;
+            {
+                lock_guard<mutex> lock( queue_lock );
+                failed = pending;
+            }
+
+            for( auto& f : failed )
+                Fail( f, st );
+
+            lock_guard<mutex> lock( queue_lock );
+            pending.clear();
+        }
+
+        changed.notify_all();
+    }
+
+    xload_device* device;
+    uint depth;
+    deque<Pending> pending;                 // written, reply not taken yet, oldest first
+    xload_status broken = XLOAD_OK;         // why the pipeline aborted, until the next Drain()
+    vector<uchar> scratch;                  // replies of commands submitted without a buffer
+    mutex queue_lock;
+    mutex submit_lock;
+    condition_variable changed;
+    bool stop = false;
+    thread reader;
+};
+
+// Synchronous calls read the link themselves, so queued commands must be answered first
+static void Drain( xload_device* device ) {
+    if( device->pipeline )
+        device->pipeline->Drain();
+}
+
+xload_status XLOAD_CALL xload_set_pipeline_depth( xload_device* device, uint32_t depth ) {
+    if( !device || depth == 0 )
+        return XLOAD_ERROR_ARGUMENT;
+
+    device->pipeline.reset();
+    device->depth = depth;
+    return XLOAD_OK;
+}
+
+xload_status XLOAD_CALL xload_submit( xload_device* device, const uint8_t* command, size_t size, uint8_t* reply,
+                                      size_t capacity, xload_reply_fn done, void* user ) {
+    if( !device || !command ) {
+        if( done )
+            done( user, XLOAD_ERROR_ARGUMENT, nullptr, 0 );
+
+        return XLOAD_ERROR_ARGUMENT;
+    }
+
+    if( device->streaming ) {
+        if( done )
+            done( user, XLOAD_ERROR_STREAMING, nullptr, 0 );
+
+        return XLOAD_ERROR_STREAMING;
+    }
+
+    if( !device->pipeline )
+        device->pipeline = make_unique<CommandPipeline>( device, device->depth );
+
+    return device->pipeline->Submit( command, size, reply, capacity, done, user );
+}
+
+void XLOAD_CALL xload_drain( xload_device* device ) {
+    if( device )
+        Drain( device );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Device
+//
+//---------------------------------------------------------------------------------------------------------------------
+xload_status XLOAD_CALL xload_list( const char* name, char* serials, size_t size, size_t* count ) {
+    if( !count || ( size && !serials ) )
+        return XLOAD_ERROR_ARGUMENT;
+
+    *count = 0;
+    if( !name )
+        name = XLOAD_DEVICE_NAME;
+
+    DWORD n = 0;
+    if( FT_CreateDeviceInfoList( &n ) != FT_OK )
+        return XLOAD_ERROR_OPEN;
+
+    vector<FT_DEVICE_LIST_INFO_NODE> nodes( n );
+    if( n && FT_GetDeviceInfoList( &nodes[ 0 ], &n ) != FT_OK )
+        return XLOAD_ERROR_OPEN;
+
+    // Attached in driver order; serials that do not fit are counted only
+    for( DWORD i = 0; i < n && i < nodes.size(); ++i ) {
+        if( strcmp( nodes[ i ].Description, name ) != 0 )
+            continue;
+
+        if( ( *count + 1 ) * XLOAD_SERIAL_SIZE <= size ) {
+            char* out = &serials[ *count * XLOAD_SERIAL_SIZE ];
+            memcpy( out, nodes[ i ].SerialNumber, XLOAD_SERIAL_SIZE - 1 );
+            out[ XLOAD_SERIAL_SIZE - 1 ] = 0;
+        }
+
+        ( *count )++;
+    }
+
+    return XLOAD_OK;
+}
+
+static xload_status Open( const char* name, DWORD open_by, uint32_t baudrate, uint32_t latency_ms,
+                          xload_device** device ) {
+    if( !device )
+        return XLOAD_ERROR_ARGUMENT;
+
+    *device = nullptr;
+
+    auto d = make_unique<xload_device>();
+    d->name = name;
+    d->open_by = open_by;
+    d->baudrate = baudrate;
+    d->latency = latency_ms;
+
+    if( FT_OpenEx( (PVOID) d->name.c_str(), d->open_by, &d->port ) != FT_OK )
+        return XLOAD_ERROR_OPEN;
+
+    xload_status st = Configure( d.get() );
+    if( st != XLOAD_OK ) {
+        ClosePort( d.get() );
+        return st;
+    }
+
+    *device = d.release();
+    return XLOAD_OK;
+}
+
+xload_status XLOAD_CALL xload_open( const char* name, uint32_t baudrate, uint32_t latency_ms, xload_device** device ) {
+    return Open( name ? name : XLOAD_DEVICE_NAME, FT_OPEN_BY_DESCRIPTION, baudrate, latency_ms, device );
+}
+
+xload_status XLOAD_CALL xload_open_serial( const char* serial, uint32_t baudrate, uint32_t latency_ms, xload_device** device ) {
+    if( !serial )
+        return XLOAD_ERROR_ARGUMENT;
+
+    return Open( serial, FT_OPEN_BY_SERIAL_NUMBER, baudrate, latency_ms, device );
+}
+
+void XLOAD_CALL xload_close( xload_device* device ) {
+    if( !device )
+        return;
+
+    device->pipeline.reset();
+    ClosePort( device );
+    delete device;
+}
+
+xload_status XLOAD_CALL xload_serial( xload_device* device, char* serial, size_t size ) {
+    if( !device || !serial || size == 0 )
+        return XLOAD_ERROR_ARGUMENT;
+
+    FT_DEVICE type;
+    DWORD id;
+    char number[ 16 ] = {};
+    char description[ 64 ] = {};
+
+    serial[ 0 ] = 0;
+    if( FT_GetDeviceInfo( device->port, &type, &id, number, description, NULL ) != FT_OK )
+        return XLOAD_ERROR_CONFIG;
+
+    if( strlen( number ) >= size )
+        return XLOAD_ERROR_ARGUMENT;
+
+    memcpy( serial, number, strlen( number ) + 1 );
+    return XLOAD_OK;
+}
+
+xload_status XLOAD_CALL xload_write( xload_device* device, const void* data, size_t size ) {
+    if( !device || ( size && !data ) )
+        return XLOAD_ERROR_ARGUMENT;
+
+    Drain( device );
+    return Write( device, data, size );
+}
+
+xload_status XLOAD_CALL xload_read( xload_device* device, void* data, size_t size ) {
+    if( !device || ( size && !data ) )
+        return XLOAD_ERROR_ARGUMENT;
+
+    Drain( device );
+    return ReadPort( device, data, size );
+}
+
+xload_status XLOAD_CALL xload_available( xload_device* device, size_t* size ) {
+    if( !device || !size )
+        return XLOAD_ERROR_ARGUMENT;
+
+    DWORD queued = 0;
+    FT_STATUS st = FT_GetQueueStatus( device->port, &queued );
+    *size = queued;
+    return st == FT_OK ? XLOAD_OK : XLOAD_ERROR_READ;
+}
+
+xload_status XLOAD_CALL xload_set_rx_event( xload_device* device, void* event ) {
+    if( !device )
+        return XLOAD_ERROR_ARGUMENT;
+
+    device->rx_event = (HANDLE) event;
+    FT_STATUS st = FT_SetEventNotification( device->port, event ? FT_EVENT_RXCHAR : 0, event );
+    return st == FT_OK ? XLOAD_OK : XLOAD_ERROR_CONFIG;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Active program
+//
+//---------------------------------------------------------------------------------------------------------------------
+
+// Request encoded by 'Op', then its reply. Nothing goes out while audio streams: the reply would land in the audio.
+template<class Op, class... Args>
+static xload_status Exchange( xload_device* device, uchar* reply, Args... args ) {
+    if( !device )
+        return XLOAD_ERROR_ARGUMENT;
+
+    if( device->streaming )
+        return XLOAD_ERROR_STREAMING;
+
+    Drain( device );
+
+    uchar data[ Op::max_request ];
+    xload_status st = Write( device, data, Op::Encode( data, args... ) );
+    if( st != XLOAD_OK )
+        return st;
+
+    return ReadReply<Op>( device, data, reply );
+}
+
+// Commands answered with a status byte (or an echo)
+template<class Op, class... Args>
+static xload_status Command( xload_device* device, Args... args ) {
+    uchar reply[ Op::reply ];
+    return Exchange<Op>( device, reply, args... );
+}
+
+// Queries go through the pipeline, all in flight at once
+xload_status XLOAD_CALL xload_get_params( xload_device* device, const uint16_t* params, uint8_t* values, size_t count ) {
+    if( !device || ( count && ( !params || !values ) ) )
+        return XLOAD_ERROR_ARGUMENT;
+
+    for( size_t i = 0; i < count; ++i ) {
+        if( params[ i ] >= XLOAD_PROGRAM_SIZE )
+            return XLOAD_ERROR_ARGUMENT;
+    }
+
+    xload_status result = XLOAD_OK;
+    auto done = []( void* user, xload_status st, const uint8_t*, size_t ) {
+        xload_status& result = *(xload_status*) user;
+        if( result == XLOAD_OK )
+            result = st;
+    };
+
+    for( size_t i = 0; i < count; ++i ) {
+        uchar data[ protocol::GetParam::max_request ];
+        size_t n = protocol::GetParam::Encode( data, params[ i ] );
+        if( xload_submit( device, data, n, &values[ i ], 1, done, &result ) != XLOAD_OK )
+            break;
+    }
+
+    Drain( device );
+    return result;
+}
+
+// One write for the whole batch, 's' commands back to back
+xload_status XLOAD_CALL xload_set_params( xload_device* device, const uint16_t* params, const uint8_t* values, size_t count ) {
+    if( !device || ( count && ( !params || !values ) ) )
+        return XLOAD_ERROR_ARGUMENT;
+
+    vector<uchar> data( count * protocol::SetParam::max_request );
+    size_t size = 0;
+    for( size_t i = 0; i < count; ++i ) {
+        if( params[ i ] >= XLOAD_PROGRAM_SIZE )
+            return XLOAD_ERROR_ARGUMENT;
+
+        size += protocol::SetParam::EncodeAt( &data[ size ], params[ i ], values[ i ] );
+    }
+
+    if( size == 0 )
+        return XLOAD_OK;
+
+    Drain( device );
+    return Write( device, &data[ 0 ], size );
+}
+
+xload_status XLOAD_CALL xload_dump_program( xload_device* device, uint8_t* program ) {
+    if( !program )
+        return XLOAD_ERROR_ARGUMENT;
+
+    return Exchange<protocol::DumpProgram>( device, program );
+}
+
+xload_status XLOAD_CALL xload_inject_program( xload_device* device, const uint8_t* program ) {
+    if( !program )
+        return XLOAD_ERROR_ARGUMENT;
+
+    return Command<protocol::InjectProgram>( device, program );
+}
+
+xload_status XLOAD_CALL xload_init_program( xload_device* device ) {
+    return Command<protocol::InitProgram>( device );
+}
+
+xload_status XLOAD_CALL xload_read_program( xload_device* device, uint32_t slot ) {
+    if( slot >= XLOAD_NUM_PROGRAMS )
+        return XLOAD_ERROR_ARGUMENT;
+
+    return Command<protocol::ReadProgram>( device, uchar( slot ) );
+}
+
+xload_status XLOAD_CALL xload_write_program( xload_device* device, uint32_t slot ) {
+    if( slot >= XLOAD_NUM_PROGRAMS )
+        return XLOAD_ERROR_ARGUMENT;
+
+    return Command<protocol::WriteProgram>( device, uchar( slot ) );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// MIDI channel
+//
+//---------------------------------------------------------------------------------------------------------------------
+xload_status XLOAD_CALL xload_get_channel( xload_device* device, uint8_t* channel ) {
+    if( !channel )
+        return XLOAD_ERROR_ARGUMENT;
+
+    return Exchange<protocol::GetChannel>( device, channel );
+}
+
+// Set as '*' 10 or 11 (part), channel; the device echoes the channel
+xload_status XLOAD_CALL xload_set_channel( xload_device* device, uint32_t part, uint32_t channel ) {
+    if( part < 1 || part > 2 || channel > 16 )
+        return XLOAD_ERROR_ARGUMENT;
+
+    return Command<protocol::SetChannel>( device, uchar( part ), uchar( channel ) );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// EEPROM bank
+//
+//---------------------------------------------------------------------------------------------------------------------
+xload_status XLOAD_CALL xload_read_bank( xload_device* device, uint8_t* bank, xload_progress_fn progress, void* user ) {
+    if( !device || !bank )
+        return XLOAD_ERROR_ARGUMENT;
+
+    if( device->streaming )
+        return XLOAD_ERROR_STREAMING;
+
+    Drain( device );
+
+    // Send 'Reset EEPROM byte counter', the whole bank follows
+    uchar cmd[ protocol::ReadBank::max_request ];
+    xload_status st = Write( device, cmd, protocol::ReadBank::Encode( cmd ) );
+    if( st != XLOAD_OK )
+        return st;
+
+    for( uint j = 0; j < XLOAD_NUM_PROGRAMS; ++j ) {
+        st = Read( device, &bank[ j * XLOAD_PROGRAM_SIZE ], XLOAD_PROGRAM_SIZE );
+        if( st != XLOAD_OK )
+            return st;
+
+        if( progress )
+            progress( user, j + 1, XLOAD_NUM_PROGRAMS );
+    }
+
+    return XLOAD_OK;
+}
+
+xload_status XLOAD_CALL xload_write_bank_program( xload_device* device, uint32_t slot, const uint8_t* program ) {
+    if( !program || slot >= XLOAD_NUM_PROGRAMS )
+        return XLOAD_ERROR_ARGUMENT;
+
+    // Send 'WriteProgramToEEPROM' msg and program number, echoed back
+    using Op = protocol::WriteBankProgram;
+    xload_status st = Command<Op>( device, uchar( slot ) );
+    if( st != XLOAD_OK )
+        return st;
+
+    // Four chunks for each program (512 bytes = 128x4)
+    for( uint i = 0; i < Op::chunks; ++i ) {
+        st = Write( device, &program[ i * Op::chunk ], Op::chunk );
+        if( st != XLOAD_OK )
+            return st;
+
+        st = ReadCode( device, Op::chunk_ack );
+        if( st != XLOAD_OK )
+            return st;
+
+        ::Sleep( 20 );
+    }
+
+    return XLOAD_OK;
+}
+
+xload_status XLOAD_CALL xload_erase_bank( xload_device* device, xload_progress_fn progress, void* user ) {
+    if( !device )
+        return XLOAD_ERROR_ARGUMENT;
+
+    if( device->streaming )
+        return XLOAD_ERROR_STREAMING;
+
+    Drain( device );
+
+    uchar cmd[ protocol::EraseBank::max_request ];
+    xload_status st = Write( device, cmd, protocol::EraseBank::Encode( cmd ) );
+    if( st != XLOAD_OK )
+        return st;
+
+    // Twiddle thumbs, the device answers when done
+    const uint TICKS = 128;
+    for( uint i = 0; i < TICKS; ++i ) {
+        ::Sleep( 100 );
+        if( progress )
+            progress( user, i + 1, TICKS );
+    }
+
+    uchar code;
+    return ReadReply<protocol::EraseBank>( device, cmd, &code );
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Flash
+//
+// Erase, then 256-byte pages. Images go through the CMOD_A7_Loader.bit loader, which has the COM set at 500kbps and
+// acks each page; tuning and wavetable data is acked byte by byte. 'progress' is called with 0 once erasing is done.
+//---------------------------------------------------------------------------------------------------------------------
+size_t XLOAD_CALL xload_flash_size( xload_flash_type type ) {
+    switch( type ) {
+        case XLOAD_FLASH_IMAGE:     return 34 * 256 * 256;
+        case XLOAD_FLASH_TUNING:    return 2 * 256 * 256;
+        case XLOAD_FLASH_WAVETABLE: return 12 * 256 * 256;
+    }
+
+    return 0;
+}
+
+template<class F>
+static xload_status FlashUpload( xload_device* device, const uchar* data, size_t flash_size, xload_progress_fn progress,
+                                 void* user, uint32_t* bad_pages ) {
+    // Send full_flash_erase command
+    xload_status st = Command<typename F::EraseOp>( device );
+    if( st != XLOAD_OK )
+        return st;
+
+    // Send full_flash_write command
+    uchar cmd[ F::WriteOp::max_request ];
+    st = Write( device, cmd, F::WriteOp::Encode( cmd ) );
+    if( st != XLOAD_OK )
+        return st;
+
+    uint pages = uint( flash_size / F::page );
+    if( progress )
+        progress( user, 0, pages );
+
+    for( uint i = 0; i < pages; ++i ) {
+        const uchar* page = &data[ i * F::page ];
+        uchar code = F::done;
+
+        if constexpr( F::page_ack ) {
+            // Write first byte (takes longer time to write, as it prepares the page)
+            st = Write( device, page, 1 );
+            if( st != XLOAD_OK )
+                return st;
+
+            // This should be ACK, but the loader is already out so hack it.
+            ::Sleep( F::first_delay_ms );
+
+            st = Write( device, page + 1, F::page - 1 );
+            if( st == XLOAD_OK )
+                st = Read( device, &code, 1 );
+
+            if( st != XLOAD_OK )
+                return st;
+        }
+        else {
+            for( uint j = 0; j < F::page; ++j ) {
+                st = Write( device, &page[ j ], 1 );
+                if( st == XLOAD_OK )
+                    st = ReadCode( device, F::done );
+
+                if( st != XLOAD_OK )
+                    return st;
+            }
+        }
+
+        if( code != F::done && bad_pages )
+            ( *bad_pages )++;
+
+        if( progress )
+            progress( user, i + 1, pages );
+    }
+
+    return ReadCode( device, F::done );
+}
+
+xload_status XLOAD_CALL xload_flash( xload_device* device, xload_flash_type type, const uint8_t* data, size_t size,
+                                     xload_progress_fn progress, void* user, uint32_t* bad_pages ) {
+    size_t flash_size = xload_flash_size( type );
+    if( !device || flash_size == 0 || ( size && !data ) || size > flash_size )
+        return XLOAD_ERROR_ARGUMENT;
+
+    if( device->streaming )
+        return XLOAD_ERROR_STREAMING;
+
+    // Short files are padded with zeros
+    vector<uchar> padded;
+    if( size < flash_size ) {
+        padded.assign( flash_size, 0 );
+        if( size )
+            memcpy( &padded[ 0 ], data, size );
+
+        data = &padded[ 0 ];
+    }
+
+    if( bad_pages )
+        *bad_pages = 0;
+
+    switch( type ) {
+        case XLOAD_FLASH_IMAGE:
+            return FlashUpload<protocol::FlashImage>( device, data, flash_size, progress, user, bad_pages );
+
+        case XLOAD_FLASH_TUNING:
+            return FlashUpload<protocol::FlashTuning>( device, data, flash_size, progress, user, bad_pages );
+
+        case XLOAD_FLASH_WAVETABLE:
+            return FlashUpload<protocol::FlashWavetable>( device, data, flash_size, progress, user, bad_pages );
+    }
+
+    return XLOAD_ERROR_ARGUMENT;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Audio
+//
+// The port is reopened at the realtime latency for streaming, and again at the device's own latency afterwards, which
+// also drops what the driver still buffers.
+//---------------------------------------------------------------------------------------------------------------------
+xload_status XLOAD_CALL xload_audio_start( xload_device* device ) {
+    if( !device )
+        return XLOAD_ERROR_ARGUMENT;
+
+    device->pipeline.reset();
+
+    xload_status st = Reopen( device, LATENCY_RT );
+    if( st != XLOAD_OK )
+        return st;
+
+    // Send 'initialize streaming' and 'start streaming' commands
+    uchar cmd[ protocol::InitAudio::max_request + protocol::StartAudio::max_request ];
+    size_t n = protocol::InitAudio::Encode( cmd );
+    n += protocol::StartAudio::EncodeAt( &cmd[ n ] );
+    st = Write( device, cmd, n );
+    device->streaming = st == XLOAD_OK;
+    return st;
+}
+
+xload_status XLOAD_CALL xload_audio_read( xload_device* device, uint8_t* buffer, size_t size ) {
+    if( !device || !buffer )
+        return XLOAD_ERROR_ARGUMENT;
+
+    return ReadPort( device, buffer, size );
+}
+
+xload_status XLOAD_CALL xload_audio_stop( xload_device* device ) {
+    if( !device )
+        return XLOAD_ERROR_ARGUMENT;
+
+    // Send terminate_streaming command
+    uchar cmd[ protocol::StopAudio::max_request ];
+    xload_status st = Write( device, cmd, protocol::StopAudio::Encode( cmd ) );
+    device->streaming = false;
+
+    xload_status reopened = Reopen( device, device->latency );
+    return st != XLOAD_OK ? st : reopened;
+}
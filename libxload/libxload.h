@@ -0,0 +1,128 @@
+//---------------------------------------------------------------------------------------------------------------------
+// libxload
+//
+// Device access for the XVA1 synthesizer over its FTDI link: programs, parameters, EEPROM bank, flash images and
+// audio streaming. Plain C ABI: opaque device handle, status codes, caller-provided buffers. Functions of one device
+// are called from one thread at a time; xload_submit() queues commands that complete on the library's reader thread.
+// See xload.hpp for the C++ interface, xload_task.hpp for coroutines, xload_protocol.hpp for the wire format,
+// xload_params.hpp for parameter names and ranges, xload_ring.hpp for the shared-memory audio ring.
+//---------------------------------------------------------------------------------------------------------------------
+#ifndef LIBXLOAD_H
+#define LIBXLOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined( _WIN32 )
+#if defined( LIBXLOAD_EXPORTS )
+#define XLOAD_API __declspec( dllexport )
+#else
+#define XLOAD_API __declspec( dllimport )
+#endif
+#define XLOAD_CALL __cdecl
+#else
+#define XLOAD_API
+#define XLOAD_CALL
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define XLOAD_VERSION           0x00020400      // 2.04.00, XLOAD_VERSION >> 16 changes break the ABI
+
+#define XLOAD_PROGRAM_SIZE      512             // bytes (parameters) per program
+#define XLOAD_NUM_PROGRAMS      128             // EEPROM programs
+#define XLOAD_BANK_SIZE         ( XLOAD_NUM_PROGRAMS * XLOAD_PROGRAM_SIZE )
+#define XLOAD_DEVICE_NAME       "Digilent Adept USB Device B"
+#define XLOAD_SERIAL_SIZE       16              // bytes per serial number, with the terminating zero
+
+typedef struct xload_device xload_device;
+
+typedef enum xload_status {
+    XLOAD_OK = 0,
+    XLOAD_ERROR_OPEN,                   // device not found or busy
+    XLOAD_ERROR_CONFIG,                 // setting link parameters failed
+    XLOAD_ERROR_WRITE,                  // link write failed
+    XLOAD_ERROR_READ,                   // link read failed or came short
+    XLOAD_ERROR_REPLY,                  // device answered with an error code
+    XLOAD_ERROR_ARGUMENT,               // invalid argument (parameter, slot, buffer size)
+    XLOAD_ERROR_UNSUPPORTED,            // command cannot be queued (xload_submit)
+    XLOAD_ERROR_CANCELLED,              // stopped by a cancellation token (xload_task.hpp)
+    XLOAD_ERROR_STREAMING               // command has a reply, and the link carries audio
+} xload_status;
+
+typedef enum xload_flash_type {
+    XLOAD_FLASH_IMAGE = 0,              // FPGA image, through the 500 kbps loader
+    XLOAD_FLASH_TUNING = 1,
+    XLOAD_FLASH_WAVETABLE = 2
+} xload_flash_type;
+
+// Progress of long operations: 'done' of 'total' steps
+typedef void ( XLOAD_CALL *xload_progress_fn )( void* user, uint32_t done, uint32_t total );
+
+// Completion of a queued command. 'reply' is the caller's buffer when one was given, else valid during the call only.
+typedef void ( XLOAD_CALL *xload_reply_fn )( void* user, xload_status status, const uint8_t* reply, size_t size );
+
+XLOAD_API uint32_t XLOAD_CALL xload_version( void );
+XLOAD_API const char* XLOAD_CALL xload_status_text( xload_status status );
+
+// Device. Several XVA1 share one description: xload_list() gives their serial numbers (XLOAD_SERIAL_SIZE bytes each,
+// up to 'size' bytes, 'count' set to the number attached), xload_open_serial() opens one of them.
+XLOAD_API xload_status XLOAD_CALL xload_list( const char* name, char* serials, size_t size, size_t* count );
+XLOAD_API xload_status XLOAD_CALL xload_open( const char* name, uint32_t baudrate, uint32_t latency_ms, xload_device** device );
+XLOAD_API xload_status XLOAD_CALL xload_open_serial( const char* serial, uint32_t baudrate, uint32_t latency_ms, xload_device** device );
+XLOAD_API void XLOAD_CALL xload_close( xload_device* device );
+XLOAD_API xload_status XLOAD_CALL xload_serial( xload_device* device, char* serial, size_t size );
+
+// Active program. Parameter reads are pipelined, a parameter batch is one write.
+XLOAD_API xload_status XLOAD_CALL xload_get_params( xload_device* device, const uint16_t* params, uint8_t* values, size_t count );
+XLOAD_API xload_status XLOAD_CALL xload_set_params( xload_device* device, const uint16_t* params, const uint8_t* values, size_t count );
+XLOAD_API xload_status XLOAD_CALL xload_dump_program( xload_device* device, uint8_t* program );
+XLOAD_API xload_status XLOAD_CALL xload_inject_program( xload_device* device, const uint8_t* program );
+XLOAD_API xload_status XLOAD_CALL xload_init_program( xload_device* device );
+XLOAD_API xload_status XLOAD_CALL xload_read_program( xload_device* device, uint32_t slot );
+XLOAD_API xload_status XLOAD_CALL xload_write_program( xload_device* device, uint32_t slot );
+
+// MIDI channel: 'part' 1 or 2, channel 0 (omni) to 16
+XLOAD_API xload_status XLOAD_CALL xload_get_channel( xload_device* device, uint8_t* channel );
+XLOAD_API xload_status XLOAD_CALL xload_set_channel( xload_device* device, uint32_t part, uint32_t channel );
+
+// EEPROM bank
+XLOAD_API xload_status XLOAD_CALL xload_read_bank( xload_device* device, uint8_t* bank, xload_progress_fn progress, void* user );
+XLOAD_API xload_status XLOAD_CALL xload_write_bank_program( xload_device* device, uint32_t slot, const uint8_t* program );
+XLOAD_API xload_status XLOAD_CALL xload_erase_bank( xload_device* device, xload_progress_fn progress, void* user );
+
+// Flash, on a device opened at the loader's baud rate. Data shorter than xload_flash_size() is padded with zeros,
+// 'bad_pages' (optional) counts image pages the loader did not ack.
+XLOAD_API size_t XLOAD_CALL xload_flash_size( xload_flash_type type );
+XLOAD_API xload_status XLOAD_CALL xload_flash( xload_device* device, xload_flash_type type, const uint8_t* data, size_t size,
+                                               xload_progress_fn progress, void* user, uint32_t* bad_pages );
+
+// Audio: 24-bit stereo at 96 kHz, read straight into the caller's buffer. While it streams, one thread reads it and
+// another may send commands without a reply (parameter writes, xload_write()); the others fail with
+// XLOAD_ERROR_STREAMING until xload_audio_stop().
+XLOAD_API xload_status XLOAD_CALL xload_audio_start( xload_device* device );
+XLOAD_API xload_status XLOAD_CALL xload_audio_read( xload_device* device, uint8_t* buffer, size_t size );
+XLOAD_API xload_status XLOAD_CALL xload_audio_stop( xload_device* device );
+
+// Raw link access, for commands the library does not wrap
+XLOAD_API xload_status XLOAD_CALL xload_write( xload_device* device, const void* data, size_t size );
+XLOAD_API xload_status XLOAD_CALL xload_read( xload_device* device, void* data, size_t size );
+
+// Non-blocking reads: bytes already received, and a Win32 event (HANDLE, null to stop) set when more arrive
+XLOAD_API xload_status XLOAD_CALL xload_available( xload_device* device, size_t* size );
+XLOAD_API xload_status XLOAD_CALL xload_set_rx_event( xload_device* device, void* event );
+
+// Pipelined commands: up to 'depth' in flight, answered in order. 'reply' (optional) receives the answer; a status
+// or echo that does not match the command completes with XLOAD_ERROR_REPLY.
+XLOAD_API xload_status XLOAD_CALL xload_set_pipeline_depth( xload_device* device, uint32_t depth );
+XLOAD_API xload_status XLOAD_CALL xload_submit( xload_device* device, const uint8_t* command, size_t size,
+                                                uint8_t* reply, size_t capacity, xload_reply_fn done, void* user );
+XLOAD_API void XLOAD_CALL xload_drain( xload_device* device );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,200 @@
+//---------------------------------------------------------------------------------------------------------------------
+// xload.hpp
+//
+// C++ interface over the libxload C ABI, header only so nothing C++ crosses the DLL boundary. xload::Device owns the
+// handle; Submit() returns a future or completes a callback on the library's reader thread, the *Async() calls run
+// long transfers on a worker thread. A device is driven by one thread at a time: wait for an Async() result before
+// the next call.
+//---------------------------------------------------------------------------------------------------------------------
+#ifndef XLOAD_HPP
+#define XLOAD_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <functional>
+#include <future>
+
+#include "libxload.h"
+
+namespace xload {
+
+using Status = xload_status;
+using Progress = std::function<void( uint32_t done, uint32_t total )>;
+
+struct Reply {
+    Status status = XLOAD_OK;
+    std::vector<uint8_t> data;
+};
+
+inline const char* StatusText( Status status ) {
+    return xload_status_text( status );
+}
+
+// Serial numbers of the attached devices named 'name'
+inline std::vector<std::string> List( const char* name = XLOAD_DEVICE_NAME ) {
+    std::vector<char> serials;
+    size_t count = 0;
+    do {
+        serials.resize( ( count + 4 ) * XLOAD_SERIAL_SIZE );
+        if( xload_list( name, &serials[ 0 ], serials.size(), &count ) != XLOAD_OK )
+            return {};
+    } while( count * XLOAD_SERIAL_SIZE > serials.size() );
+
+    std::vector<std::string> list;
+    for( size_t i = 0; i < count; ++i )
+        list.push_back( &serials[ i * XLOAD_SERIAL_SIZE ] );
+
+    return list;
+}
+
+class Device {
+public:
+    Device() = default;
+    Device( const Device& ) = delete;
+    Device& operator=( const Device& ) = delete;
+
+    Device( Device&& other ) noexcept : device( other.device ) {
+        other.device = nullptr;
+    }
+
+    Device& operator=( Device&& other ) noexcept {
+        if( this != &other ) {
+            Close();
+            device = other.device;
+            other.device = nullptr;
+        }
+        return *this;
+    }
+
+    ~Device() {
+        Close();
+    }
+
+    Status Open( uint32_t baudrate, uint32_t latency_ms, const char* name = XLOAD_DEVICE_NAME ) {
+        Close();
+        return xload_open( name, baudrate, latency_ms, &device );
+    }
+
+    Status OpenSerial( const char* serial, uint32_t baudrate, uint32_t latency_ms ) {
+        Close();
+        return xload_open_serial( serial, baudrate, latency_ms, &device );
+    }
+
+    void Close() {
+        if( device ) {
+            xload_close( device );
+            device = nullptr;
+        }
+    }
+
+    bool IsOpen() const { return device != nullptr; }
+    xload_device* Handle() const { return device; }
+
+    std::string Serial() const {
+        char serial[ 32 ];
+        return xload_serial( device, serial, sizeof( serial ) ) == XLOAD_OK ? serial : "";
+    }
+
+    // Active program
+    Status GetParam( uint16_t param, uint8_t& value ) { return xload_get_params( device, &param, &value, 1 ); }
+    Status GetParams( const uint16_t* params, uint8_t* values, size_t count ) { return xload_get_params( device, params, values, count ); }
+    Status SetParams( const uint16_t* params, const uint8_t* values, size_t count ) { return xload_set_params( device, params, values, count ); }
+    Status SetParam( uint16_t param, uint8_t value ) { return xload_set_params( device, &param, &value, 1 ); }
+    Status DumpProgram( uint8_t* program ) { return xload_dump_program( device, program ); }
+    Status InjectProgram( const uint8_t* program ) { return xload_inject_program( device, program ); }
+    Status InitProgram() { return xload_init_program( device ); }
+    Status ReadProgram( uint32_t slot ) { return xload_read_program( device, slot ); }
+    Status WriteProgram( uint32_t slot ) { return xload_write_program( device, slot ); }
+
+    // MIDI channel
+    Status GetChannel( uint8_t& channel ) { return xload_get_channel( device, &channel ); }
+    Status SetChannel( uint32_t part, uint32_t channel ) { return xload_set_channel( device, part, channel ); }
+
+    // EEPROM bank
+    Status ReadBank( uint8_t* bank, const Progress& progress = {} ) {
+        return xload_read_bank( device, bank, progress ? OnProgress : nullptr, (void*) &progress );
+    }
+
+    Status WriteBankProgram( uint32_t slot, const uint8_t* program ) { return xload_write_bank_program( device, slot, program ); }
+
+    Status EraseBank( const Progress& progress = {} ) {
+        return xload_erase_bank( device, progress ? OnProgress : nullptr, (void*) &progress );
+    }
+
+    // Flash
+    Status Flash( xload_flash_type type, const uint8_t* data, size_t size, const Progress& progress = {}, uint32_t* bad_pages = nullptr ) {
+        return xload_flash( device, type, data, size, progress ? OnProgress : nullptr, (void*) &progress, bad_pages );
+    }
+
+    // Audio
+    Status AudioStart() { return xload_audio_start( device ); }
+    Status AudioRead( uint8_t* buffer, size_t size ) { return xload_audio_read( device, buffer, size ); }
+    Status AudioStop() { return xload_audio_stop( device ); }
+
+    // Raw link
+    Status Write( const void* data, size_t size ) { return xload_write( device, data, size ); }
+    Status Read( void* data, size_t size ) { return xload_read( device, data, size ); }
+    Status Available( size_t& size ) { return xload_available( device, &size ); }
+
+    // Pipelined commands
+    Status SetPipelineDepth( uint32_t depth ) { return xload_set_pipeline_depth( device, depth ); }
+    void Drain() { xload_drain( device ); }
+
+    std::future<Reply> Submit( const uint8_t* cmd, size_t size ) {
+        auto result = new std::promise<Reply>;
+        auto future = result->get_future();
+        xload_submit( device, cmd, size, nullptr, 0, OnReplyPromise, result );
+        return future;
+    }
+
+    Status Submit( const uint8_t* cmd, size_t size, std::function<void( const Reply& )> done ) {
+        auto callback = new std::function<void( const Reply& )>( std::move( done ) );
+        return xload_submit( device, cmd, size, nullptr, 0, OnReplyCallback, callback );
+    }
+
+    // Zero-copy: the reply lands in 'reply', 'done' gets the status only
+    Status Submit( const uint8_t* cmd, size_t size, uint8_t* reply, size_t capacity, std::function<void( Status )> done ) {
+        auto callback = new std::function<void( Status )>( std::move( done ) );
+        return xload_submit( device, cmd, size, reply, capacity, OnStatusCallback, callback );
+    }
+
+    // Long transfers on a worker thread; the buffers must outlive the future
+    std::future<Status> ReadBankAsync( uint8_t* bank, Progress progress = {} ) {
+        return std::async( std::launch::async, [ this, bank, progress ]() { return ReadBank( bank, progress ); } );
+    }
+
+    std::future<Status> FlashAsync( xload_flash_type type, const uint8_t* data, size_t size, Progress progress = {} ) {
+        return std::async( std::launch::async, [ this, type, data, size, progress ]() { return Flash( type, data, size, progress ); } );
+    }
+
+private:
+    static void XLOAD_CALL OnProgress( void* user, uint32_t done, uint32_t total ) {
+        ( *(const Progress*) user )( done, total );
+    }
+
+    // The library calls 'done' exactly once per submit, so each trampoline owns its state
+    static void XLOAD_CALL OnReplyPromise( void* user, Status status, const uint8_t* data, size_t size ) {
+        auto result = (std::promise<Reply>*) user;
+        result->set_value( Reply{ status, std::vector<uint8_t>( data, data + size ) } );
+        delete result;
+    }
+
+    static void XLOAD_CALL OnReplyCallback( void* user, Status status, const uint8_t* data, size_t size ) {
+        auto done = (std::function<void( const Reply& )>*) user;
+        ( *done )( Reply{ status, std::vector<uint8_t>( data, data + size ) } );
+        delete done;
+    }
+
+    static void XLOAD_CALL OnStatusCallback( void* user, Status status, const uint8_t*, size_t ) {
+        auto done = (std::function<void( Status )>*) user;
+        ( *done )( status );
+        delete done;
+    }
+
+    xload_device* device = nullptr;
+};
+
+}
+
+#endif
@@ -0,0 +1,163 @@
+//---------------------------------------------------------------------------------------------------------------------
+// xload_params.hpp
+//
+// Parameter metadata: name, index, accepted range and display format of the program parameters that have a name.
+// Names resolve through a perfect hash computed at compile time, so lookups neither build nor search a map. Indexes
+// without an entry take 0-255 and print as numbers.
+//
+// Only what is known for certain is listed: the 24 characters of the program name. Entries for further parameters go
+// into PARAMS (names unique, lower case); the hash, the index table and the checks follow by themselves.
+//---------------------------------------------------------------------------------------------------------------------
+#ifndef XLOAD_PARAMS_HPP
+#define XLOAD_PARAMS_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include "libxload.h"
+
+namespace xload {
+namespace params {
+
+enum class Format : uint8_t {
+    Number,                                 // decimal
+    Char,                                   // ASCII character
+};
+
+struct Param {
+    std::string_view name;                  // empty for parameters without an entry
+    uint16_t index;
+    uint8_t min;
+    uint8_t max;
+    Format format;
+};
+
+constexpr Param PARAMS[] = {
+    { "name1", 480, 32, 126, Format::Char },
+    { "name2", 481, 32, 126, Format::Char },
+    { "name3", 482, 32, 126, Format::Char },
+    { "name4", 483, 32, 126, Format::Char },
+    { "name5", 484, 32, 126, Format::Char },
+    { "name6", 485, 32, 126, Format::Char },
+    { "name7", 486, 32, 126, Format::Char },
+    { "name8", 487, 32, 126, Format::Char },
+    { "name9", 488, 32, 126, Format::Char },
+    { "name10", 489, 32, 126, Format::Char },
+    { "name11", 490, 32, 126, Format::Char },
+    { "name12", 491, 32, 126, Format::Char },
+    { "name13", 492, 32, 126, Format::Char },
+    { "name14", 493, 32, 126, Format::Char },
+    { "name15", 494, 32, 126, Format::Char },
+    { "name16", 495, 32, 126, Format::Char },
+    { "name17", 496, 32, 126, Format::Char },
+    { "name18", 497, 32, 126, Format::Char },
+    { "name19", 498, 32, 126, Format::Char },
+    { "name20", 499, 32, 126, Format::Char },
+    { "name21", 500, 32, 126, Format::Char },
+    { "name22", 501, 32, 126, Format::Char },
+    { "name23", 502, 32, 126, Format::Char },
+    { "name24", 503, 32, 126, Format::Char },
+};
+
+constexpr size_t COUNT = sizeof( PARAMS ) / sizeof( PARAMS[ 0 ] );
+
+//---------------------------------------------------------------------------------------------------------------------
+// Perfect hash
+//
+// FNV-1a from a seed, into a power-of-two table of at least twice the entries. SEED is the first seed that gives every
+// name its own slot (duplicate names never do: the search gives up and Valid() fails).
+//---------------------------------------------------------------------------------------------------------------------
+constexpr uint32_t Hash( std::string_view name, uint32_t seed ) {
+    uint32_t h = 2166136261u ^ seed;
+    for( char c : name ) {
+        h ^= uint8_t( c );
+        h *= 16777619u;
+    }
+
+    return h ^ ( h >> 15 );
+}
+
+constexpr size_t TableSize( size_t count ) {
+    size_t size = 1;
+    while( size < 2 * count )
+        size *= 2;
+
+    return size;
+}
+
+constexpr size_t SLOTS = TableSize( COUNT );
+
+constexpr bool Separates( uint32_t seed ) {
+    bool used[ SLOTS ] = {};
+    for( auto& p : PARAMS ) {
+        size_t slot = Hash( p.name, seed ) & ( SLOTS - 1 );
+        if( used[ slot ] )
+            return false;
+
+        used[ slot ] = true;
+    }
+
+    return true;
+}
+
+constexpr uint32_t FindSeed() {
+    uint32_t seed = 0;
+    while( seed < 0x10000 && !Separates( seed ) )
+        seed++;
+
+    return seed;
+}
+
+constexpr uint32_t SEED = FindSeed();
+
+// PARAMS position + 1 by hash slot, and by parameter index (0: no entry)
+constexpr std::array<uint16_t, SLOTS> MakeSlots() {
+    std::array<uint16_t, SLOTS> slots{};
+    for( size_t i = 0; i < COUNT; ++i )
+        slots[ Hash( PARAMS[ i ].name, SEED ) & ( SLOTS - 1 ) ] = uint16_t( i + 1 );
+
+    return slots;
+}
+
+constexpr std::array<uint16_t, XLOAD_PROGRAM_SIZE> MakeIndexes() {
+    std::array<uint16_t, XLOAD_PROGRAM_SIZE> indexes{};
+    for( size_t i = 0; i < COUNT; ++i )
+        indexes[ PARAMS[ i ].index ] = uint16_t( i + 1 );
+
+    return indexes;
+}
+
+constexpr std::array<uint16_t, SLOTS> BY_NAME = MakeSlots();
+constexpr std::array<uint16_t, XLOAD_PROGRAM_SIZE> BY_INDEX = MakeIndexes();
+
+// Entry named 'name', or null
+constexpr const Param* Find( std::string_view name ) {
+    uint16_t entry = BY_NAME[ Hash( name, SEED ) & ( SLOTS - 1 ) ];
+    return entry && PARAMS[ entry - 1 ].name == name ? &PARAMS[ entry - 1 ] : nullptr;
+}
+
+// Metadata of parameter 'index' (< XLOAD_PROGRAM_SIZE), a nameless 0-255 number if it has no entry
+constexpr Param Describe( uint16_t index ) {
+    return BY_INDEX[ index ] ? PARAMS[ BY_INDEX[ index ] - 1 ] : Param{ {}, index, 0, 255, Format::Number };
+}
+
+constexpr bool Valid() {
+    for( size_t i = 0; i < COUNT; ++i ) {
+        if( PARAMS[ i ].name.empty() || PARAMS[ i ].index >= XLOAD_PROGRAM_SIZE || PARAMS[ i ].min > PARAMS[ i ].max )
+            return false;
+
+        if( Find( PARAMS[ i ].name ) != &PARAMS[ i ] || BY_INDEX[ PARAMS[ i ].index ] != i + 1 )
+            return false;           // duplicate name or index
+    }
+
+    return true;
+}
+
+static_assert( Valid(), "PARAMS names and indexes must be unique and in range" );
+
+}
+}
+
+#endif
@@ -0,0 +1,273 @@
+//---------------------------------------------------------------------------------------------------------------------
+// xload_protocol.hpp
+//
+// The XVA1 serial protocol, one type per opcode: request layout, encoder, reply length and how the reply is checked.
+// libxload encodes every command through these types, and the command pipeline and the coroutines in xload_task.hpp
+// size and check replies from the same descriptors, so an opcode is described once. Encoders write straight into the
+// caller's buffer without branching; the array overloads check the buffer size at compile time.
+//
+// Parameters above 255 are sent as 255 followed by ( prm - 256 ). The image loader (CMOD_A7_Loader.bit) reuses '{'
+// and '}' for its own erase and write, so its opcodes are kept out of the terminal lookup, see Find().
+//---------------------------------------------------------------------------------------------------------------------
+#ifndef XLOAD_PROTOCOL_HPP
+#define XLOAD_PROTOCOL_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "libxload.h"
+
+namespace xload {
+namespace protocol {
+
+// How the first reply byte is checked
+enum class Check : uint8_t {
+    None,                                   // no reply, or any bytes
+    Code,                                   // equals 'arg' (0 for success)
+    Echo,                                   // equals request byte 'arg'
+};
+
+// Descriptor of one opcode, see the opcode types below
+struct Descriptor {
+    uint8_t op;
+    uint16_t request;                       // request bytes, without a parameter extension
+    bool param;                             // byte 1 is a parameter number, 255 adds a byte
+    uint32_t reply;                         // fixed reply bytes (0: none)
+    Check check;
+    uint8_t arg;                            // Check::Code value, or Check::Echo request byte
+    bool queued;                            // fixed-size exchange that may go through the command pipeline
+};
+
+// Request length of the complete command at 'cmd', 0 while 'size' bytes do not hold one
+constexpr size_t RequestSize( const Descriptor& d, const uint8_t* cmd, size_t size ) {
+    if( size < d.request )
+        return 0;
+
+    size_t n = d.request + ( d.param && cmd[ 1 ] == 255 ? 1 : 0 );
+    return size >= n ? n : 0;
+}
+
+// Whether 'reply' answers 'cmd' with success
+constexpr bool Accept( const Descriptor& d, const uint8_t* cmd, const uint8_t* reply ) {
+    switch( d.check ) {
+        case Check::Code:   return reply[ 0 ] == d.arg;
+        case Check::Echo:   return reply[ 0 ] == cmd[ d.arg ];
+        default:            return true;
+    }
+}
+
+// Opcode byte and a parameter number: 2 or 3 bytes, returns the next free position
+inline size_t EncodeParam( uint8_t* out, uint8_t op, uint16_t prm ) {
+    uint8_t ext = uint8_t( prm >> 8 );      // 0 or 1, prm < XLOAD_PROGRAM_SIZE
+    out[ 0 ] = op;
+    out[ 1 ] = uint8_t( prm ) | uint8_t( 0 - ext );
+    out[ 2 ] = uint8_t( prm );
+    return 2 + ext;
+}
+
+// Base of the opcode types: EncodeAt( out, args... ) writes at most 'max_request' bytes and returns the count, Encode()
+// does the same into an array checked to be large enough
+template<class Self, uint8_t Op, uint16_t Request, uint32_t Reply, Check C = Check::None, uint8_t Arg = 0,
+         bool Queued = true, bool Param = false>
+struct Opcode {
+    static constexpr Descriptor descriptor = { Op, Request, Param, Reply, C, Arg, Queued };
+    static constexpr uint8_t op = Op;
+    static constexpr size_t max_request = Request + ( Param ? 1 : 0 );
+    static constexpr size_t reply = Reply;
+
+    static size_t EncodeAt( uint8_t* out ) {
+        out[ 0 ] = Op;
+        return 1;
+    }
+
+    template<size_t N, class... Args>
+    static size_t Encode( uint8_t ( &out )[ N ], Args... args ) {
+        static_assert( N >= max_request, "buffer too small for the request" );
+        return Self::EncodeAt( &out[ 0 ], args... );
+    }
+
+    static constexpr bool Accept( const uint8_t* cmd, const uint8_t* reply ) {
+        return xload::protocol::Accept( descriptor, cmd, reply );
+    }
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+// Active program
+//---------------------------------------------------------------------------------------------------------------------
+
+// 'g' prm: the value
+struct GetParam : Opcode<GetParam, 'g', 2, 1, Check::None, 0, true, true> {
+    static size_t EncodeAt( uint8_t* out, uint16_t prm ) {
+        return EncodeParam( out, op, prm );
+    }
+};
+
+// 's' prm value: no reply
+struct SetParam : Opcode<SetParam, 's', 3, 0, Check::None, 0, true, true> {
+    static size_t EncodeAt( uint8_t* out, uint16_t prm, uint8_t value ) {
+        size_t n = EncodeParam( out, op, prm );
+        out[ n ] = value;
+        return n + 1;
+    }
+};
+
+// 'd': the whole program
+struct DumpProgram : Opcode<DumpProgram, 'd', 1, XLOAD_PROGRAM_SIZE> {};
+
+// 'j' program: status 0
+struct InjectProgram : Opcode<InjectProgram, 'j', 1 + XLOAD_PROGRAM_SIZE, 1, Check::Code, 0> {
+    static size_t EncodeAt( uint8_t* out, const uint8_t* program ) {
+        out[ 0 ] = op;
+        memcpy( &out[ 1 ], program, XLOAD_PROGRAM_SIZE );
+        return max_request;
+    }
+};
+
+// 'i': status 0
+struct InitProgram : Opcode<InitProgram, 'i', 1, 1, Check::Code, 0> {};
+
+// 'r' slot: EEPROM program to the active one, status 0
+struct ReadProgram : Opcode<ReadProgram, 'r', 2, 1, Check::Code, 0> {
+    static size_t EncodeAt( uint8_t* out, uint8_t slot ) {
+        out[ 0 ] = op;
+        out[ 1 ] = slot;
+        return 2;
+    }
+};
+
+// 'w' slot: active program to EEPROM, status 0
+struct WriteProgram : Opcode<WriteProgram, 'w', 2, 1, Check::Code, 0> {
+    static size_t EncodeAt( uint8_t* out, uint8_t slot ) {
+        out[ 0 ] = op;
+        out[ 1 ] = slot;
+        return 2;
+    }
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+// MIDI channel
+//---------------------------------------------------------------------------------------------------------------------
+
+// '!': the channel
+struct GetChannel : Opcode<GetChannel, '!', 1, 1> {};
+
+// '*' 9+part channel: the channel echoed
+struct SetChannel : Opcode<SetChannel, '*', 3, 1, Check::Echo, 2> {
+    static size_t EncodeAt( uint8_t* out, uint8_t part, uint8_t channel ) {
+        out[ 0 ] = op;
+        out[ 1 ] = uint8_t( 9 + part );
+        out[ 2 ] = channel;
+        return 3;
+    }
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+// EEPROM bank
+//
+// These wait on the EEPROM or stream, so they stay out of the pipeline.
+//---------------------------------------------------------------------------------------------------------------------
+
+// '>': all programs, slot 0 first
+struct ReadBank : Opcode<ReadBank, '>', 1, XLOAD_BANK_SIZE, Check::None, 0, false> {};
+
+// '}' slot: the slot echoed, then 'chunks' of 'chunk' bytes, each acked with 'chunk_ack'
+struct WriteBankProgram : Opcode<WriteBankProgram, '}', 2, 1, Check::Echo, 1, false> {
+    static constexpr size_t chunk = 128;
+    static constexpr size_t chunks = XLOAD_PROGRAM_SIZE / chunk;
+    static constexpr uint8_t chunk_ack = 0x80;
+
+    static size_t EncodeAt( uint8_t* out, uint8_t slot ) {
+        out[ 0 ] = op;
+        out[ 1 ] = slot;
+        return 2;
+    }
+};
+
+// '$': status 0 once every slot is erased
+struct EraseBank : Opcode<EraseBank, '$', 1, 1, Check::Code, 0, false> {};
+
+//---------------------------------------------------------------------------------------------------------------------
+// Audio
+//
+// 'e' then 'h' start the stream, which runs until 'f'.
+//---------------------------------------------------------------------------------------------------------------------
+struct InitAudio : Opcode<InitAudio, 'e', 1, 0, Check::None, 0, false> {};
+struct StartAudio : Opcode<StartAudio, 'h', 1, 0, Check::None, 0, false> {};
+struct StopAudio : Opcode<StopAudio, 'f', 1, 0, Check::None, 0, false> {};
+
+//---------------------------------------------------------------------------------------------------------------------
+// Flash
+//
+// Erase answers 0 when done. Write is followed by 'page'-byte pages: image pages are acked once (the loader takes
+// the first byte of a page on its own, 'first_delay_ms' later), tuning and wavetable bytes one by one with 0; a final
+// 0 ends the upload.
+//---------------------------------------------------------------------------------------------------------------------
+template<uint8_t Erase, uint8_t Write, bool PageAck>
+struct Flash {
+    struct EraseOp : Opcode<EraseOp, Erase, 1, 1, Check::Code, 0, false> {};
+    struct WriteOp : Opcode<WriteOp, Write, 1, 0, Check::None, 0, false> {};
+
+    static constexpr size_t page = 256;
+    static constexpr bool page_ack = PageAck;   // one ack per page, else one per byte
+    static constexpr uint32_t first_delay_ms = 10;
+    static constexpr uint8_t done = 0;          // final reply, and the per-byte ack
+};
+
+using FlashImage = Flash<'{', '}', true>;
+using FlashTuning = Flash<'#', 't', false>;
+using FlashWavetable = Flash<'V', 'v', false>;
+
+// Erase and write opcodes by xload_flash_type
+constexpr Descriptor FLASH[][ 2 ] = {
+    { FlashImage::EraseOp::descriptor, FlashImage::WriteOp::descriptor },
+    { FlashTuning::EraseOp::descriptor, FlashTuning::WriteOp::descriptor },
+    { FlashWavetable::EraseOp::descriptor, FlashWavetable::WriteOp::descriptor },
+};
+
+static_assert( FLASH[ XLOAD_FLASH_IMAGE ][ 0 ].op == '{' && FLASH[ XLOAD_FLASH_TUNING ][ 0 ].op == '#' &&
+               FLASH[ XLOAD_FLASH_WAVETABLE ][ 0 ].op == 'V', "FLASH follows xload_flash_type" );
+static_assert( FlashImage::page == FlashTuning::page && FlashImage::page == FlashWavetable::page, "one page size" );
+
+//---------------------------------------------------------------------------------------------------------------------
+// Lookup
+//
+// Terminal opcodes by first byte, for code that gets commands as bytes (xload_submit()).
+//---------------------------------------------------------------------------------------------------------------------
+constexpr Descriptor TERMINAL[] = {
+    GetParam::descriptor, SetParam::descriptor, DumpProgram::descriptor, InjectProgram::descriptor,
+    InitProgram::descriptor, ReadProgram::descriptor, WriteProgram::descriptor, GetChannel::descriptor,
+    SetChannel::descriptor, ReadBank::descriptor, WriteBankProgram::descriptor, EraseBank::descriptor,
+    InitAudio::descriptor, StartAudio::descriptor, StopAudio::descriptor,
+};
+
+constexpr std::array<uint8_t, 256> MakeIndex() {
+    std::array<uint8_t, 256> index{};
+    for( size_t i = 0; i < sizeof( TERMINAL ) / sizeof( TERMINAL[ 0 ] ); ++i )
+        index[ TERMINAL[ i ].op ] = uint8_t( i + 1 );
+
+    return index;
+}
+
+constexpr std::array<uint8_t, 256> INDEX = MakeIndex();
+
+constexpr const Descriptor* Find( uint8_t op ) {
+    return INDEX[ op ] ? &TERMINAL[ INDEX[ op ] - 1 ] : nullptr;
+}
+
+constexpr bool UniqueOpcodes() {
+    for( auto& d : TERMINAL ) {
+        if( Find( d.op ) != &d )
+            return false;
+    }
+
+    return true;
+}
+
+static_assert( UniqueOpcodes(), "TERMINAL opcodes must be unique" );
+
+}
+}
+
+#endif
@@ -0,0 +1,420 @@
+//---------------------------------------------------------------------------------------------------------------------
+// xload_ring.hpp
+//
+// Live audio for other processes: the recorder publishes the stream into a named shared-memory ring of fixed blocks,
+// readers on the same machine map it and follow it with a cursor of their own. Nothing is locked and the writer never
+// waits on a reader: a reader that falls a whole ring behind is lapped, finds out on its next read and skips ahead.
+// Header only, C++17, Win32 file mappings.
+//
+// Two mappings. The stream, 'name', is mapped read-only by readers (layout little-endian, offsets in bytes):
+//
+//     0   Header      magic 'XLAR', version, block size and count, sample format, table offsets, writer process id
+//                     and state, take epoch and first block, write_seq (blocks published, on its own cache line)
+//   128   seq[count]  64-bit sequence number of the block in each ring position, BUSY while it is being written
+//   data_offset       count blocks of block_size bytes, block n of the stream at ( n % count ) * block_size
+//
+// The reader slots, 'name' + SLOTS, the only memory readers write:
+//
+//     0   Slot[8]     one per reader, 64 bytes each: process id (0: free), cursor (next block it reads), lapped
+//                     (blocks the writer overwrote before the reader had them)
+//
+// Block numbers run on across takes: every take starts at a multiple of count, announced by a new epoch and
+// first_block. A block is read like a seqlock: seq[ n % count ] equals n before and after the copy, or the copy is
+// torn. Readers poll write_seq; at 96 kHz a 384-byte block is 2/3 ms of audio.
+//
+// A process that dies without closing leaves its process id behind. A slot whose reader is gone is taken back, by the
+// writer when it would lap it and by a new reader when no slot is free; a ring whose writer is gone can be written by
+// the next one although its state still says RUNNING.
+//---------------------------------------------------------------------------------------------------------------------
+#ifndef XLOAD_RING_HPP
+#define XLOAD_RING_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <windows.h>
+
+namespace xload {
+namespace ring {
+
+constexpr uint32_t MAGIC = 0x52414C58;              // "XLAR"
+constexpr uint32_t VERSION = 2;
+constexpr uint32_t READERS = 8;
+constexpr uint64_t BUSY = ~uint64_t( 0 );
+constexpr const char* NAME = "Local\\XLoadAudio";
+constexpr const char* SLOTS = ".Slots";             // appended to the ring name
+
+enum State : uint32_t {
+    IDLE = 0,                                       // no take, or the writer is gone
+    RUNNING = 1,
+};
+
+struct alignas( 64 ) Slot {
+    std::atomic<uint32_t> pid;
+    uint32_t reserved;
+    std::atomic<uint64_t> cursor;
+    std::atomic<uint64_t> lapped;
+};
+
+struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;                            // bytes
+    uint32_t block_count;
+    uint32_t sample_rate;
+    uint32_t channels;
+    uint32_t bits;                                  // per sample, packed little-endian
+    uint32_t frame_size;                            // bytes per sample frame
+    uint32_t seq_offset;
+    uint32_t data_offset;
+    uint32_t writer;                                // process id
+    std::atomic<uint32_t> state;
+    std::atomic<uint64_t> epoch;                    // takes started, first_block is valid for it
+    uint64_t first_block;
+    alignas( 64 ) std::atomic<uint64_t> write_seq;
+};
+
+static_assert( std::atomic<uint64_t>::is_always_lock_free, "ring counters are shared between processes" );
+static_assert( offsetof( Header, write_seq ) == 64 && sizeof( Header ) == 128 && sizeof( Slot ) == 64,
+               "Header layout is part of the format" );
+
+constexpr size_t DataOffset( uint32_t block_count ) {
+    return ( sizeof( Header ) + block_count * sizeof( uint64_t ) + 4095 ) & ~size_t( 4095 );
+}
+
+constexpr size_t MappingSize( uint32_t block_size, uint32_t block_count ) {
+    return DataOffset( block_count ) + size_t( block_size ) * block_count;
+}
+
+inline std::string SlotsName( const char* name ) { return std::string( name ) + SLOTS; }
+
+// False once the process has exited. A process of another user cannot be opened and counts as running.
+inline bool Alive( uint32_t pid ) {
+    HANDLE process = OpenProcess( PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid );
+    if( !process )
+        return GetLastError() == ERROR_ACCESS_DENIED;
+
+    DWORD code = 0;
+    bool alive = GetExitCodeProcess( process, &code ) && code == STILL_ACTIVE;
+    CloseHandle( process );
+    return alive;
+}
+
+// Mapped view of a ring, common to both ends
+class View {
+public:
+    View() = default;
+    View( const View& ) = delete;
+    View& operator=( const View& ) = delete;
+    ~View() { Unmap(); }
+
+    bool Mapped() const { return header != nullptr; }
+    const Header& Info() const { return *header; }
+
+protected:
+    // 'access' for the stream; the slots are always writable
+    bool Map( HANDLE mapping, DWORD access, HANDLE slot_mapping ) {
+        this->mapping = mapping;
+        this->slot_mapping = slot_mapping;
+        if( mapping )
+            header = (Header*) MapViewOfFile( mapping, access, 0, 0, 0 );
+        if( slot_mapping )
+            slots = (Slot*) MapViewOfFile( slot_mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0 );
+
+        if( !header || !slots ) {
+            Unmap();
+            return false;
+        }
+
+        return true;
+    }
+
+    void Unmap() {
+        if( header )
+            UnmapViewOfFile( header );
+
+        if( slots )
+            UnmapViewOfFile( slots );
+
+        if( mapping )
+            CloseHandle( mapping );
+
+        if( slot_mapping )
+            CloseHandle( slot_mapping );
+
+        header = nullptr;
+        slots = nullptr;
+        mapping = nullptr;
+        slot_mapping = nullptr;
+    }
+
+    std::atomic<uint64_t>* Seq() const { return (std::atomic<uint64_t>*) ( (uint8_t*) header + header->seq_offset ); }
+    uint8_t* Data() const { return (uint8_t*) header + header->data_offset; }
+
+    HANDLE mapping = nullptr;
+    HANDLE slot_mapping = nullptr;
+    Header* header = nullptr;
+    Slot* slots = nullptr;                          // READERS of them
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+// Writer
+//
+// Write( n, block ) copies block n of the take in. The writer keeps the stream in memory of its own and only copies it
+// here, so nothing a reader does to the ring reaches it.
+//---------------------------------------------------------------------------------------------------------------------
+class Writer : public View {
+public:
+    ~Writer() { Close(); }
+
+    // Creates the ring, or joins one whose readers outlived the last take. Fails if another live process writes to it.
+    bool Open( const char* name, uint32_t block_size, uint32_t block_count, uint32_t sample_rate, uint32_t channels,
+               uint32_t bits ) {
+        size_t size = MappingSize( block_size, block_count );
+        HANDLE h = CreateFileMappingA( INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, DWORD( uint64_t( size ) >> 32 ),
+                                       DWORD( size ), name );
+        bool existed = GetLastError() == ERROR_ALREADY_EXISTS;
+        HANDLE s = nullptr;
+        if( h )
+            s = CreateFileMappingA( INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, DWORD( sizeof( Slot ) * READERS ),
+                                    SlotsName( name ).c_str() );
+        if( !Map( h, FILE_MAP_ALL_ACCESS, s ) )
+            return false;
+
+        Header& hd = *header;
+        if( existed && hd.magic == MAGIC ) {
+            if( hd.version != VERSION || hd.block_size != block_size || hd.block_count != block_count ||
+                ( hd.state == RUNNING && hd.writer != GetCurrentProcessId() && Alive( hd.writer ) ) ) {
+                Unmap();
+                return false;
+            }
+        }
+        else {
+            hd.version = VERSION;
+            hd.block_size = block_size;
+            hd.block_count = block_count;
+            hd.seq_offset = uint32_t( sizeof( Header ) );
+            hd.data_offset = uint32_t( DataOffset( block_count ) );
+            for( uint32_t i = 0; i < block_count; ++i )
+                Seq()[ i ].store( BUSY, std::memory_order_relaxed );
+        }
+
+        hd.sample_rate = sample_rate;
+        hd.channels = channels;
+        hd.bits = bits;
+        hd.frame_size = channels * bits / 8;
+        hd.writer = GetCurrentProcessId();
+
+        // The take starts on a whole lap, so block n of it is at ring position n % count
+        uint64_t seq = hd.write_seq.load( std::memory_order_relaxed );
+        base = ( seq + block_count - 1 ) / block_count * block_count;
+        hd.first_block = base;
+        hd.write_seq.store( base, std::memory_order_relaxed );
+        hd.state.store( RUNNING, std::memory_order_relaxed );
+        hd.magic = MAGIC;
+        hd.epoch.fetch_add( 1, std::memory_order_release );
+        lapped = 0;
+        for( auto& c : checked )
+            c = 0;
+
+        return true;
+    }
+
+    void Close() {
+        if( !header )
+            return;
+
+        header->state.store( IDLE, std::memory_order_release );
+        Unmap();
+    }
+
+    // block_size bytes of block n of the take
+    void Write( uint64_t n, const void* block ) {
+        uint64_t seq = base + n;
+        uint64_t at = seq % header->block_count;
+        Begin( seq );
+        memcpy( Data() + at * header->block_size, block, header->block_size );
+        Seq()[ at ].store( seq, std::memory_order_release );
+        header->write_seq.store( seq + 1, std::memory_order_release );
+    }
+
+    uint32_t Readers() const {
+        uint32_t count = 0;
+        for( uint32_t i = 0; i < READERS; ++i ) {
+            uint32_t pid = slots[ i ].pid.load( std::memory_order_relaxed );
+            count += pid != 0 && Alive( pid );
+        }
+
+        return count;
+    }
+
+    // Blocks readers missed this take, all of them together
+    uint64_t Lapped() const { return lapped; }
+
+private:
+    // Takes the position away from readers; those still on the block it held are lapped by one. A reader found gone
+    // gets its slot freed instead; one found running is not looked at again for a lap.
+    void Begin( uint64_t seq ) {
+        Seq()[ seq % header->block_count ].store( BUSY, std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_release );
+
+        for( uint32_t i = 0; i < READERS; ++i ) {
+            Slot& slot = slots[ i ];
+            uint32_t pid = slot.pid.load( std::memory_order_relaxed );
+            if( !pid || slot.cursor.load( std::memory_order_relaxed ) + header->block_count > seq )
+                continue;
+
+            if( seq >= checked[ i ] ) {
+                if( !Alive( pid ) ) {
+                    slot.pid.compare_exchange_strong( pid, 0 );
+                    continue;
+                }
+
+                checked[ i ] = seq + header->block_count;
+            }
+
+            slot.lapped.fetch_add( 1, std::memory_order_relaxed );
+            lapped++;
+        }
+    }
+
+    uint64_t base = 0;
+    uint64_t lapped = 0;
+    uint64_t checked[ READERS ] = {};               // block up to which each slot's reader is known to run
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+// Reader
+//
+// Read() copies the next block; Peek() and Release() read it in place, Release() telling whether it stayed intact.
+// A new reader starts at the live end. One thread per Reader. The stream is mapped read-only.
+//---------------------------------------------------------------------------------------------------------------------
+enum class Result {
+    Ok,
+    Empty,                                          // nothing new yet
+    Lapped,                                         // the writer overwrote blocks before they were read: skipped
+    Restarted,                                      // a new take began: the cursor moved to its first block
+};
+
+class Reader : public View {
+public:
+    ~Reader() { Close(); }
+
+    bool Open( const char* name = NAME ) {
+        HANDLE h = OpenFileMappingA( FILE_MAP_READ, FALSE, name );
+        HANDLE s = h ? OpenFileMappingA( FILE_MAP_ALL_ACCESS, FALSE, SlotsName( name ).c_str() ) : nullptr;
+        if( !Map( h, FILE_MAP_READ, s ) )
+            return false;
+
+        if( header->magic != MAGIC || header->version != VERSION ) {
+            Unmap();
+            return false;
+        }
+
+        // A free slot, else one whose reader is gone
+        for( int pass = 0; pass < 2; ++pass ) {
+            for( uint32_t i = 0; i < READERS; ++i ) {
+                uint32_t pid = slots[ i ].pid.load( std::memory_order_relaxed );
+                bool wanted = pass == 0 ? pid == 0 : pid != 0 && !Alive( pid );
+                if( !wanted )
+                    continue;
+
+                if( slots[ i ].pid.compare_exchange_strong( pid, GetCurrentProcessId() ) ) {
+                    slot = &slots[ i ];
+                    slot->lapped.store( 0, std::memory_order_relaxed );
+                    epoch = header->epoch.load( std::memory_order_acquire );
+                    Seek( header->write_seq.load( std::memory_order_acquire ) );
+                    return true;
+                }
+            }
+        }
+
+        Unmap();
+        return false;                               // every slot taken
+    }
+
+    void Close() {
+        if( slot )
+            slot->pid.store( 0, std::memory_order_release );
+
+        slot = nullptr;
+        Unmap();
+    }
+
+    size_t BlockSize() const { return header->block_size; }
+    uint64_t Cursor() const { return cursor; }
+    uint64_t Lost() const { return lost; }          // blocks skipped since Open()
+    bool Live() const { return header->state.load( std::memory_order_acquire ) == RUNNING && Alive( header->writer ); }
+
+    Result Read( void* block ) {
+        const uint8_t* data = nullptr;
+        Result r = Peek( data );
+        if( r != Result::Ok )
+            return r;
+
+        memcpy( block, data, header->block_size );
+        return Release() ? Result::Ok : Result::Lapped;
+    }
+
+    Result Peek( const uint8_t*& data ) {
+        uint64_t e = header->epoch.load( std::memory_order_acquire );
+        if( e != epoch ) {
+            epoch = e;
+            Seek( header->first_block );
+            return Result::Restarted;
+        }
+
+        uint64_t written = header->write_seq.load( std::memory_order_acquire );
+        if( cursor >= written )
+            return Result::Empty;
+
+        if( written - cursor >= header->block_count ) {
+            Skip( written );
+            return Result::Lapped;
+        }
+
+        if( Seq()[ cursor % header->block_count ].load( std::memory_order_acquire ) != cursor ) {
+            Skip( written );
+            return Result::Lapped;
+        }
+
+        data = Data() + ( cursor % header->block_count ) * header->block_size;
+        return Result::Ok;
+    }
+
+    bool Release() {
+        std::atomic_thread_fence( std::memory_order_acquire );
+        if( Seq()[ cursor % header->block_count ].load( std::memory_order_relaxed ) != cursor ) {
+            Skip( header->write_seq.load( std::memory_order_acquire ) );
+            return false;
+        }
+
+        Seek( cursor + 1 );
+        return true;
+    }
+
+private:
+    void Seek( uint64_t n ) {
+        cursor = n;
+        slot->cursor.store( n, std::memory_order_release );
+    }
+
+    // Half a ring behind the writer, so the next blocks are not the ones it overwrites
+    void Skip( uint64_t written ) {
+        uint64_t to = written > header->block_count / 2 ? written - header->block_count / 2 : 0;
+        lost += to > cursor ? to - cursor : 1;
+        Seek( to > cursor ? to : cursor + 1 );
+    }
+
+    Slot* slot = nullptr;
+    uint64_t epoch = 0;
+    uint64_t cursor = 0;
+    uint64_t lost = 0;
+};
+
+}
+}
+
+#endif
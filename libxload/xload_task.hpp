@@ -0,0 +1,599 @@
+//---------------------------------------------------------------------------------------------------------------------
+// xload_task.hpp
+//
+// C++20 coroutines over libxload. An Executor runs any number of Task<> coroutines on the calling thread and sleeps in
+// WaitForMultipleObjects on the devices' receive events (xload_set_rx_event), the console, events given to Signal()
+// and its own wake event, so a flash upload, a file read-ahead and a parameter tweak interleave without a thread each.
+// Every wait takes a CancelToken and completes with XLOAD_ERROR_CANCELLED once it is cancelled; Key() turns a key
+// press into one. Reads must fit the driver's receive queue (a program, a bank page or an audio chunk).
+//---------------------------------------------------------------------------------------------------------------------
+#ifndef XLOAD_TASK_HPP
+#define XLOAD_TASK_HPP
+
+#include <coroutine>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <vector>
+#include <windows.h>
+
+#include "xload.hpp"
+#include "xload_protocol.hpp"
+
+namespace xload {
+
+//---------------------------------------------------------------------------------------------------------------------
+// Task
+//
+// Lazy coroutine: starts when awaited (or spawned), resumes its awaiter when done.
+//---------------------------------------------------------------------------------------------------------------------
+template<class T = void>
+class Task;
+
+namespace detail {
+
+struct PromiseBase {
+    std::coroutine_handle<> continuation;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    struct Final {
+        bool await_ready() noexcept { return false; }
+
+        template<class P>
+        std::coroutine_handle<> await_suspend( std::coroutine_handle<P> h ) noexcept {
+            auto next = h.promise().continuation;
+            return next ? next : std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    Final final_suspend() noexcept { return {}; }
+    void unhandled_exception() { std::terminate(); }
+};
+
+}
+
+template<class T>
+class Task {
+public:
+    struct promise_type : detail::PromiseBase {
+        T value{};
+
+        Task get_return_object() { return Task( std::coroutine_handle<promise_type>::from_promise( *this ) ); }
+        void return_value( T v ) { value = std::move( v ); }
+    };
+
+    Task( Task&& other ) noexcept : handle( other.handle ) { other.handle = nullptr; }
+    Task( const Task& ) = delete;
+    ~Task() { if( handle ) handle.destroy(); }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend( std::coroutine_handle<> awaiter ) noexcept {
+        handle.promise().continuation = awaiter;
+        return handle;
+    }
+
+    T await_resume() { return std::move( handle.promise().value ); }
+
+private:
+    friend class Executor;
+    explicit Task( std::coroutine_handle<promise_type> h ) : handle( h ) {}
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+template<>
+class Task<void> {
+public:
+    struct promise_type : detail::PromiseBase {
+        Task get_return_object() { return Task( std::coroutine_handle<promise_type>::from_promise( *this ) ); }
+        void return_void() {}
+    };
+
+    Task( Task&& other ) noexcept : handle( other.handle ) { other.handle = nullptr; }
+    Task( const Task& ) = delete;
+    ~Task() { if( handle ) handle.destroy(); }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend( std::coroutine_handle<> awaiter ) noexcept {
+        handle.promise().continuation = awaiter;
+        return handle;
+    }
+
+    void await_resume() {}
+
+private:
+    friend class Executor;
+    explicit Task( std::coroutine_handle<promise_type> h ) : handle( h ) {}
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+// Cancellation
+//
+// A CancelSource hands out tokens; Cancel() may be called from any thread and wakes the executor it was made for.
+//---------------------------------------------------------------------------------------------------------------------
+class CancelToken {
+public:
+    CancelToken() = default;
+    bool Cancelled() const { return state && state->load(); }
+
+private:
+    friend class CancelSource;
+    explicit CancelToken( std::shared_ptr<std::atomic<bool>> state ) : state( std::move( state ) ) {}
+
+    std::shared_ptr<std::atomic<bool>> state;
+};
+
+class CancelSource {
+public:
+    explicit CancelSource( HANDLE wake = nullptr ) : state( std::make_shared<std::atomic<bool>>( false ) ), wake( wake ) {}
+
+    CancelToken Token() const { return CancelToken( state ); }
+    bool Cancelled() const { return state->load(); }
+
+    void Cancel() {
+        state->store( true );
+        if( wake )
+            ::SetEvent( wake );
+    }
+
+private:
+    std::shared_ptr<std::atomic<bool>> state;
+    HANDLE wake;
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+// Executor
+//
+//---------------------------------------------------------------------------------------------------------------------
+class Executor {
+public:
+    Executor() {
+        wake = ::CreateEventA( NULL, FALSE, FALSE, NULL );
+        console = ::GetStdHandle( STD_INPUT_HANDLE );
+
+        DWORD mode;
+        if( !::GetConsoleMode( console, &mode ) )
+            console = nullptr;              // redirected: no key presses
+    }
+
+    ~Executor() {
+        for( auto& e : rx_events ) {
+            xload_set_rx_event( e.first, nullptr );
+            ::CloseHandle( e.second );
+        }
+
+        ::CloseHandle( wake );
+    }
+
+    Executor( const Executor& ) = delete;
+    Executor& operator=( const Executor& ) = delete;
+
+    CancelSource MakeCancel() const { return CancelSource( wake ); }
+
+    // Starts 'task' on the next Run()
+    void Spawn( Task<void> task ) {
+        ready.push_back( task.handle );
+        roots.push_back( std::move( task ) );
+    }
+
+    // Runs until every spawned task has finished
+    void Run() {
+        for( ;; ) {
+            while( !ready.empty() ) {
+                auto h = ready.front();
+                ready.pop_front();
+                h.resume();
+            }
+
+            for( auto i = roots.begin(); i != roots.end(); ) {
+                if( i->handle.done() )
+                    i = roots.erase( i );
+                else
+                    ++i;
+            }
+
+            if( roots.empty() )
+                return;
+
+            Poll();
+            if( ready.empty() && !Wait() )
+                return;                     // nothing left that could wake a task
+        }
+    }
+
+    // Awaitables, each resuming with a Status
+    //
+
+    struct Awaitable {
+        Executor& executor;
+        std::function<bool( Status& )> poll;   // true once complete, sets the status
+        Status status = XLOAD_OK;
+
+        bool await_ready() { return false; }   // always through Poll(), so one busy task cannot starve the rest
+        void await_suspend( std::coroutine_handle<> h ) { executor.waits.push_back( { poll, &status, h } ); }
+        Status await_resume() { return status; }
+    };
+
+    // Exactly 'size' bytes from the device into 'buffer'
+    Awaitable Read( Device& device, uint8_t* buffer, size_t size, CancelToken token = {} ) {
+        xload_device* d = device.Handle();
+        Watch( d );
+
+        return Awaitable{ *this, [ = ]( Status& st ) {
+            if( token.Cancelled() ) {
+                st = XLOAD_ERROR_CANCELLED;
+                return true;
+            }
+
+            size_t available = 0;
+            st = xload_available( d, &available );
+            if( st != XLOAD_OK )
+                return true;
+
+            if( available < size )
+                return false;
+
+            st = xload_read( d, buffer, size );
+            return true;
+        } };
+    }
+
+    Awaitable Delay( uint32_t ms, CancelToken token = {} ) {
+        auto due = std::chrono::steady_clock::now() + std::chrono::milliseconds( ms );
+        timers.push_back( due );
+
+        return Awaitable{ *this, [ = ]( Status& st ) {
+            st = token.Cancelled() ? XLOAD_ERROR_CANCELLED : XLOAD_OK;
+            return token.Cancelled() || std::chrono::steady_clock::now() >= due;
+        } };
+    }
+
+    // Until 'done' holds, checked whenever other tasks have run
+    Awaitable Until( std::function<bool()> done, CancelToken token = {} ) {
+        return Awaitable{ *this, [ = ]( Status& st ) {
+            st = token.Cancelled() ? XLOAD_ERROR_CANCELLED : XLOAD_OK;
+            return token.Cancelled() || done();
+        } };
+    }
+
+    // Lets the other ready tasks run
+    Awaitable Yield() {
+        return Awaitable{ *this, []( Status& st ) {
+            st = XLOAD_OK;
+            return true;
+        } };
+    }
+
+    // 'event' set; it must be manual-reset, and is left set
+    Awaitable Signal( HANDLE event, CancelToken token = {} ) {
+        signals.push_back( event );
+
+        return Awaitable{ *this, [ =, this ]( Status& st ) {
+            st = token.Cancelled() ? XLOAD_ERROR_CANCELLED : XLOAD_OK;
+            if( !token.Cancelled() && ::WaitForSingleObject( event, 0 ) != WAIT_OBJECT_0 )
+                return false;
+
+            signals.erase( std::find( signals.begin(), signals.end(), event ) );
+            return true;
+        } };
+    }
+
+    // A press of virtual key 'vk' on the console (never, when input is redirected)
+    Awaitable Key( int vk, CancelToken token = {} ) {
+        keys_wanted++;
+        uint64_t since = key_presses.size();
+
+        return Awaitable{ *this, [ =, this ]( Status& st ) {
+            st = token.Cancelled() ? XLOAD_ERROR_CANCELLED : XLOAD_OK;
+            if( token.Cancelled() ) {
+                keys_wanted--;
+                return true;
+            }
+
+            for( size_t i = since; i < key_presses.size(); ++i ) {
+                if( key_presses[ i ] == vk ) {
+                    keys_wanted--;
+                    return true;
+                }
+            }
+
+            return false;
+        } };
+    }
+
+private:
+    struct Waiting {
+        std::function<bool( Status& )> poll;
+        Status* status;
+        std::coroutine_handle<> handle;
+    };
+
+    // Registers the device's receive event the first time a task reads from it
+    void Watch( xload_device* d ) {
+        if( rx_events.count( d ) )
+            return;
+
+        HANDLE e = ::CreateEventA( NULL, FALSE, FALSE, NULL );
+        xload_set_rx_event( d, e );
+        rx_events[ d ] = e;
+    }
+
+    void Poll() {
+        // Busy devices keep tasks ready, so the console is also checked without waiting
+        if( console && keys_wanted && ::WaitForSingleObject( console, 0 ) == WAIT_OBJECT_0 )
+            ReadKeys();
+
+        for( auto i = waits.begin(); i != waits.end(); ) {
+            if( i->poll( *i->status ) ) {
+                ready.push_back( i->handle );
+                i = waits.erase( i );
+            }
+            else
+                ++i;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        for( auto i = timers.begin(); i != timers.end(); ) {
+            if( *i <= now )
+                i = timers.erase( i );
+            else
+                ++i;
+        }
+
+        if( keys_wanted == 0 )
+            key_presses.clear();
+    }
+
+    // Sleeps until a device receives, a key is pressed, a timer is due or a token is cancelled
+    bool Wait() {
+        if( waits.empty() )
+            return false;
+
+        std::vector<HANDLE> handles{ wake };
+        for( auto& e : rx_events )
+            handles.push_back( e.second );
+
+        handles.insert( handles.end(), signals.begin(), signals.end() );
+
+        if( console && keys_wanted )
+            handles.push_back( console );
+
+        DWORD timeout = INFINITE;
+        auto now = std::chrono::steady_clock::now();
+        for( auto& due : timers ) {
+            auto ms = std::chrono::ceil<std::chrono::milliseconds>( due - now ).count();
+            DWORD t = ms > 0 ? DWORD( ms ) : 0;
+            if( t < timeout )
+                timeout = t;
+        }
+
+        DWORD w = ::WaitForMultipleObjects( DWORD( handles.size() ), &handles[ 0 ], FALSE, timeout );
+        if( w == WAIT_OBJECT_0 + handles.size() - 1 && handles.back() == console )
+            ReadKeys();
+
+        return true;
+    }
+
+    void ReadKeys() {
+        INPUT_RECORD records[ 16 ];
+        DWORD count = 0;
+        if( !::GetNumberOfConsoleInputEvents( console, &count ) || count == 0 )
+            return;
+
+        if( !::ReadConsoleInputA( console, records, count < 16 ? count : 16, &count ) )
+            return;
+
+        for( DWORD i = 0; i < count; ++i ) {
+            if( records[ i ].EventType == KEY_EVENT && records[ i ].Event.KeyEvent.bKeyDown )
+                key_presses.push_back( records[ i ].Event.KeyEvent.wVirtualKeyCode );
+        }
+    }
+
+    HANDLE wake;
+    HANDLE console;
+    std::deque<std::coroutine_handle<>> ready;
+    std::list<Task<void>> roots;
+    std::vector<Waiting> waits;
+    std::vector<std::chrono::steady_clock::time_point> timers;
+    std::map<xload_device*, HANDLE> rx_events;
+    std::vector<HANDLE> signals;                // events of Signal() waits
+    std::vector<int> key_presses;               // since the oldest Key() wait
+    uint32_t keys_wanted = 0;
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+// Device operations
+//
+// The handshakes of libxload.cpp, with each reply and pause awaited. Replies the device owes are always taken, so
+// a cancelled flash stops between pages (the loader then waits for a power cycle); bank slots are written whole.
+//---------------------------------------------------------------------------------------------------------------------
+
+// Program into EEPROM 'slot': '}' slot (echoed), four 128-byte chunks each acked with 0x80
+inline Task<Status> WriteBankProgram( Executor& ex, Device& device, uint32_t slot, const uint8_t* program ) {
+    using Op = protocol::WriteBankProgram;
+
+    if( slot >= XLOAD_NUM_PROGRAMS )
+        co_return XLOAD_ERROR_ARGUMENT;
+
+    uint8_t data[ Op::max_request ], code;
+    Status st = device.Write( data, Op::Encode( data, uint8_t( slot ) ) );
+    if( st == XLOAD_OK )
+        st = co_await ex.Read( device, &code, 1 );
+
+    if( st != XLOAD_OK )
+        co_return st;
+
+    if( !Op::Accept( data, &code ) )
+        co_return XLOAD_ERROR_REPLY;
+
+    for( uint32_t i = 0; i < Op::chunks; ++i ) {
+        st = device.Write( &program[ i * Op::chunk ], Op::chunk );
+        if( st == XLOAD_OK )
+            st = co_await ex.Read( device, &code, 1 );
+
+        if( st != XLOAD_OK )
+            co_return st;
+
+        if( code != Op::chunk_ack )
+            co_return XLOAD_ERROR_REPLY;
+
+        co_await ex.Delay( 20 );
+    }
+
+    co_return XLOAD_OK;
+}
+
+namespace detail {
+
+template<class F>
+Task<Status> FlashUpload( Executor& ex, Device& device, const uint8_t* data, size_t size, Progress progress,
+                          CancelToken token, const size_t* ready, uint32_t* bad_pages ) {
+    uint8_t cmd[ F::EraseOp::max_request ], code;
+
+    if( token.Cancelled() )
+        co_return XLOAD_ERROR_CANCELLED;
+
+    // Erase, then write command
+    Status st = device.Write( cmd, F::EraseOp::Encode( cmd ) );
+    if( st == XLOAD_OK )
+        st = co_await ex.Read( device, &code, 1 );
+
+    if( st != XLOAD_OK )
+        co_return st;
+
+    if( !F::EraseOp::Accept( cmd, &code ) )
+        co_return XLOAD_ERROR_REPLY;
+
+    st = device.Write( cmd, F::WriteOp::Encode( cmd ) );
+    if( st != XLOAD_OK )
+        co_return st;
+
+    uint32_t pages = uint32_t( size / F::page );
+    if( progress )
+        progress( 0, pages );
+
+    for( uint32_t i = 0; i < pages; ++i ) {
+        const uint8_t* page = &data[ i * F::page ];
+
+        if( ready && *ready < ( i + 1 ) * F::page ) {
+            st = co_await ex.Until( [ = ]() { return *ready >= ( i + 1 ) * F::page; }, token );
+            if( st != XLOAD_OK )
+                co_return st;
+        }
+
+        if( token.Cancelled() )
+            co_return XLOAD_ERROR_CANCELLED;
+
+        if constexpr( F::page_ack ) {
+            // First byte prepares the page, the loader does not ack it
+            st = device.Write( page, 1 );
+            if( st != XLOAD_OK )
+                co_return st;
+
+            co_await ex.Delay( F::first_delay_ms );
+
+            st = device.Write( page + 1, F::page - 1 );
+            if( st == XLOAD_OK )
+                st = co_await ex.Read( device, &code, 1 );
+
+            if( st != XLOAD_OK )
+                co_return st;
+
+            if( code != F::done && bad_pages )
+                ( *bad_pages )++;
+        }
+        else {
+            for( size_t j = 0; j < F::page; ++j ) {
+                st = device.Write( &page[ j ], 1 );
+                if( st == XLOAD_OK )
+                    st = co_await ex.Read( device, &code, 1 );
+
+                if( st != XLOAD_OK )
+                    co_return st;
+
+                if( code != F::done )
+                    co_return XLOAD_ERROR_REPLY;
+            }
+        }
+
+        if( progress )
+            progress( i + 1, pages );
+    }
+
+    st = co_await ex.Read( device, &code, 1 );
+    if( st != XLOAD_OK )
+        co_return st;
+
+    co_return code == F::done ? XLOAD_OK : XLOAD_ERROR_REPLY;
+}
+
+}
+
+// Flash upload, as xload_flash(). With 'ready', pages are sent as the caller fills 'data' up to *ready bytes;
+// 'bad_pages' (optional) counts image pages the loader did not ack.
+inline Task<Status> Flash( Executor& ex, Device& device, xload_flash_type type, const uint8_t* data, size_t size,
+                           Progress progress = {}, CancelToken token = {}, const size_t* ready = nullptr,
+                           uint32_t* bad_pages = nullptr ) {
+    size_t flash_size = xload_flash_size( type );
+    if( flash_size == 0 || size != flash_size )
+        co_return XLOAD_ERROR_ARGUMENT;
+
+    if( bad_pages )
+        *bad_pages = 0;
+
+    Status st = XLOAD_ERROR_ARGUMENT;
+    switch( type ) {
+        case XLOAD_FLASH_IMAGE:
+            st = co_await detail::FlashUpload<protocol::FlashImage>( ex, device, data, size, progress, token, ready,
+                                                                     bad_pages );
+            break;
+
+        case XLOAD_FLASH_TUNING:
+            st = co_await detail::FlashUpload<protocol::FlashTuning>( ex, device, data, size, progress, token, ready,
+                                                                      bad_pages );
+            break;
+
+        case XLOAD_FLASH_WAVETABLE:
+            st = co_await detail::FlashUpload<protocol::FlashWavetable>( ex, device, data, size, progress, token, ready,
+                                                                         bad_pages );
+            break;
+    }
+
+    co_return st;
+}
+
+// Audio stream into 'sink', chunk by chunk, until cancelled (which is not an error here)
+inline Task<Status> Capture( Executor& ex, Device& device, uint8_t* chunk, size_t size,
+                             std::function<void( const uint8_t*, size_t )> sink, CancelToken token ) {
+    Status st = device.AudioStart();
+    if( st != XLOAD_OK )
+        co_return st;
+
+    for( ;; ) {
+        st = co_await ex.Read( device, chunk, size, token );
+        if( st != XLOAD_OK )
+            break;
+
+        sink( chunk, size );
+    }
+
+    Status stopped = device.AudioStop();
+    co_return st == XLOAD_ERROR_CANCELLED ? stopped : st;
+}
+
+}
+
+#endif